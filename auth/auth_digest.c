@@ -480,10 +480,12 @@ serf__validate_response_digest_auth(const serf__authn_scheme_t *scheme,
     /* Need a copy cuz we're going to write NUL characters into the string.  */
     if (peer == HOST)
         auth_attr = apr_pstrdup(pool,
-            serf_bucket_headers_get(hdrs, "Authentication-Info"));
+            serf__bucket_headers_get_token(hdrs,
+                                           SERF__HDR_AUTHENTICATION_INFO));
     else
         auth_attr = apr_pstrdup(pool,
-            serf_bucket_headers_get(hdrs, "Proxy-Authentication-Info"));
+            serf__bucket_headers_get_token(hdrs,
+                                           SERF__HDR_PROXY_AUTHENTICATION_INFO));
 
     /* If there's no Authentication-Info header there's nothing to validate. */
     if (! auth_attr)
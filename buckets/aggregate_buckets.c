@@ -17,16 +17,19 @@
 #include "serf_bucket_util.h"
 
 
-/* Should be an APR_RING? */
-typedef struct bucket_list {
-    serf_bucket_t *bucket;
-    struct bucket_list *next;
-} bucket_list_t;
+/* Capacity of the ring when the first bucket is added. Must be a power
+   of two. */
+#define INITIAL_RING_SIZE 8
 
 typedef struct {
-    bucket_list_t *list; /* active buckets */
-    bucket_list_t *last; /* last bucket of the list */
-    bucket_list_t *done; /* we finished reading this; now pending a destroy */
+    /* Ring of bucket pointers, RING_SIZE entries (a power of two). Starting
+       at FIRST it holds NDONE buckets we finished reading, now pending a
+       destroy, followed by NACTIVE buckets still to be read. */
+    serf_bucket_t **ring;
+    int ring_size;
+    int first;
+    int ndone;
+    int nactive;
 
     serf_bucket_aggregate_eof_t hold_open;
     void *hold_open_baton;
@@ -36,24 +39,63 @@ typedef struct {
 } aggregate_context_t;
 
 
+/* The I'th active bucket. */
+#define ACTIVE(ctx, i) \
+    ((ctx)->ring[((ctx)->first + (ctx)->ndone + (i)) & ((ctx)->ring_size - 1)])
+
 static void cleanup_aggregate(aggregate_context_t *ctx,
                               serf_bucket_alloc_t *allocator)
 {
-    bucket_list_t *next_list;
+    int i;
 
     /* If we finished reading a bucket during the previous read, then
      * we can now toss that bucket.
      */
-    while (ctx->done != NULL) {
-        next_list = ctx->done->next;
-
-        if (ctx->bucket_owner) {
-            serf_bucket_destroy(ctx->done->bucket);
+    if (ctx->bucket_owner) {
+        for (i = 0; i < ctx->ndone; i++) {
+            serf_bucket_destroy(
+                ctx->ring[(ctx->first + i) & (ctx->ring_size - 1)]);
         }
-        serf_bucket_mem_free(allocator, ctx->done);
-
-        ctx->done = next_list;
     }
+
+    ctx->first = ctx->nactive ? (ctx->first + ctx->ndone)
+                                & (ctx->ring_size - 1)
+                              : 0;
+    ctx->ndone = 0;
+}
+
+/* Make room for one more bucket in the ring. */
+static void grow_ring(aggregate_context_t *ctx,
+                      serf_bucket_alloc_t *allocator)
+{
+    serf_bucket_t **ring;
+    int size;
+    int used = ctx->ndone + ctx->nactive;
+    int i;
+
+    if (used < ctx->ring_size)
+        return;
+
+    size = ctx->ring_size ? ctx->ring_size * 2 : INITIAL_RING_SIZE;
+    ring = serf_bucket_mem_alloc(allocator, size * sizeof(*ring));
+
+    /* Unwrap the entries to the start of the new ring. */
+    for (i = 0; i < used; i++)
+        ring[i] = ctx->ring[(ctx->first + i) & (ctx->ring_size - 1)];
+
+    if (ctx->ring)
+        serf_bucket_mem_free(allocator, ctx->ring);
+
+    ctx->ring = ring;
+    ctx->ring_size = size;
+    ctx->first = 0;
+}
+
+/* The head bucket was read to its end; keep it until the next read. */
+static void retire_head(aggregate_context_t *ctx)
+{
+    ctx->ndone++;
+    ctx->nactive--;
 }
 
 void serf_bucket_aggregate_cleanup(
@@ -70,9 +112,11 @@ static aggregate_context_t *create_aggregate(serf_bucket_alloc_t *allocator)
 
     ctx = serf_bucket_mem_alloc(allocator, sizeof(*ctx));
 
-    ctx->list = NULL;
-    ctx->last = NULL;
-    ctx->done = NULL;
+    ctx->ring = NULL;
+    ctx->ring_size = 0;
+    ctx->first = 0;
+    ctx->ndone = 0;
+    ctx->nactive = 0;
     ctx->hold_open = NULL;
     ctx->hold_open_baton = NULL;
     ctx->bucket_owner = 1;
@@ -109,18 +153,15 @@ serf_bucket_t *serf__bucket_stream_create(
 static void serf_aggregate_destroy_and_data(serf_bucket_t *bucket)
 {
     aggregate_context_t *ctx = bucket->data;
-    bucket_list_t *next_ctx;
 
-    while (ctx->list) {
-        if (ctx->bucket_owner) {
-            serf_bucket_destroy(ctx->list->bucket);
-        }
-        next_ctx = ctx->list->next;
-        serf_bucket_mem_free(bucket->allocator, ctx->list);
-        ctx->list = next_ctx;
-    }
+    /* Retire all active buckets, and destroy them with the done ones. */
+    ctx->ndone += ctx->nactive;
+    ctx->nactive = 0;
     cleanup_aggregate(ctx, bucket->allocator);
 
+    if (ctx->ring)
+        serf_bucket_mem_free(bucket->allocator, ctx->ring);
+
     serf_default_destroy_and_data(bucket);
 }
 
@@ -142,14 +183,20 @@ void serf_bucket_aggregate_prepend(
     serf_bucket_t *prepend_bucket)
 {
     aggregate_context_t *ctx = aggregate_bucket->data;
-    bucket_list_t *new_list;
+    int mask;
 
-    new_list = serf_bucket_mem_alloc(aggregate_bucket->allocator,
-                                     sizeof(*new_list));
-    new_list->bucket = prepend_bucket;
-    new_list->next = ctx->list;
+    grow_ring(ctx, aggregate_bucket->allocator);
+    mask = ctx->ring_size - 1;
 
-    ctx->list = new_list;
+    /* The new bucket goes in front of the active ones, which is where the
+       last done bucket lives. The order of the done buckets doesn't matter,
+       so move that one to the free slot in front of the ring. */
+    ctx->first = (ctx->first - 1) & mask;
+    if (ctx->ndone) {
+        ctx->ring[ctx->first] = ctx->ring[(ctx->first + ctx->ndone) & mask];
+    }
+    ctx->ring[(ctx->first + ctx->ndone) & mask] = prepend_bucket;
+    ctx->nactive++;
 }
 
 void serf_bucket_aggregate_append(
@@ -157,25 +204,11 @@ void serf_bucket_aggregate_append(
     serf_bucket_t *append_bucket)
 {
     aggregate_context_t *ctx = aggregate_bucket->data;
-    bucket_list_t *new_list;
-
-    new_list = serf_bucket_mem_alloc(aggregate_bucket->allocator,
-                                     sizeof(*new_list));
-    new_list->bucket = append_bucket;
-    new_list->next = NULL;
-
-    /* If we use APR_RING, this is trivial.  So, wait.
-    new_list->next = ctx->list;
-    ctx->list = new_list;
-    */
-    if (ctx->list == NULL) {
-        ctx->list = new_list;
-        ctx->last = new_list;
-    }
-    else {
-        ctx->last->next = new_list;
-        ctx->last = ctx->last->next;
-    }
+
+    grow_ring(ctx, aggregate_bucket->allocator);
+
+    ACTIVE(ctx, ctx->nactive) = append_bucket;
+    ctx->nactive++;
 }
 
 void serf_bucket_aggregate_hold_open(serf_bucket_t *aggregate_bucket, 
@@ -221,10 +254,16 @@ void serf_bucket_aggregate_append_iovec(
     serf_bucket_aggregate_append(aggregate_bucket, new_bucket);
 }
 
+/* Read up to REQUESTED bytes into VECS. If FILE is not NULL, the children
+   are read with read_for_sendfile instead, and the read stops after the
+   first child that hands out a file region; that region follows the
+   VECS_USED vecs in the stream. */
 static apr_status_t read_aggregate(serf_bucket_t *bucket,
                                    apr_size_t requested,
                                    int vecs_size, struct iovec *vecs,
-                                   int *vecs_used)
+                                   int *vecs_used,
+                                   apr_file_t **file, apr_off_t *offset,
+                                   apr_size_t *len)
 {
     aggregate_context_t *ctx = bucket->data;
     int cur_vecs_used;
@@ -232,7 +271,7 @@ static apr_status_t read_aggregate(serf_bucket_t *bucket,
 
     *vecs_used = 0;
 
-    if (!ctx->list) {
+    if (!ctx->nactive) {
         if (ctx->hold_open) {
             return ctx->hold_open(ctx->hold_open_baton, bucket);
         }
@@ -243,10 +282,24 @@ static apr_status_t read_aggregate(serf_bucket_t *bucket,
 
     status = APR_SUCCESS;
     while (requested) {
-        serf_bucket_t *head = ctx->list->bucket;
+        serf_bucket_t *head = ACTIVE(ctx, 0);
+
+        if (file) {
+            apr_hdtr_t hdtr;
 
-        status = serf_bucket_read_iovec(head, requested, vecs_size, vecs,
-                                        &cur_vecs_used);
+            hdtr.headers = vecs;
+            hdtr.numheaders = vecs_size;
+            hdtr.trailers = NULL;
+            hdtr.numtrailers = 0;
+
+            status = serf_bucket_read_for_sendfile(head, requested, &hdtr,
+                                                   file, offset, len);
+            cur_vecs_used = hdtr.numheaders;
+        }
+        else {
+            status = serf_bucket_read_iovec(head, requested, vecs_size, vecs,
+                                            &cur_vecs_used);
+        }
 
         if (SERF_BUCKET_READ_ERROR(status))
             return status;
@@ -254,35 +307,42 @@ static apr_status_t read_aggregate(serf_bucket_t *bucket,
         /* Add the number of vecs we read to our running total. */
         *vecs_used += cur_vecs_used;
 
-        if (cur_vecs_used > 0 || status) {
-            bucket_list_t *next_list;
-
-            /* If we got SUCCESS (w/bytes) or EAGAIN, we want to return now
-             * as it isn't safe to read more without returning to our caller.
+        if (cur_vecs_used > 0 || status || (file && *file)) {
+            /* If we got EAGAIN, we want to return now as it isn't safe to
+             * read more without returning to our caller. The same goes for
+             * SUCCESS (w/bytes), unless the bucket keeps what it handed out
+             * valid until it is destroyed; then we read it again.
              */
-            if (!status || APR_STATUS_IS_EAGAIN(status) || status == SERF_ERROR_WAIT_CONN) {
+            if (APR_STATUS_IS_EAGAIN(status) ||
+                status == SERF_ERROR_WAIT_CONN ||
+                (!status && ((file && *file) ||
+                             !serf_bucket_data_is_stable(head)))) {
                 return status;
             }
 
-            /* However, if we read EOF, we can stash this bucket in a
-             * to-be-freed list and move on to the next bucket.  This ensures
-             * that the bucket stays alive (so as not to violate our read
-             * semantics).  We'll destroy this list of buckets the next time
-             * we are asked to perform a read operation - thus ensuring the
-             * proper read lifetime.
-             */
-            next_list = ctx->list->next;
-            ctx->list->next = ctx->done;
-            ctx->done = ctx->list;
-            ctx->list = next_list;
-
-            /* If we have no more in our list, return EOF. */
-            if (!ctx->list) {
-                if (ctx->hold_open) {
-                    return ctx->hold_open(ctx->hold_open_baton, bucket);
+            if (status) {
+                /* However, if we read EOF, we can stash this bucket in a
+                 * to-be-freed list and move on to the next bucket.  This
+                 * ensures that the bucket stays alive (so as not to violate
+                 * our read semantics).  We'll destroy this list of buckets
+                 * the next time we are asked to perform a read operation -
+                 * thus ensuring the proper read lifetime.
+                 */
+                retire_head(ctx);
+
+                /* If we have no more in our list, return EOF. */
+                if (!ctx->nactive) {
+                    if (ctx->hold_open) {
+                        return ctx->hold_open(ctx->hold_open_baton, bucket);
+                    }
+                    else {
+                        return APR_EOF;
+                    }
                 }
-                else {
-                    return APR_EOF;
+
+                /* Nothing can follow a file region in a single read. */
+                if (file && *file) {
+                    return APR_SUCCESS;
                 }
             }
 
@@ -323,7 +383,8 @@ static apr_status_t serf_aggregate_read(serf_bucket_t *bucket,
 
     cleanup_aggregate(ctx, bucket->allocator);
 
-    status = read_aggregate(bucket, requested, 1, &vec, &vecs_used);
+    status = read_aggregate(bucket, requested, 1, &vec, &vecs_used,
+                            NULL, NULL, NULL);
 
     if (!vecs_used) {
         *len = 0;
@@ -346,7 +407,32 @@ static apr_status_t serf_aggregate_read_iovec(serf_bucket_t *bucket,
 
     cleanup_aggregate(ctx, bucket->allocator);
 
-    return read_aggregate(bucket, requested, vecs_size, vecs, vecs_used);
+    return read_aggregate(bucket, requested, vecs_size, vecs, vecs_used,
+                          NULL, NULL, NULL);
+}
+
+static apr_status_t serf_aggregate_read_for_sendfile(serf_bucket_t *bucket,
+                                                     apr_size_t requested,
+                                                     apr_hdtr_t *hdtr,
+                                                     apr_file_t **file,
+                                                     apr_off_t *offset,
+                                                     apr_size_t *len)
+{
+    aggregate_context_t *ctx = bucket->data;
+    apr_status_t status;
+    int vecs_used;
+
+    cleanup_aggregate(ctx, bucket->allocator);
+
+    *file = NULL;
+    status = read_aggregate(bucket, requested,
+                            hdtr->numheaders, hdtr->headers, &vecs_used,
+                            file, offset, len);
+
+    hdtr->numheaders = vecs_used;
+    hdtr->numtrailers = 0;
+
+    return status;
 }
 
 static apr_status_t serf_aggregate_readline(serf_bucket_t *bucket,
@@ -363,7 +449,7 @@ static apr_status_t serf_aggregate_readline(serf_bucket_t *bucket,
 
         *len = 0;
 
-        if (!ctx->list) {
+        if (!ctx->nactive) {
             if (ctx->hold_open) {
                 return ctx->hold_open(ctx->hold_open_baton, bucket);
             }
@@ -372,7 +458,7 @@ static apr_status_t serf_aggregate_readline(serf_bucket_t *bucket,
             }
         }
 
-        head = ctx->list->bucket;
+        head = ACTIVE(ctx, 0);
 
         status = serf_bucket_readline(head, acceptable, found,
                                       data, len);
@@ -380,16 +466,11 @@ static apr_status_t serf_aggregate_readline(serf_bucket_t *bucket,
             return status;
 
         if (status == APR_EOF) {
-            bucket_list_t *next_list;
-
             /* head bucket is empty, move to to-be-cleaned-up list. */
-            next_list = ctx->list->next;
-            ctx->list->next = ctx->done;
-            ctx->done = ctx->list;
-            ctx->list = next_list;
+            retire_head(ctx);
 
             /* If we have no more in our list, return EOF. */
-            if (!ctx->list) {
+            if (!ctx->nactive) {
                 if (ctx->hold_open) {
                     return ctx->hold_open(ctx->hold_open_baton, bucket);
                 }
@@ -420,7 +501,7 @@ static apr_status_t serf_aggregate_peek(serf_bucket_t *bucket,
     cleanup_aggregate(ctx, bucket->allocator);
 
     /* Peek the first bucket in the list, if any. */
-    if (!ctx->list) {
+    if (!ctx->nactive) {
         *len = 0;
         if (ctx->hold_open) {
             status = ctx->hold_open(ctx->hold_open_baton, bucket);
@@ -433,12 +514,12 @@ static apr_status_t serf_aggregate_peek(serf_bucket_t *bucket,
         }
     }
 
-    head = ctx->list->bucket;
+    head = ACTIVE(ctx, 0);
 
     status = serf_bucket_peek(head, data, len);
 
     if (status == APR_EOF) {
-        if (ctx->list->next) {
+        if (ctx->nactive > 1) {
             status = APR_SUCCESS;
         } else {
             if (ctx->hold_open) {
@@ -460,19 +541,22 @@ static serf_bucket_t * serf_aggregate_read_bucket(
     aggregate_context_t *ctx = bucket->data;
     serf_bucket_t *found_bucket;
 
-    if (!ctx->list) {
+    if (!ctx->nactive) {
         return NULL;
     }
 
-    if (ctx->list->bucket->type == type) {
-        /* Got the bucket. Consume it from our list. */
-        found_bucket = ctx->list->bucket;
-        ctx->list = ctx->list->next;
+    found_bucket = ACTIVE(ctx, 0);
+    if (found_bucket->type == type) {
+        /* Got the bucket. Consume it from our list. Its slot is taken over
+           by the first done bucket, keeping the done ones in front. */
+        ACTIVE(ctx, 0) = ctx->ring[ctx->first];
+        ctx->first = (ctx->first + 1) & (ctx->ring_size - 1);
+        ctx->nactive--;
         return found_bucket;
     }
 
     /* Call read_bucket on first one in our list. */
-    return serf_bucket_read_bucket(ctx->list->bucket, type);
+    return serf_bucket_read_bucket(found_bucket, type);
 }
 
 
@@ -481,7 +565,7 @@ const serf_bucket_type_t serf_bucket_type_aggregate = {
     serf_aggregate_read,
     serf_aggregate_readline,
     serf_aggregate_read_iovec,
-    serf_default_read_for_sendfile,
+    serf_aggregate_read_for_sendfile,
     serf_aggregate_read_bucket,
     serf_aggregate_peek,
     serf_aggregate_destroy_and_data,
@@ -19,14 +19,14 @@
 
 #include "serf.h"
 #include "serf_bucket_util.h"
+#include "serf_private.h"
 
 
 typedef struct node_header_t {
     apr_size_t size;
     union {
-        struct node_header_t *next;      /* if size == 0 (freed/inactive) */
-        /* no data                          if size == STANDARD_NODE_SIZE */
-        apr_memnode_t *memnode;          /* if size > STANDARD_NODE_SIZE */
+        apr_memnode_t *block;            /* if size <= MAX_NODE_SIZE */
+        apr_memnode_t *memnode;          /* if size > MAX_NODE_SIZE */
     } u;
 } node_header_t;
 
@@ -38,21 +38,45 @@ typedef struct node_header_t {
  */
 #define SIZEOF_NODE_HEADER_T  APR_ALIGN_DEFAULT(sizeof(node_header_t))
 
-
-/* STANDARD_NODE_SIZE is manually set to an allocation size that will
- * capture most allocators performed via this API. It must be "large
- * enough" to avoid lots of spillage to allocating directly from the
- * apr_allocator associated with the bucket allocator. The apr_allocator
- * has a minimum size of 8k, which can be expensive if you missed the
- * STANDARD_NODE_SIZE by just a few bytes.
+/* Free nodes (size == 0 if DEBUG_DOUBLE_FREE) are linked into their
+ * freelist through the first bytes of their otherwise unused data, so that
+ * the header can keep track of the block the node belongs to.
  */
-/* ### we should define some rules or ways to determine how to derive
- * ### a "good" value for this. probably log some stats on allocs, then
- * ### analyze them for size "misses". then find the balance point between
- * ### wasted space due to min-size allocator, and wasted-space due to
- * ### size-spill to the 8k minimum.
+#define NODE_NEXT(node) \
+    (*(node_header_t **)((char *)(node) + SIZEOF_NODE_HEADER_T))
+
+/* Each block that is subdivided into nodes starts with this header. */
+typedef struct block_header_t {
+    apr_size_t nodes_in_use;    /* allocated nodes carved from this block */
+} block_header_t;
+
+#define SIZEOF_BLOCK_HEADER_T  APR_ALIGN_DEFAULT(sizeof(block_header_t))
+
+#define BLOCK_HEADER(block) \
+    ((block_header_t *)((char *)(block) + APR_MEMNODE_T_SIZE))
+
+
+/* Small allocations (including the node_header_t) are rounded up to one
+ * of a set of power-of-two size classes: MIN_NODE_SIZE, 2*MIN_NODE_SIZE,
+ * ..., MAX_NODE_SIZE. Each class has its own freelist, and nodes for all
+ * classes are carved out of the same ALLOC_AMT blocks. Only allocations
+ * larger than MAX_NODE_SIZE go directly to the apr_allocator associated
+ * with the bucket allocator.
+ *
+ * The apr_allocator has a minimum size of 8k, which is expensive for a
+ * header value or line buffer that misses a single fixed node size by
+ * just a few bytes. With the size classes, anything up to MAX_NODE_SIZE
+ * is served from a freelist in constant time.
  */
-#define STANDARD_NODE_SIZE 128
+#define MIN_NODE_SHIFT 6        /* 64 bytes */
+#define MAX_NODE_SHIFT 12       /* 4096 bytes */
+#define NUM_SIZE_CLASSES (MAX_NODE_SHIFT - MIN_NODE_SHIFT + 1)
+
+#define MIN_NODE_SIZE ((apr_size_t)1 << MIN_NODE_SHIFT)
+#define MAX_NODE_SIZE ((apr_size_t)1 << MAX_NODE_SHIFT)
+
+/* The size of the nodes in size class IDX. */
+#define CLASS_SIZE(idx) (MIN_NODE_SIZE << (idx))
 
 /* When allocating a block of memory from the allocator, we should go for
  * an 8k block, minus the overhead that the allocator needs.
@@ -90,9 +114,18 @@ struct serf_bucket_alloc_t {
 
     apr_uint32_t num_alloc;
 
-    node_header_t *freelist;    /* free STANDARD_NODE_SIZE blocks */
+    /* free nodes, one list per size class */
+    node_header_t *freelist[NUM_SIZE_CLASSES];
     apr_memnode_t *blocks;      /* blocks we allocated for subdividing */
 
+    /* see serf_bucket_allocator_stats() */
+    apr_size_t bytes_in_use;
+    apr_size_t peak_bytes_in_use;
+    apr_size_t num_blocks;
+    apr_size_t num_free_nodes;
+    apr_size_t large_allocs_in_use;
+    apr_size_t large_allocs_total;
+
     track_state_t *track;
 };
 
@@ -162,6 +195,67 @@ apr_pool_t *serf_bucket_allocator_get_pool(
     return allocator->pool;
 }
 
+void serf__bucket_allocator_set_pool(serf_bucket_alloc_t *allocator,
+                                     apr_pool_t *pool)
+{
+    allocator->pool = pool;
+}
+
+apr_size_t serf__bucket_mem_usable_size(apr_size_t size)
+{
+    return size - SIZEOF_NODE_HEADER_T;
+}
+
+void serf_bucket_allocator_stats(
+    serf_bucket_alloc_stats_t *stats,
+    const serf_bucket_alloc_t *allocator)
+{
+    stats->bytes_in_use = allocator->bytes_in_use;
+    stats->peak_bytes_in_use = allocator->peak_bytes_in_use;
+    stats->allocs_in_use = allocator->num_alloc;
+    stats->blocks = allocator->num_blocks;
+    stats->freelist_len = allocator->num_free_nodes;
+    stats->large_allocs_in_use = allocator->large_allocs_in_use;
+    stats->large_allocs_total = allocator->large_allocs_total;
+}
+
+
+/* Return the index of the smallest size class that holds SIZE bytes. */
+static int size_to_class(apr_size_t size)
+{
+    int idx = 0;
+
+    while (CLASS_SIZE(idx) < size)
+        ++idx;
+
+    return idx;
+}
+
+/* The active block (the head of ALLOCATOR->blocks) cannot hold another
+ * node of size class IDX. Rather than waste the tail of the block, split
+ * it up into nodes of the smaller size classes and put those onto their
+ * freelists.
+ */
+static void recycle_tail(serf_bucket_alloc_t *allocator,
+                         apr_memnode_t *active,
+                         int idx)
+{
+    while (idx-- > 0) {
+        apr_size_t size = CLASS_SIZE(idx);
+
+        if ((apr_size_t)(active->endp - active->first_avail) >= size) {
+            node_header_t *node = (node_header_t *)active->first_avail;
+
+            active->first_avail += size;
+
+            node->size = 0;
+            node->u.block = active;
+            NODE_NEXT(node) = allocator->freelist[idx];
+            allocator->freelist[idx] = node;
+            ++allocator->num_free_nodes;
+        }
+    }
+}
 
 void *serf_bucket_mem_alloc(
     serf_bucket_alloc_t *allocator,
@@ -172,26 +266,26 @@ void *serf_bucket_mem_alloc(
     ++allocator->num_alloc;
 
     size += SIZEOF_NODE_HEADER_T;
-    if (size <= STANDARD_NODE_SIZE) {
-        if (allocator->freelist) {
+    if (size <= MAX_NODE_SIZE) {
+        int idx = size_to_class(size);
+
+        if (allocator->freelist[idx]) {
             /* just pull a node off our freelist */
-            node = allocator->freelist;
-            allocator->freelist = node->u.next;
-#ifdef DEBUG_DOUBLE_FREE
-            /* When we free an item, we set its size to zero. Thus, when
-             * we return it to the caller, we must ensure the size is set
-             * properly.
-             */
-            node->size = STANDARD_NODE_SIZE;
-#endif
+            node = allocator->freelist[idx];
+            allocator->freelist[idx] = NODE_NEXT(node);
+            --allocator->num_free_nodes;
         }
         else {
             apr_memnode_t *active = allocator->blocks;
 
+            size = CLASS_SIZE(idx);
             if (active == NULL
-                || active->first_avail + STANDARD_NODE_SIZE >= active->endp) {
+                || (apr_size_t)(active->endp - active->first_avail) < size) {
                 apr_memnode_t *head = allocator->blocks;
 
+                if (active != NULL)
+                    recycle_tail(allocator, active, idx);
+
                 /* ran out of room. grab another block. */
                 active = apr_allocator_alloc(allocator->allocator, ALLOC_AMT);
 
@@ -202,12 +296,22 @@ void *serf_bucket_mem_alloc(
                 /* link the block into our tracking list */
                 allocator->blocks = active;
                 active->next = head;
+                ++allocator->num_blocks;
+
+                BLOCK_HEADER(active)->nodes_in_use = 0;
+                active->first_avail += SIZEOF_BLOCK_HEADER_T;
             }
 
             node = (node_header_t *)active->first_avail;
-            node->size = STANDARD_NODE_SIZE;
-            active->first_avail += STANDARD_NODE_SIZE;
+            active->first_avail += size;
+            node->u.block = active;
         }
+
+        /* Freed nodes have their size set to zero (see DEBUG_DOUBLE_FREE),
+         * so always record the class size of the node we hand out.
+         */
+        node->size = CLASS_SIZE(idx);
+        ++BLOCK_HEADER(node->u.block)->nodes_in_use;
     }
     else {
         apr_memnode_t *memnode = apr_allocator_alloc(allocator->allocator,
@@ -219,8 +323,15 @@ void *serf_bucket_mem_alloc(
         node = (node_header_t *)memnode->first_avail;
         node->u.memnode = memnode;
         node->size = size;
+
+        ++allocator->large_allocs_in_use;
+        ++allocator->large_allocs_total;
     }
 
+    allocator->bytes_in_use += node->size;
+    if (allocator->bytes_in_use > allocator->peak_bytes_in_use)
+        allocator->peak_bytes_in_use = allocator->bytes_in_use;
+
     return ((char *)node) + SIZEOF_NODE_HEADER_T;
 }
 
@@ -248,21 +359,35 @@ void serf_bucket_mem_free(
 
     node = (node_header_t *)((char *)block - SIZEOF_NODE_HEADER_T);
 
-    if (node->size == STANDARD_NODE_SIZE) {
-        /* put the node onto our free list */
-        node->u.next = allocator->freelist;
-        allocator->freelist = node;
+    if (node->size <= MAX_NODE_SIZE) {
+        int idx;
+
+#ifdef DEBUG_DOUBLE_FREE
+        if (node->size == 0) {
+            /* damn thing was freed already. */
+            abort();
+        }
+#endif
+
+        allocator->bytes_in_use -= node->size;
+
+        --BLOCK_HEADER(node->u.block)->nodes_in_use;
+
+        /* put the node onto the free list of its size class */
+        idx = size_to_class(node->size);
+        NODE_NEXT(node) = allocator->freelist[idx];
+        allocator->freelist[idx] = node;
+        ++allocator->num_free_nodes;
 
 #ifdef DEBUG_DOUBLE_FREE
         /* note that this thing was freed. */
         node->size = 0;
-    }
-    else if (node->size == 0) {
-        /* damn thing was freed already. */
-        abort();
 #endif
     }
     else {
+        allocator->bytes_in_use -= node->size;
+        --allocator->large_allocs_in_use;
+
 #ifdef DEBUG_DOUBLE_FREE
         /* note that this thing was freed. */
         node->size = 0;
@@ -274,6 +399,54 @@ void serf_bucket_mem_free(
 }
 
 
+void serf_bucket_allocator_trim(
+    serf_bucket_alloc_t *allocator)
+{
+    apr_memnode_t **link;
+    int idx;
+
+    /* New nodes are carved from the first block, which we always keep. If
+       that's the only one, there's nothing to do. */
+    if (allocator->blocks == NULL || allocator->blocks->next == NULL)
+        return;
+
+    /* Drop the free nodes of all blocks that are about to go away. */
+    for (idx = 0; idx < NUM_SIZE_CLASSES; idx++) {
+        node_header_t **scan = &allocator->freelist[idx];
+
+        while (*scan) {
+            node_header_t *node = *scan;
+
+            if (node->u.block != allocator->blocks
+                && BLOCK_HEADER(node->u.block)->nodes_in_use == 0) {
+                *scan = NODE_NEXT(node);
+                --allocator->num_free_nodes;
+            }
+            else {
+                scan = &NODE_NEXT(node);
+            }
+        }
+    }
+
+    /* And give those blocks back to the APR allocator. */
+    link = &allocator->blocks->next;
+    while (*link) {
+        apr_memnode_t *block = *link;
+
+        if (BLOCK_HEADER(block)->nodes_in_use == 0) {
+            *link = block->next;
+            --allocator->num_blocks;
+
+            block->next = NULL;
+            apr_allocator_free(allocator->allocator, block);
+        }
+        else {
+            link = &block->next;
+        }
+    }
+}
+
+
 /* ==================================================================== */
 
 
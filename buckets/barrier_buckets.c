@@ -17,6 +17,7 @@
 
 #include "serf.h"
 #include "serf_bucket_util.h"
+#include "serf_private.h"
 
 
 typedef struct {
@@ -36,6 +37,13 @@ serf_bucket_t *serf_bucket_barrier_create(
     return serf_bucket_create(&serf_bucket_type_barrier, allocator, ctx);
 }
 
+serf_bucket_t *serf__bucket_barrier_get_stream(serf_bucket_t *bucket)
+{
+    barrier_context_t *ctx = bucket->data;
+
+    return ctx->stream;
+}
+
 static apr_status_t serf_barrier_read(serf_bucket_t *bucket,
                                      apr_size_t requested,
                                      const char **data, apr_size_t *len)
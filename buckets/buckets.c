@@ -97,6 +97,20 @@ apr_status_t serf_default_read_for_sendfile(
 }
 
 
+int serf_bucket_data_is_stable(
+    const serf_bucket_t *bucket)
+{
+    /* A barrier hands out the data of the bucket it protects. */
+    while (SERF_BUCKET_IS_BARRIER(bucket))
+        bucket = serf__bucket_barrier_get_stream((serf_bucket_t *)bucket);
+
+    return (SERF_BUCKET_IS_SIMPLE(bucket) ||
+            SERF_BUCKET_IS_IOVEC(bucket) ||
+            SERF_BUCKET_IS_MMAP(bucket) ||
+            SERF_BUCKET_IS_HEADERS(bucket));
+}
+
+
 serf_bucket_t *serf_default_read_bucket(
     serf_bucket_t *bucket,
     const serf_bucket_type_t *type)
@@ -185,40 +199,159 @@ char *serf_bstrcatv(serf_bucket_alloc_t *allocator, struct iovec *vec,
 /* ==================================================================== */
 
 
-static void find_crlf(const char **data, apr_size_t *len, int *found)
-{
-    const char *start = *data;
-    const char *end = start + *len;
+/* Scanning for line endings.
+ *
+ * When more than one kind of newline is acceptable, we look for the first
+ * CR or LF in a single pass over the data. On x86 we do that 16 (SSE2) or
+ * 32 (AVX2, if the CPU supports it) bytes at a time; elsewhere we test a
+ * machine word at a time. When only one of the two characters matters,
+ * memchr() is used, which the C library has already optimized.
+ */
+
+#if defined(__SSE2__) || defined(_M_X64) || defined(_M_AMD64) \
+    || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define SERF__SCAN_SSE2
+#include <emmintrin.h>
+#endif
+
+#if defined(SERF__SCAN_SSE2) && (defined(__x86_64__) || defined(__i386__)) \
+    && ((defined(__clang__) && __clang_major__ >= 8) \
+        || (!defined(__clang__) && defined(__GNUC__) \
+            && (__GNUC__ > 4 || (__GNUC__ == 4 && __GNUC_MINOR__ >= 9))))
+#define SERF__SCAN_AVX2
+#include <immintrin.h>
+#endif
 
-    while (start < end) {
-        const char *cr = memchr(start, '\r', *len);
+#ifdef _MSC_VER
+#include <intrin.h>
+#endif
+
+/* Return a pointer to the first CR or LF in [START, END), or END if there
+   is none. */
+typedef const char *(*scan_cr_lf_func_t)(const char *start,
+                                         const char *end);
 
-        if (cr == NULL) {
+static const char *scan_cr_lf_swar(const char *start, const char *end)
+{
+    /* 0x0101...01, 0x8080...80 and the characters to look for, repeated
+       in every byte of an apr_size_t. */
+    const apr_size_t ones = (apr_size_t)-1 / 0xFF;
+    const apr_size_t highs = ones << 7;
+    const apr_size_t crs = ones * '\r';
+    const apr_size_t lfs = ones * '\n';
+
+    while ((apr_size_t)(end - start) >= sizeof(apr_size_t)) {
+        apr_size_t word, cr, lf;
+
+        memcpy(&word, start, sizeof(word));
+        cr = word ^ crs;
+        lf = word ^ lfs;
+
+        /* Is there a zero byte in CR or LF? */
+        if (((cr - ones) & ~cr & highs) | ((lf - ones) & ~lf & highs))
             break;
-        }
-        ++cr;
 
-        if (cr < end && cr[0] == '\n') {
-            *len -= cr + 1 - start;
-            *data = cr + 1;
-            *found = SERF_NEWLINE_CRLF;
-            return;
-        }
-        if (cr == end) {
-            *len = 0;
-            *data = end;
-            *found = SERF_NEWLINE_CRLF_SPLIT;
-            return;
-        }
+        start += sizeof(word);
+    }
+
+    /* Find the exact position in this word, or check the last few bytes. */
+    while (start < end && *start != '\r' && *start != '\n')
+        ++start;
+
+    return start;
+}
+
+#ifdef SERF__SCAN_SSE2
 
-        /* It was a bare CR without an LF. Just move past it. */
-        *len -= cr - start;
-        start = cr;
+/* Return the index of the lowest bit set in MASK, which must not be 0. */
+static int lowest_bit(unsigned int mask)
+{
+#if defined(__GNUC__)
+    return __builtin_ctz(mask);
+#elif defined(_MSC_VER)
+    unsigned long idx;
+
+    _BitScanForward(&idx, mask);
+    return (int)idx;
+#else
+    int idx = 0;
+
+    while (!(mask & 1)) {
+        mask >>= 1;
+        ++idx;
     }
+    return idx;
+#endif
+}
 
-    *data = start + *len;
-    *len -= *data - start;
-    *found = SERF_NEWLINE_NONE;
+static const char *scan_cr_lf_sse2(const char *start, const char *end)
+{
+    const __m128i crs = _mm_set1_epi8('\r');
+    const __m128i lfs = _mm_set1_epi8('\n');
+
+    while (end - start >= 16) {
+        __m128i chunk = _mm_loadu_si128((const __m128i *)start);
+        unsigned int mask = _mm_movemask_epi8(
+                                _mm_or_si128(_mm_cmpeq_epi8(chunk, crs),
+                                             _mm_cmpeq_epi8(chunk, lfs)));
+
+        if (mask)
+            return start + lowest_bit(mask);
+
+        start += 16;
+    }
+
+    return scan_cr_lf_swar(start, end);
+}
+
+#endif /* SERF__SCAN_SSE2 */
+
+#ifdef SERF__SCAN_AVX2
+
+__attribute__((target("avx2")))
+static const char *scan_cr_lf_avx2(const char *start, const char *end)
+{
+    const __m256i crs = _mm256_set1_epi8('\r');
+    const __m256i lfs = _mm256_set1_epi8('\n');
+
+    while (end - start >= 32) {
+        __m256i chunk = _mm256_loadu_si256((const __m256i *)start);
+        unsigned int mask = _mm256_movemask_epi8(
+                                _mm256_or_si256(_mm256_cmpeq_epi8(chunk, crs),
+                                                _mm256_cmpeq_epi8(chunk, lfs)));
+
+        if (mask)
+            return start + lowest_bit(mask);
+
+        start += 32;
+    }
+
+    return scan_cr_lf_sse2(start, end);
+}
+
+#endif /* SERF__SCAN_AVX2 */
+
+static const char *scan_cr_lf_init(const char *start, const char *end);
+
+/* The implementation to use on this CPU; chosen on first use. Racing
+   threads will all store the same value, so no locking is needed. */
+static scan_cr_lf_func_t scan_cr_lf = scan_cr_lf_init;
+
+static const char *scan_cr_lf_init(const char *start, const char *end)
+{
+#if defined(SERF__SCAN_AVX2)
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2"))
+        scan_cr_lf = scan_cr_lf_avx2;
+    else
+        scan_cr_lf = scan_cr_lf_sse2;
+#elif defined(SERF__SCAN_SSE2)
+    scan_cr_lf = scan_cr_lf_sse2;
+#else
+    scan_cr_lf = scan_cr_lf_swar;
+#endif
+
+    return scan_cr_lf(start, end);
 }
 
 
@@ -228,75 +361,66 @@ void serf_util_readline(
     int acceptable,
     int *found)
 {
-    const char *start;
-    const char *cr;
-    const char *lf;
-    int want_cr;
-    int want_crlf;
-    int want_lf;
+    const char *start = *data;
+    const char *end = start + *len;
+    const char *scan = start;
+    int want_cr = acceptable & SERF_NEWLINE_CR;
+    int want_crlf = acceptable & SERF_NEWLINE_CRLF;
+    int want_lf = acceptable & SERF_NEWLINE_LF;
 
-    /* If _only_ CRLF is acceptable, then the scanning needs a loop to
-     * skip false hits on CR characters. Use a separate function.
-     */
-    if (acceptable == SERF_NEWLINE_CRLF) {
-        find_crlf(data, len, found);
-        return;
-    }
+    *found = SERF_NEWLINE_NONE;
 
-    start = *data;
-    cr = lf = NULL;
-    want_cr = acceptable & SERF_NEWLINE_CR;
-    want_crlf = acceptable & SERF_NEWLINE_CRLF;
-    want_lf = acceptable & SERF_NEWLINE_LF;
+    while (scan < end) {
+        const char *eol;
 
-    if (want_cr || want_crlf) {
-        cr = memchr(start, '\r', *len);
-    }
-    if (want_lf) {
-        lf = memchr(start, '\n', *len);
-    }
+        if (want_lf && (want_cr || want_crlf)) {
+            eol = scan_cr_lf(scan, end);
+        }
+        else {
+            eol = memchr(scan, want_lf ? '\n' : '\r', end - scan);
+            if (eol == NULL)
+                eol = end;
+        }
 
-    if (cr != NULL) {
-        if (lf != NULL) {
-            if (cr + 1 == lf)
-                *found = want_crlf ? SERF_NEWLINE_CRLF : SERF_NEWLINE_CR;
-            else if (want_cr && cr < lf)
-                *found = SERF_NEWLINE_CR;
-            else
-                *found = SERF_NEWLINE_LF;
+        if (eol == end) {
+            break;
+        }
+
+        if (*eol == '\n') {
+            *found = SERF_NEWLINE_LF;
+            *data = eol + 1;
+            break;
         }
-        else if (cr == start + *len - 1) {
+
+        /* It's a CR. */
+        if (eol + 1 == end) {
             /* the CR occurred in the last byte of the buffer. this could be
              * a CRLF split across the data boundary.
-             * ### FIX THIS LOGIC? does caller need to detect?
              */
-            *found = want_crlf ? SERF_NEWLINE_CRLF_SPLIT : SERF_NEWLINE_CR;
+            if (want_crlf)
+                *found = SERF_NEWLINE_CRLF_SPLIT;
+            else if (want_cr)
+                *found = SERF_NEWLINE_CR;
+            *data = end;
+            break;
         }
-        else if (want_cr)
+        if (want_crlf && eol[1] == '\n') {
+            *found = SERF_NEWLINE_CRLF;
+            *data = eol + 2;
+            break;
+        }
+        if (want_cr) {
             *found = SERF_NEWLINE_CR;
-        else /* want_crlf */
-            *found = SERF_NEWLINE_NONE;
+            *data = eol + 1;
+            break;
+        }
+
+        /* It was a CR we're not interested in. Just move past it. */
+        scan = eol + 1;
     }
-    else if (lf != NULL)
-        *found = SERF_NEWLINE_LF;
-    else
-        *found = SERF_NEWLINE_NONE;
-
-    switch (*found) {
-      case SERF_NEWLINE_LF:
-        *data = lf + 1;
-        break;
-      case SERF_NEWLINE_CR:
-      case SERF_NEWLINE_CRLF:
-      case SERF_NEWLINE_CRLF_SPLIT:
-        *data = cr + 1 + (*found == SERF_NEWLINE_CRLF);
-        break;
-      case SERF_NEWLINE_NONE:
-        *data += *len;
-        break;
-      default:
-        /* Not reachable */
-        return;
+
+    if (*found == SERF_NEWLINE_NONE) {
+        *data = end;
     }
 
     *len -= *data - start;
@@ -432,6 +556,199 @@ apr_status_t serf_databuf_peek(
 /* ==================================================================== */
 
 
+void serf_dynbuf_init(
+    serf_dynbuf_t *dynbuf,
+    serf_bucket_alloc_t *allocator,
+    apr_size_t min_size,
+    apr_size_t max_size)
+{
+    /* nothing is sitting in the buffer */
+    dynbuf->current = "";
+    dynbuf->remaining = 0;
+
+    /* avoid thinking we have hit EOF */
+    dynbuf->status = APR_SUCCESS;
+
+    /* the buffer is allocated on first use */
+    dynbuf->buf = NULL;
+    dynbuf->bufsize = 0;
+    dynbuf->allocator = allocator;
+
+    serf_dynbuf_set_size(dynbuf, min_size, max_size);
+    dynbuf->size = dynbuf->min_size;
+}
+
+void serf_dynbuf_set_size(
+    serf_dynbuf_t *dynbuf,
+    apr_size_t min_size,
+    apr_size_t max_size)
+{
+    if (min_size == 0)
+        min_size = 1;
+    if (max_size < min_size)
+        max_size = min_size;
+
+    dynbuf->min_size = min_size;
+    dynbuf->max_size = max_size;
+
+    if (dynbuf->size < min_size)
+        dynbuf->size = min_size;
+    else if (dynbuf->size > max_size)
+        dynbuf->size = max_size;
+}
+
+void serf_dynbuf_destroy(
+    serf_dynbuf_t *dynbuf)
+{
+    if (dynbuf->buf) {
+        serf_bucket_mem_free(dynbuf->allocator, dynbuf->buf);
+        dynbuf->buf = NULL;
+        dynbuf->bufsize = 0;
+    }
+    dynbuf->current = "";
+    dynbuf->remaining = 0;
+}
+
+/* Ensure the buffer is prepared for reading. Will return APR_SUCCESS,
+ * APR_EOF, or some failure code. *len is only set for EOF. */
+static apr_status_t common_dynbuf_prep(serf_dynbuf_t *dynbuf,
+                                       apr_size_t *len)
+{
+    apr_size_t readlen;
+    apr_status_t status;
+
+    /* if there is data in the buffer, then we're happy. */
+    if (dynbuf->remaining > 0)
+        return APR_SUCCESS;
+
+    /* if we already hit EOF, then keep returning that. */
+    if (APR_STATUS_IS_EOF(dynbuf->status)) {
+        *len = 0;
+        return APR_EOF;
+    }
+
+    /* The buffer is empty, so now is the time to resize it. */
+    if (dynbuf->buf && dynbuf->bufsize != dynbuf->size) {
+        serf_dynbuf_destroy(dynbuf);
+    }
+    if (dynbuf->buf == NULL) {
+        dynbuf->buf = serf_bucket_mem_alloc(dynbuf->allocator, dynbuf->size);
+        if (dynbuf->buf == NULL)
+            return APR_ENOMEM;
+        dynbuf->bufsize = dynbuf->size;
+    }
+
+    /* refill the buffer */
+    status = (*dynbuf->read)(dynbuf->read_baton, dynbuf->bufsize,
+                             dynbuf->buf, &readlen);
+    if (SERF_BUCKET_READ_ERROR(status)) {
+        return status;
+    }
+
+    dynbuf->current = dynbuf->buf;
+    dynbuf->remaining = readlen;
+    dynbuf->status = status;
+
+    if (readlen == dynbuf->bufsize) {
+        /* The source had at least as much data as we could take. Ask for
+           more next time. */
+        dynbuf->size = dynbuf->bufsize * 2;
+        if (dynbuf->size > dynbuf->max_size)
+            dynbuf->size = dynbuf->max_size;
+    }
+    else if (readlen == 0 && APR_STATUS_IS_EAGAIN(status)) {
+        /* The source ran dry. Don't hold on to a big buffer while it's
+           idle, but keep one of the minimum size: a source that is polled
+           often would otherwise have it freed and allocated again each
+           time. */
+        if (dynbuf->bufsize > dynbuf->min_size)
+            serf_dynbuf_destroy(dynbuf);
+
+        dynbuf->size /= 2;
+        if (dynbuf->size < dynbuf->min_size)
+            dynbuf->size = dynbuf->min_size;
+    }
+
+    return APR_SUCCESS;
+}
+
+
+apr_status_t serf_dynbuf_read(
+    serf_dynbuf_t *dynbuf,
+    apr_size_t requested,
+    const char **data,
+    apr_size_t *len)
+{
+    apr_status_t status = common_dynbuf_prep(dynbuf, len);
+    if (status)
+        return status;
+
+    /* peg the requested amount to what we have remaining */
+    if (requested == SERF_READ_ALL_AVAIL || requested > dynbuf->remaining)
+        requested = dynbuf->remaining;
+
+    /* return the values */
+    *data = dynbuf->current;
+    *len = requested;
+
+    /* adjust our internal state to note we've consumed some data */
+    dynbuf->current += requested;
+    dynbuf->remaining -= requested;
+
+    /* see serf_databuf_read's return condition */
+    return dynbuf->remaining ? APR_SUCCESS : dynbuf->status;
+}
+
+
+apr_status_t serf_dynbuf_readline(
+    serf_dynbuf_t *dynbuf,
+    int acceptable,
+    int *found,
+    const char **data,
+    apr_size_t *len)
+{
+    apr_status_t status = common_dynbuf_prep(dynbuf, len);
+    if (status)
+        return status;
+
+    /* the returned line will start at the current position. */
+    *data = dynbuf->current;
+
+    /* read a line from the buffer, and adjust the various pointers. */
+    serf_util_readline(&dynbuf->current, &dynbuf->remaining, acceptable,
+                       found);
+
+    /* the length matches the amount consumed by the readline */
+    *len = dynbuf->current - *data;
+
+    /* see serf_databuf_read's return condition */
+    return dynbuf->remaining ? APR_SUCCESS : dynbuf->status;
+}
+
+
+apr_status_t serf_dynbuf_peek(
+    serf_dynbuf_t *dynbuf,
+    const char **data,
+    apr_size_t *len)
+{
+    apr_status_t status = common_dynbuf_prep(dynbuf, len);
+    if (status)
+        return status;
+
+    /* return everything we have */
+    *data = dynbuf->current;
+    *len = dynbuf->remaining;
+
+    /* see serf_databuf_peek's return condition */
+    if (APR_STATUS_IS_EOF(dynbuf->status))
+        return APR_EOF;
+    return APR_SUCCESS;
+}
+
+
+/* ==================================================================== */
+
+
 void serf_linebuf_init(serf_linebuf_t *linebuf)
 {
     linebuf->state = SERF_LINEBUF_EMPTY;
@@ -439,10 +756,14 @@ void serf_linebuf_init(serf_linebuf_t *linebuf)
 }
 
 
-apr_status_t serf_linebuf_fetch(
+/* Implements serf_linebuf_fetch() and, if LINE is not NULL,
+   serf_linebuf_fetch_nocopy(). */
+static apr_status_t linebuf_fetch(
     serf_linebuf_t *linebuf,
     serf_bucket_t *bucket,
-    int acceptable)
+    int acceptable,
+    const char **line,
+    apr_size_t *line_len)
 {
     /* If we had a complete line, then assume the caller has used it, so
      * we can now reset the state.
@@ -539,11 +860,17 @@ apr_status_t serf_linebuf_fetch(
                 len -= 1 + (found == SERF_NEWLINE_CRLF);
 
                 linebuf->state = SERF_LINEBUF_READY;
+
+                /* If we got the whole line at once and the caller can
+                 * deal with it, don't copy it at all.
+                 */
+                if (line && linebuf->used == 0) {
+                    *line = data;
+                    *line_len = linebuf->used = len;
+                    return status;
+                }
             }
 
-            /* ### it would be nice to avoid this copy if at all possible,
-               ### and just return the a data/len pair to the caller. we're
-               ### keeping it simple for now. */
             memcpy(&linebuf->line[linebuf->used], data, len);
             linebuf->used += len;
         }
@@ -552,8 +879,13 @@ apr_status_t serf_linebuf_fetch(
          * we should return that status. If the line was completed, then
          * we should also return.
          */
-        if (status || linebuf->state == SERF_LINEBUF_READY)
+        if (status || linebuf->state == SERF_LINEBUF_READY) {
+            if (line && linebuf->state == SERF_LINEBUF_READY) {
+                *line = linebuf->line;
+                *line_len = linebuf->used;
+            }
             return status;
+        }
 
         /* We got APR_SUCCESS and the line buffer is not complete. Let's
          * loop to read some more data.
@@ -562,6 +894,24 @@ apr_status_t serf_linebuf_fetch(
     /* NOTREACHED */
 }
 
+apr_status_t serf_linebuf_fetch(
+    serf_linebuf_t *linebuf,
+    serf_bucket_t *bucket,
+    int acceptable)
+{
+    return linebuf_fetch(linebuf, bucket, acceptable, NULL, NULL);
+}
+
+apr_status_t serf_linebuf_fetch_nocopy(
+    serf_linebuf_t *linebuf,
+    serf_bucket_t *bucket,
+    int acceptable,
+    const char **line,
+    apr_size_t *line_len)
+{
+    return linebuf_fetch(linebuf, bucket, acceptable, line, line_len);
+}
+
 /* Logging functions.
    Use with one of the [COMP]_VERBOSE defines so that the compiler knows to
    optimize this code out when no logging is needed. */
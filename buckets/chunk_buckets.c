@@ -20,18 +20,31 @@
 #include "serf_bucket_util.h"
 
 
+/* Number of vecs of data read from the stream for one chunk. */
+#define CHUNK_VECS 64
+
 typedef struct {
     enum {
-        STATE_FETCH,
-        STATE_CHUNK,
-        STATE_EOF
+        STATE_FETCH,  /* read the stream for the next chunk */
+        STATE_CHUNK,  /* returning a chunk */
+        STATE_EOF     /* returning the last chunk, or done */
     } state;
 
     apr_status_t last_status;
 
-    serf_bucket_t *chunk;
     serf_bucket_t *stream;
 
+    /* Upper limit of the size of a chunk, or 0 for whatever the stream
+       returns at once. */
+    apr_size_t max_size;
+
+    /* The current chunk: its size line, the data of the stream and the CRLF
+       ending it (and the last chunk, at the end of the stream). The vecs
+       from CUR to COUNT are still to be returned. */
+    struct iovec vecs[CHUNK_VECS + 2];
+    int cur;
+    int count;
+
     char chunk_hdr[20];
 } chunk_context_t;
 
@@ -43,21 +56,33 @@ serf_bucket_t *serf_bucket_chunk_create(
 
     ctx = serf_bucket_mem_alloc(allocator, sizeof(*ctx));
     ctx->state = STATE_FETCH;
-    ctx->chunk = serf_bucket_aggregate_create(allocator);
+    ctx->last_status = APR_SUCCESS;
     ctx->stream = stream;
+    ctx->max_size = 0;
+    ctx->cur = 0;
+    ctx->count = 0;
 
     return serf_bucket_create(&serf_bucket_type_chunk, allocator, ctx);
 }
 
+void serf_bucket_chunk_set_max_size(
+    serf_bucket_t *bucket,
+    apr_size_t max_size)
+{
+    chunk_context_t *ctx = bucket->data;
+
+    ctx->max_size = max_size;
+}
+
 #define CRLF "\r\n"
 
+/* Read the stream and set up the vecs of the next chunk. The data is not
+   copied; it stays valid until we read the stream again, which we only do
+   once all of it was returned, on the next read of the chunk bucket. */
 static apr_status_t create_chunk(serf_bucket_t *bucket)
 {
     chunk_context_t *ctx = bucket->data;
-    serf_bucket_t *simple_bkt;
-    apr_size_t chunk_len;
     apr_size_t stream_len;
-    struct iovec vecs[66]; /* 64 + chunk trailer + EOF trailer = 66 */
     int vecs_read;
     int i;
 
@@ -66,8 +91,10 @@ static apr_status_t create_chunk(serf_bucket_t *bucket)
     }
 
     ctx->last_status =
-        serf_bucket_read_iovec(ctx->stream, SERF_READ_ALL_AVAIL,
-                               64, vecs, &vecs_read);
+        serf_bucket_read_iovec(ctx->stream,
+                               ctx->max_size ? ctx->max_size
+                                             : SERF_READ_ALL_AVAIL,
+                               CHUNK_VECS, &ctx->vecs[1], &vecs_read);
 
     if (SERF_BUCKET_READ_ERROR(ctx->last_status)) {
         /* Uh-oh. */
@@ -77,11 +104,9 @@ static apr_status_t create_chunk(serf_bucket_t *bucket)
     /* Count the length of the data we read. */
     stream_len = 0;
     for (i = 0; i < vecs_read; i++) {
-        stream_len += vecs[i].iov_len;
+        stream_len += ctx->vecs[i + 1].iov_len;
     }
 
-    /* assert: stream_len in hex < sizeof(ctx->chunk_hdr) */
-
     /* Inserting a 0 byte chunk indicates a terminator, which already happens
      * during the EOF handler below.  Adding another one here will cause the
      * EOF chunk to be interpreted by the server as a new request.  So,
@@ -89,40 +114,72 @@ static apr_status_t create_chunk(serf_bucket_t *bucket)
      */
     if (stream_len) {
         /* Build the chunk header. */
-        chunk_len = apr_snprintf(ctx->chunk_hdr, sizeof(ctx->chunk_hdr),
-                                 "%" APR_UINT64_T_HEX_FMT CRLF,
-                                 (apr_uint64_t)stream_len);
-
-        /* Create a copy of the chunk header so we can have multiple chunks
-         * in the pipeline at the same time.
-         */
-        simple_bkt = serf_bucket_simple_copy_create(ctx->chunk_hdr, chunk_len,
-                                                    bucket->allocator);
-        serf_bucket_aggregate_append(ctx->chunk, simple_bkt);
-
-        /* Insert the chunk footer. */
-        vecs[vecs_read].iov_base = CRLF;
-        vecs[vecs_read++].iov_len = sizeof(CRLF) - 1;
-    }
-
-    /* We've reached the end of the line for the stream. */
-    if (APR_STATUS_IS_EOF(ctx->last_status)) {
-        /* Insert the chunk footer. */
-        vecs[vecs_read].iov_base = "0" CRLF CRLF;
-        vecs[vecs_read++].iov_len = sizeof("0" CRLF CRLF) - 1;
-
-        ctx->state = STATE_EOF;
+        ctx->vecs[0].iov_base = ctx->chunk_hdr;
+        ctx->vecs[0].iov_len = apr_snprintf(ctx->chunk_hdr,
+                                            sizeof(ctx->chunk_hdr),
+                                            "%" APR_UINT64_T_HEX_FMT CRLF,
+                                            (apr_uint64_t)stream_len);
+        ctx->cur = 0;
+        ctx->count = vecs_read + 1;
+
+        /* Insert the chunk footer, and the terminator if this is it. */
+        if (APR_STATUS_IS_EOF(ctx->last_status)) {
+            ctx->vecs[ctx->count].iov_base = CRLF "0" CRLF CRLF;
+            ctx->vecs[ctx->count++].iov_len = sizeof(CRLF "0" CRLF CRLF) - 1;
+        }
+        else {
+            ctx->vecs[ctx->count].iov_base = CRLF;
+            ctx->vecs[ctx->count++].iov_len = sizeof(CRLF) - 1;
+        }
     }
     else {
-        /* Okay, we can return data.  */
-        ctx->state = STATE_CHUNK;
+        ctx->cur = ctx->count = 0;
+
+        /* We've reached the end of the line for the stream. */
+        if (APR_STATUS_IS_EOF(ctx->last_status)) {
+            ctx->vecs[ctx->count].iov_base = "0" CRLF CRLF;
+            ctx->vecs[ctx->count++].iov_len = sizeof("0" CRLF CRLF) - 1;
+        }
     }
 
-    serf_bucket_aggregate_append_iovec(ctx->chunk, vecs, vecs_read);
+    ctx->state = APR_STATUS_IS_EOF(ctx->last_status) ? STATE_EOF
+                                                     : STATE_CHUNK;
 
     return APR_SUCCESS;
 }
 
+/* The status to return once the caller got what it asked for. */
+static apr_status_t chunk_status(chunk_context_t *ctx)
+{
+    if (ctx->cur < ctx->count)
+        return APR_SUCCESS;
+
+    if (ctx->state == STATE_EOF)
+        return APR_EOF;
+
+    /* Done with this chunk; report how the stream was doing. */
+    ctx->state = STATE_FETCH;
+    return ctx->last_status;
+}
+
+/* Return up to REQUESTED bytes of the current vec. */
+static void read_vec(chunk_context_t *ctx, apr_size_t requested,
+                     const char **data, apr_size_t *len)
+{
+    struct iovec *vec = &ctx->vecs[ctx->cur];
+
+    *data = vec->iov_base;
+    if (requested == SERF_READ_ALL_AVAIL || requested >= vec->iov_len) {
+        *len = vec->iov_len;
+        ctx->cur++;
+    }
+    else {
+        *len = requested;
+        vec->iov_base = (char *)vec->iov_base + requested;
+        vec->iov_len -= requested;
+    }
+}
+
 static apr_status_t serf_chunk_read(serf_bucket_t *bucket,
                                     apr_size_t requested,
                                     const char **data, apr_size_t *len)
@@ -138,15 +195,12 @@ static apr_status_t serf_chunk_read(serf_bucket_t *bucket,
         }
     }
 
-    status = serf_bucket_read(ctx->chunk, requested, data, len);
-
-    /* Mask EOF from aggregate bucket. */
-    if (APR_STATUS_IS_EOF(status) && ctx->state == STATE_CHUNK) {
-        status = ctx->last_status;
-        ctx->state = STATE_FETCH;
+    *len = 0;
+    if (ctx->cur < ctx->count) {
+        read_vec(ctx, requested, data, len);
     }
 
-    return status;
+    return chunk_status(ctx);
 }
 
 static apr_status_t serf_chunk_readline(serf_bucket_t *bucket,
@@ -156,15 +210,36 @@ static apr_status_t serf_chunk_readline(serf_bucket_t *bucket,
     chunk_context_t *ctx = bucket->data;
     apr_status_t status;
 
-    status = serf_bucket_readline(ctx->chunk, acceptable, found, data, len);
+    if (ctx->state == STATE_FETCH) {
+        status = create_chunk(bucket);
+        if (status) {
+            return status;
+        }
+    }
+
+    *found = SERF_NEWLINE_NONE;
+    *len = 0;
+    if (ctx->cur < ctx->count) {
+        struct iovec *vec = &ctx->vecs[ctx->cur];
+        const char *start = vec->iov_base;
+        const char *end = start;
+        apr_size_t remaining = vec->iov_len;
+
+        serf_util_readline(&end, &remaining, acceptable, found);
 
-    /* Mask EOF from aggregate bucket. */
-    if (APR_STATUS_IS_EOF(status) && ctx->state == STATE_CHUNK) {
-        status = APR_EAGAIN;
-        ctx->state = STATE_FETCH;
+        *data = start;
+        *len = end - start;
+
+        if (remaining) {
+            vec->iov_base = (char *)end;
+            vec->iov_len = remaining;
+        }
+        else {
+            ctx->cur++;
+        }
     }
 
-    return status;
+    return chunk_status(ctx);
 }
 
 static apr_status_t serf_chunk_read_iovec(serf_bucket_t *bucket,
@@ -184,16 +259,22 @@ static apr_status_t serf_chunk_read_iovec(serf_bucket_t *bucket,
         }
     }
 
-    status = serf_bucket_read_iovec(ctx->chunk, requested, vecs_size, vecs,
-                                    vecs_used);
+    *vecs_used = 0;
+    while (ctx->cur < ctx->count && *vecs_used < vecs_size && requested) {
+        const char *data;
+        apr_size_t len;
 
-    /* Mask EOF from aggregate bucket. */
-    if (APR_STATUS_IS_EOF(status) && ctx->state == STATE_CHUNK) {
-        status = ctx->last_status;
-        ctx->state = STATE_FETCH;
+        read_vec(ctx, requested, &data, &len);
+
+        vecs[*vecs_used].iov_base = (char *)data;
+        vecs[*vecs_used].iov_len = len;
+        (*vecs_used)++;
+
+        if (requested != SERF_READ_ALL_AVAIL)
+            requested -= len;
     }
 
-    return status;
+    return chunk_status(ctx);
 }
 
 static apr_status_t serf_chunk_peek(serf_bucket_t *bucket,
@@ -201,16 +282,16 @@ static apr_status_t serf_chunk_peek(serf_bucket_t *bucket,
                                      apr_size_t *len)
 {
     chunk_context_t *ctx = bucket->data;
-    apr_status_t status;
 
-    status = serf_bucket_peek(ctx->chunk, data, len);
-
-    /* Mask EOF from aggregate bucket. */
-    if (APR_STATUS_IS_EOF(status) && ctx->state == STATE_CHUNK) {
-        status = APR_EAGAIN;
+    if (ctx->cur < ctx->count) {
+        *data = ctx->vecs[ctx->cur].iov_base;
+        *len = ctx->vecs[ctx->cur].iov_len;
+        return APR_SUCCESS;
     }
 
-    return status;
+    *len = 0;
+
+    return ctx->state == STATE_EOF ? APR_EOF : APR_EAGAIN;
 }
 
 static void serf_chunk_destroy(serf_bucket_t *bucket)
@@ -218,7 +299,6 @@ static void serf_chunk_destroy(serf_bucket_t *bucket)
     chunk_context_t *ctx = bucket->data;
 
     serf_bucket_destroy(ctx->stream);
-    serf_bucket_destroy(ctx->chunk);
 
     serf_default_destroy_and_data(bucket);
 }
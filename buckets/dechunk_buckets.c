@@ -61,12 +61,15 @@ static void serf_dechunk_destroy_and_data(serf_bucket_t *bucket)
     serf_default_destroy_and_data(bucket);
 }
 
-static apr_status_t serf_dechunk_read(serf_bucket_t *bucket,
-                                      apr_size_t requested,
-                                      const char **data, apr_size_t *len)
+/* Read the chunk size line, or the terminator of the previous chunk and
+   the next size line, until we're at the data of a chunk. Returns
+   APR_SUCCESS when there's chunk data to read, or the status that stopped
+   us: APR_EOF after the last-chunk marker, EAGAIN or an error. */
+static apr_status_t wait_for_chunk(dechunk_context_t *ctx)
 {
-    dechunk_context_t *ctx = bucket->data;
     apr_status_t status;
+    const char *data;
+    apr_size_t len;
 
     while (1) {
         switch (ctx->state) {
@@ -95,64 +98,31 @@ static apr_status_t serf_dechunk_read(serf_bucket_t *bucket,
                 if (ctx->body_left == 0) {
                     /* Just read the last-chunk marker. We're DONE. */
                     ctx->state = STATE_DONE;
-                    status = APR_EOF;
-                }
-                else {
-                    /* Got a size, so we'll start reading the chunk now. */
-                    ctx->state = STATE_CHUNK;
+                    return APR_EOF;
                 }
 
-                /* If we can read more, then go do so. */
-                if (!status)
-                    continue;
+                /* Got a size, so we'll start reading the chunk now. */
+                ctx->state = STATE_CHUNK;
+                return APR_SUCCESS;
             }
             /* assert: status != 0 */
 
-            /* Note that we didn't actually read anything, so our callers
-             * don't get confused.
-             */
-            *len = 0;
-
             return status;
 
         case STATE_CHUNK:
-
-            if (requested > ctx->body_left) {
-                requested = ctx->body_left;
-            }
-
-            /* Delegate to the stream bucket to do the read. */
-            status = serf_bucket_read(ctx->stream, requested, data, len);
-            if (SERF_BUCKET_READ_ERROR(status))
-                return status;
-
-            /* Some data was read, so decrement the amount left and see
-             * if we're done reading this chunk.
-             */
-            ctx->body_left -= *len;
-            if (!ctx->body_left) {
-                ctx->state = STATE_TERM;
-                ctx->body_left = 2;     /* CRLF */
-            }
-
-            /* We need more data but there is no more available. */
-            if (ctx->body_left && APR_STATUS_IS_EOF(status)) {
-                return SERF_ERROR_TRUNCATED_HTTP_RESPONSE;
-            }
-
-            /* Return the data we just read. */
-            return status;
+            return APR_SUCCESS;
 
         case STATE_TERM:
             /* Delegate to the stream bucket to do the read. */
-            status = serf_bucket_read(ctx->stream, ctx->body_left, data, len);
+            status = serf_bucket_read(ctx->stream, ctx->body_left,
+                                      &data, &len);
             if (SERF_BUCKET_READ_ERROR(status))
                 return status;
 
             /* Some data was read, so decrement the amount left and see
              * if we're done reading the chunk terminator.
              */
-            ctx->body_left -= *len;
+            ctx->body_left -= len;
 
             /* We need more data but there is no more available. */
             if (ctx->body_left && APR_STATUS_IS_EOF(status))
@@ -163,8 +133,6 @@ static apr_status_t serf_dechunk_read(serf_bucket_t *bucket,
             }
 
             /* Don't return the CR of CRLF to the caller! */
-            *len = 0;
-
             if (status)
                 return status;
 
@@ -172,7 +140,6 @@ static apr_status_t serf_dechunk_read(serf_bucket_t *bucket,
 
         case STATE_DONE:
             /* Just keep returning EOF */
-            *len = 0;
             return APR_EOF;
 
         default:
@@ -183,15 +150,174 @@ static apr_status_t serf_dechunk_read(serf_bucket_t *bucket,
     /* NOTREACHED */
 }
 
-/* ### need to implement */
-#define serf_dechunk_readline NULL
-#define serf_dechunk_peek NULL
+/* Account for LEN bytes of chunk data that were read from the stream with
+   STATUS, and return the status for our caller. */
+static apr_status_t chunk_data_read(dechunk_context_t *ctx,
+                                    apr_size_t len,
+                                    apr_status_t status)
+{
+    /* Some data was read, so decrement the amount left and see
+     * if we're done reading this chunk.
+     */
+    ctx->body_left -= len;
+    if (!ctx->body_left) {
+        ctx->state = STATE_TERM;
+        ctx->body_left = 2;     /* CRLF */
+    }
+
+    /* We need more data but there is no more available. */
+    if (ctx->body_left && APR_STATUS_IS_EOF(status)) {
+        return SERF_ERROR_TRUNCATED_HTTP_RESPONSE;
+    }
+
+    /* Return the data we just read. */
+    return status;
+}
+
+/* Limit REQUESTED to what is left of the current chunk. */
+static apr_size_t chunk_limit(dechunk_context_t *ctx, apr_size_t requested)
+{
+    if (requested == SERF_READ_ALL_AVAIL || requested > ctx->body_left)
+        return (apr_size_t)ctx->body_left;
+    return requested;
+}
+
+static apr_status_t serf_dechunk_read(serf_bucket_t *bucket,
+                                      apr_size_t requested,
+                                      const char **data, apr_size_t *len)
+{
+    dechunk_context_t *ctx = bucket->data;
+    apr_status_t status;
+
+    status = wait_for_chunk(ctx);
+    if (status) {
+        /* Note that we didn't actually read anything, so our callers
+         * don't get confused.
+         */
+        *len = 0;
+        return status;
+    }
+
+    /* Delegate to the stream bucket to do the read. */
+    status = serf_bucket_read(ctx->stream, chunk_limit(ctx, requested),
+                              data, len);
+    if (SERF_BUCKET_READ_ERROR(status))
+        return status;
+
+    return chunk_data_read(ctx, *len, status);
+}
+
+/* Pass the data of the current chunk through, in as few and as large vecs
+   as the stream can hand out. */
+static apr_status_t serf_dechunk_read_iovec(serf_bucket_t *bucket,
+                                            apr_size_t requested,
+                                            int vecs_size,
+                                            struct iovec *vecs,
+                                            int *vecs_used)
+{
+    dechunk_context_t *ctx = bucket->data;
+    apr_status_t status;
+    apr_size_t len;
+    int i;
+
+    *vecs_used = 0;
+
+    status = wait_for_chunk(ctx);
+    if (status)
+        return status;
+
+    status = serf_bucket_read_iovec(ctx->stream, chunk_limit(ctx, requested),
+                                    vecs_size, vecs, vecs_used);
+    if (SERF_BUCKET_READ_ERROR(status))
+        return status;
+
+    len = 0;
+    for (i = 0; i < *vecs_used; i++)
+        len += vecs[i].iov_len;
+
+    return chunk_data_read(ctx, len, status);
+}
+
+static apr_status_t serf_dechunk_readline(serf_bucket_t *bucket,
+                                          int acceptable, int *found,
+                                          const char **data, apr_size_t *len)
+{
+    dechunk_context_t *ctx = bucket->data;
+    apr_status_t status;
+    const char *peek_data = NULL;
+    apr_size_t peek_len = 0;
+    const char *end;
+    apr_size_t remaining;
+
+    *found = SERF_NEWLINE_NONE;
+    *len = 0;
+
+    status = wait_for_chunk(ctx);
+    if (status)
+        return status;
+
+    /* A line may run past the end of the chunk, so look for its end in
+       what the stream has available, and read exactly that. */
+    if (ctx->stream->type->peek) {
+        status = serf_bucket_peek(ctx->stream, &peek_data, &peek_len);
+        if (SERF_BUCKET_READ_ERROR(status))
+            return status;
+    }
+
+    if (peek_len) {
+        end = peek_data;
+        remaining = chunk_limit(ctx, peek_len);
+        serf_util_readline(&end, &remaining, acceptable, found);
+        peek_len = end - peek_data;
+    }
+    else {
+        /* Nothing to look at; make progress a byte at a time. */
+        peek_len = 1;
+    }
+
+    status = serf_bucket_read(ctx->stream, peek_len, data, len);
+    if (SERF_BUCKET_READ_ERROR(status))
+        return status;
+
+    /* Check what we actually got. */
+    end = *data;
+    remaining = *len;
+    serf_util_readline(&end, &remaining, acceptable, found);
+
+    return chunk_data_read(ctx, *len, status);
+}
+
+static apr_status_t serf_dechunk_peek(serf_bucket_t *bucket,
+                                      const char **data,
+                                      apr_size_t *len)
+{
+    dechunk_context_t *ctx = bucket->data;
+    apr_status_t status;
+
+    *len = 0;
+
+    if (ctx->state == STATE_DONE)
+        return APR_EOF;
+
+    /* We can't parse a chunk header without reading it. */
+    if (ctx->state != STATE_CHUNK || !ctx->stream->type->peek)
+        return APR_SUCCESS;
+
+    status = serf_bucket_peek(ctx->stream, data, len);
+    if (SERF_BUCKET_READ_ERROR(status))
+        return status;
+
+    *len = chunk_limit(ctx, *len);
+
+    /* The stream's EOF is not ours; there's at least a terminator left. */
+    return APR_SUCCESS;
+}
 
 const serf_bucket_type_t serf_bucket_type_dechunk = {
     "DECHUNK",
     serf_dechunk_read,
     serf_dechunk_readline,
-    serf_default_read_iovec,
+    serf_dechunk_read_iovec,
     serf_default_read_for_sendfile,
     serf_default_read_bucket,
     serf_dechunk_peek,
@@ -0,0 +1,435 @@
+/* Copyright 2002-2004 Justin Erenkrantz and Greg Stein
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/* Decoding of the brotli and zstd content codings. Both decoders run the
+   same state machine; only the call into the library differs. The bucket
+   types exist in every build, but can only be created when serf was built
+   with the library they need. */
+
+#ifdef SERF_HAVE_BROTLI
+#include <brotli/decode.h>
+#endif
+
+#ifdef SERF_HAVE_ZSTD
+#include <zstd.h>
+#endif
+
+#include "serf.h"
+#include "serf_bucket_util.h"
+
+#define DECOMPRESS_BUFFER_SIZE 16384
+
+typedef enum {
+    FORMAT_BROTLI,
+    FORMAT_ZSTD
+} decompress_format_t;
+
+typedef struct {
+    serf_bucket_t *stream;
+
+    decompress_format_t format;
+
+    enum {
+        STATE_INIT,             /* creating the decoder */
+        STATE_DECODE,           /* decoding the content now */
+        STATE_DONE              /* content is done; reads go to the stream */
+    } state;
+
+#ifdef SERF_HAVE_BROTLI
+    BrotliDecoderState *brotli;
+#endif
+#ifdef SERF_HAVE_ZSTD
+    ZSTD_DStream *zstd;
+    int zstd_frame_done;        /* Did the last call end a frame? */
+#endif
+
+    /* Compressed data read from the stream, not yet consumed. */
+    const char *next_in;
+    apr_size_t avail_in;
+
+    /* Status of the last read of the stream. */
+    apr_status_t stream_status;
+
+    /* Decoded data not yet returned: from OUT up to OUT_END. */
+    const char *out;
+    char *out_end;
+
+    char buffer[DECOMPRESS_BUFFER_SIZE];
+} decompress_context_t;
+
+#if defined(SERF_HAVE_BROTLI) || defined(SERF_HAVE_ZSTD)
+static serf_bucket_t *create_decompress_bucket(
+    const serf_bucket_type_t *type,
+    decompress_format_t format,
+    serf_bucket_t *stream,
+    serf_bucket_alloc_t *allocator)
+{
+    decompress_context_t *ctx;
+
+    ctx = serf_bucket_mem_alloc(allocator, sizeof(*ctx));
+    ctx->stream = stream;
+    ctx->format = format;
+    ctx->state = STATE_INIT;
+    ctx->next_in = NULL;
+    ctx->avail_in = 0;
+    ctx->stream_status = APR_SUCCESS;
+    ctx->out = ctx->out_end = ctx->buffer;
+
+    return serf_bucket_create(type, allocator, ctx);
+}
+#endif
+
+serf_bucket_t *serf_bucket_brotli_create(
+    serf_bucket_t *stream,
+    serf_bucket_alloc_t *allocator)
+{
+#ifdef SERF_HAVE_BROTLI
+    return create_decompress_bucket(&serf_bucket_type_brotli, FORMAT_BROTLI,
+                                    stream, allocator);
+#else
+    return NULL;
+#endif
+}
+
+serf_bucket_t *serf_bucket_zstd_create(
+    serf_bucket_t *stream,
+    serf_bucket_alloc_t *allocator)
+{
+#ifdef SERF_HAVE_ZSTD
+    return create_decompress_bucket(&serf_bucket_type_zstd, FORMAT_ZSTD,
+                                    stream, allocator);
+#else
+    return NULL;
+#endif
+}
+
+static void serf_decompress_destroy_and_data(serf_bucket_t *bucket)
+{
+    decompress_context_t *ctx = bucket->data;
+
+    if (ctx->state != STATE_INIT) {
+        switch (ctx->format) {
+#ifdef SERF_HAVE_BROTLI
+            case FORMAT_BROTLI:
+                BrotliDecoderDestroyInstance(ctx->brotli);
+                break;
+#endif
+#ifdef SERF_HAVE_ZSTD
+            case FORMAT_ZSTD:
+                ZSTD_freeDStream(ctx->zstd);
+                break;
+#endif
+            default:
+                break;
+        }
+    }
+
+    serf_bucket_destroy(ctx->stream);
+
+    serf_default_destroy_and_data(bucket);
+}
+
+static apr_status_t init_decoder(decompress_context_t *ctx)
+{
+    switch (ctx->format) {
+#ifdef SERF_HAVE_BROTLI
+        case FORMAT_BROTLI:
+            ctx->brotli = BrotliDecoderCreateInstance(NULL, NULL, NULL);
+            if (!ctx->brotli)
+                return APR_ENOMEM;
+            return APR_SUCCESS;
+#endif
+#ifdef SERF_HAVE_ZSTD
+        case FORMAT_ZSTD:
+            ctx->zstd = ZSTD_createDStream();
+            if (!ctx->zstd)
+                return APR_ENOMEM;
+            if (ZSTD_isError(ZSTD_initDStream(ctx->zstd))) {
+                ZSTD_freeDStream(ctx->zstd);
+                return SERF_ERROR_DECOMPRESSION_FAILED;
+            }
+            ctx->zstd_frame_done = 0;
+            return APR_SUCCESS;
+#endif
+        default:
+            /* Not reachable */
+            return APR_ENOTIMPL;
+    }
+}
+
+#ifdef SERF_HAVE_BROTLI
+static apr_status_t decode_brotli(decompress_context_t *ctx)
+{
+    const uint8_t *next_in = (const uint8_t *)ctx->next_in;
+    size_t avail_in = ctx->avail_in;
+    uint8_t *next_out = (uint8_t *)ctx->out_end;
+    size_t avail_out = ctx->buffer + sizeof(ctx->buffer) - ctx->out_end;
+    BrotliDecoderResult result;
+
+    result = BrotliDecoderDecompressStream(ctx->brotli,
+                                           &avail_in, &next_in,
+                                           &avail_out, &next_out, NULL);
+
+    ctx->next_in = (const char *)next_in;
+    ctx->avail_in = avail_in;
+    ctx->out_end = (char *)next_out;
+
+    switch (result) {
+        case BROTLI_DECODER_RESULT_SUCCESS:
+            ctx->state = STATE_DONE;
+            return APR_SUCCESS;
+        case BROTLI_DECODER_RESULT_NEEDS_MORE_INPUT:
+            /* All input was consumed; if there is no more, the content
+               was truncated. */
+            if (APR_STATUS_IS_EOF(ctx->stream_status))
+                return SERF_ERROR_DECOMPRESSION_FAILED;
+            return APR_SUCCESS;
+        case BROTLI_DECODER_RESULT_NEEDS_MORE_OUTPUT:
+            return APR_SUCCESS;
+        default:
+            return SERF_ERROR_DECOMPRESSION_FAILED;
+    }
+}
+#endif
+
+#ifdef SERF_HAVE_ZSTD
+static apr_status_t decode_zstd(decompress_context_t *ctx)
+{
+    ZSTD_inBuffer in;
+    ZSTD_outBuffer out;
+    size_t zerr;
+
+    /* The content may consist of several frames; it ends where the
+       stream ends, which must be at the end of a frame. */
+    if (!ctx->avail_in && APR_STATUS_IS_EOF(ctx->stream_status)
+        && ctx->zstd_frame_done) {
+        ctx->state = STATE_DONE;
+        return APR_SUCCESS;
+    }
+
+    in.src = ctx->next_in;
+    in.size = ctx->avail_in;
+    in.pos = 0;
+    out.dst = ctx->out_end;
+    out.size = ctx->buffer + sizeof(ctx->buffer) - ctx->out_end;
+    out.pos = 0;
+
+    zerr = ZSTD_decompressStream(ctx->zstd, &out, &in);
+    if (ZSTD_isError(zerr))
+        return SERF_ERROR_DECOMPRESSION_FAILED;
+
+    ctx->next_in += in.pos;
+    ctx->avail_in -= in.pos;
+    ctx->out_end += out.pos;
+
+    /* 0 means a frame was decoded and flushed completely. */
+    ctx->zstd_frame_done = (zerr == 0);
+
+    if (!ctx->avail_in && APR_STATUS_IS_EOF(ctx->stream_status)) {
+        if (ctx->zstd_frame_done)
+            ctx->state = STATE_DONE;
+        else if (out.pos < out.size)
+            return SERF_ERROR_DECOMPRESSION_FAILED;
+    }
+
+    return APR_SUCCESS;
+}
+#endif
+
+/* Fill the buffer with decoded data of the stream, as much as there is
+   room and input for. The decoders keep whatever state they need, so the
+   stream is only read again once all of its previous data was consumed. */
+static apr_status_t decompress_stream(decompress_context_t *ctx)
+{
+    apr_status_t status;
+
+    if (ctx->state == STATE_INIT) {
+        status = init_decoder(ctx);
+        if (status)
+            return status;
+
+        ctx->state = STATE_DECODE;
+    }
+
+    ctx->out = ctx->out_end = ctx->buffer;
+
+    while (ctx->state == STATE_DECODE &&
+           ctx->out_end < ctx->buffer + sizeof(ctx->buffer)) {
+        if (!ctx->avail_in && !APR_STATUS_IS_EOF(ctx->stream_status)) {
+            const char *data;
+            apr_size_t len;
+
+            status = serf_bucket_read(ctx->stream, SERF_READ_ALL_AVAIL,
+                                      &data, &len);
+            if (SERF_BUCKET_READ_ERROR(status))
+                return status;
+
+            ctx->stream_status = status;
+            ctx->next_in = data;
+            ctx->avail_in = len;
+
+            /* Wait for more input, rather than looping for it. */
+            if (!len && !APR_STATUS_IS_EOF(status))
+                break;
+        }
+
+        switch (ctx->format) {
+#ifdef SERF_HAVE_BROTLI
+            case FORMAT_BROTLI:
+                status = decode_brotli(ctx);
+                break;
+#endif
+#ifdef SERF_HAVE_ZSTD
+            case FORMAT_ZSTD:
+                status = decode_zstd(ctx);
+                break;
+#endif
+            default:
+                /* Not reachable */
+                status = APR_ENOTIMPL;
+                break;
+        }
+        if (status)
+            return status;
+
+        if (!ctx->avail_in && APR_STATUS_IS_EAGAIN(ctx->stream_status))
+            break;
+    }
+
+    return APR_SUCCESS;
+}
+
+/* Make decoded data available in the buffer, if we can. Returns the status
+   to report once all of it was returned in DRAINED_STATUS. */
+static apr_status_t prepare_output(decompress_context_t *ctx,
+                                   apr_status_t *drained_status)
+{
+    apr_status_t status;
+
+    if (ctx->out == ctx->out_end && ctx->state != STATE_DONE) {
+        status = decompress_stream(ctx);
+        if (status)
+            return status;
+    }
+
+    /* A brotli stream ends by itself, maybe before our stream does. Its
+       rest is read through us, so that all of it gets consumed. */
+    if (ctx->state == STATE_DONE && APR_STATUS_IS_EOF(ctx->stream_status))
+        *drained_status = APR_EOF;
+    else if (ctx->state == STATE_DONE)
+        *drained_status = APR_SUCCESS;
+    else if (!ctx->avail_in && APR_STATUS_IS_EAGAIN(ctx->stream_status))
+        *drained_status = APR_EAGAIN;
+    else
+        *drained_status = APR_SUCCESS;
+
+    return APR_SUCCESS;
+}
+
+static apr_status_t serf_decompress_read(serf_bucket_t *bucket,
+                                         apr_size_t requested,
+                                         const char **data,
+                                         apr_size_t *len)
+{
+    decompress_context_t *ctx = bucket->data;
+    apr_status_t drained_status;
+    apr_status_t status;
+    apr_size_t avail;
+
+    *len = 0;
+
+    status = prepare_output(ctx, &drained_status);
+    if (status)
+        return status;
+
+    if (ctx->out == ctx->out_end && ctx->state == STATE_DONE)
+        return serf_bucket_read(ctx->stream, requested, data, len);
+
+    avail = ctx->out_end - ctx->out;
+    *data = ctx->out;
+    *len = (requested == SERF_READ_ALL_AVAIL || requested > avail)
+           ? avail : requested;
+    ctx->out += *len;
+
+    return ctx->out == ctx->out_end ? drained_status : APR_SUCCESS;
+}
+
+static apr_status_t serf_decompress_readline(serf_bucket_t *bucket,
+                                             int acceptable, int *found,
+                                             const char **data,
+                                             apr_size_t *len)
+{
+    decompress_context_t *ctx = bucket->data;
+    apr_status_t drained_status;
+    apr_status_t status;
+    const char *end;
+    apr_size_t remaining;
+
+    *found = SERF_NEWLINE_NONE;
+    *len = 0;
+
+    status = prepare_output(ctx, &drained_status);
+    if (status)
+        return status;
+
+    if (ctx->out == ctx->out_end && ctx->state == STATE_DONE)
+        return serf_bucket_readline(ctx->stream, acceptable, found, data, len);
+
+    *data = end = ctx->out;
+    remaining = ctx->out_end - ctx->out;
+    serf_util_readline(&end, &remaining, acceptable, found);
+
+    *len = end - *data;
+    ctx->out += *len;
+
+    return ctx->out == ctx->out_end ? drained_status : APR_SUCCESS;
+}
+
+static apr_status_t serf_decompress_peek(serf_bucket_t *bucket,
+                                         const char **data,
+                                         apr_size_t *len)
+{
+    decompress_context_t *ctx = bucket->data;
+
+    if (ctx->out == ctx->out_end && ctx->state == STATE_DONE)
+        return serf_bucket_peek(ctx->stream, data, len);
+
+    *data = ctx->out;
+    *len = ctx->out_end - ctx->out;
+
+    return APR_SUCCESS;
+}
+
+const serf_bucket_type_t serf_bucket_type_brotli = {
+    "BROTLI",
+    serf_decompress_read,
+    serf_decompress_readline,
+    serf_default_read_iovec,
+    serf_default_read_for_sendfile,
+    serf_default_read_bucket,
+    serf_decompress_peek,
+    serf_decompress_destroy_and_data,
+};
+
+const serf_bucket_type_t serf_bucket_type_zstd = {
+    "ZSTD",
+    serf_decompress_read,
+    serf_decompress_readline,
+    serf_default_read_iovec,
+    serf_default_read_for_sendfile,
+    serf_default_read_bucket,
+    serf_decompress_peek,
+    serf_decompress_destroy_and_data,
+};
@@ -29,14 +29,15 @@
 static char deflate_magic[2] = { '\037', '\213' };
 #define DEFLATE_MAGIC_SIZE 10
 #define DEFLATE_VERIFY_SIZE 8
-#define DEFLATE_BUFFER_SIZE 8096
+#define DEFLATE_BUFFER_SIZE 16384
+#define DEFLATE_MIN_BUFFER_SIZE 1024
+#define DEFLATE_MAX_BUFFER_SIZE (256 * 1024)
 
 static const int DEFLATE_WINDOW_SIZE = -15;
 static const int DEFLATE_MEMLEVEL = 9;
 
 typedef struct {
     serf_bucket_t *stream;
-    serf_bucket_t *inflate_stream;
 
     int format;                 /* Are we 'deflate' or 'gzip'? */
 
@@ -53,11 +54,15 @@ typedef struct {
 
     z_stream zstream;
     char hdr_buffer[DEFLATE_MAGIC_SIZE];
-    unsigned char buffer[DEFLATE_BUFFER_SIZE];
     unsigned long crc;
     int windowSize;
     int memLevel;
-    int bufferSize;
+
+    /* zlib inflates into this buffer; the data from OUT up to
+       zstream.next_out wasn't returned yet. */
+    unsigned char *buffer;
+    apr_size_t bufferSize;
+    const unsigned char *out;
 
     /* How much of the chunk, or the terminator, do we have left to read? */
     apr_size_t stream_left;
@@ -88,7 +93,6 @@ serf_bucket_t *serf_bucket_deflate_create(
     ctx = serf_bucket_mem_alloc(allocator, sizeof(*ctx));
     ctx->stream = stream;
     ctx->stream_status = APR_SUCCESS;
-    ctx->inflate_stream = serf_bucket_aggregate_create(allocator);
     ctx->format = format;
     ctx->crc = 0;
     /* zstream must be NULL'd out. */
@@ -112,11 +116,35 @@ serf_bucket_t *serf_bucket_deflate_create(
 
     ctx->windowSize = DEFLATE_WINDOW_SIZE;
     ctx->memLevel = DEFLATE_MEMLEVEL;
+
+    /* The buffer is allocated once we start inflating. */
+    ctx->buffer = NULL;
     ctx->bufferSize = DEFLATE_BUFFER_SIZE;
+    ctx->out = NULL;
 
     return serf_bucket_create(&serf_bucket_type_deflate, allocator, ctx);
 }
 
+void serf_bucket_deflate_set_buffer_size(
+    serf_bucket_t *bucket,
+    apr_size_t buffer_size)
+{
+    deflate_context_t *ctx = bucket->data;
+
+    /* Too late, we're inflating already. */
+    if (ctx->buffer)
+        return;
+
+    if (buffer_size == 0)
+        buffer_size = DEFLATE_BUFFER_SIZE;
+    else if (buffer_size < DEFLATE_MIN_BUFFER_SIZE)
+        buffer_size = DEFLATE_MIN_BUFFER_SIZE;
+    else if (buffer_size > DEFLATE_MAX_BUFFER_SIZE)
+        buffer_size = DEFLATE_MAX_BUFFER_SIZE;
+
+    ctx->bufferSize = buffer_size;
+}
+
 static void serf_deflate_destroy_and_data(serf_bucket_t *bucket)
 {
     deflate_context_t *ctx = bucket->data;
@@ -125,20 +153,118 @@ static void serf_deflate_destroy_and_data(serf_bucket_t *bucket)
         ctx->state <= STATE_FINISH)
         inflateEnd(&ctx->zstream);
 
-    /* We may have appended inflate_stream into the stream bucket.
-     * If so, avoid free'ing it twice.
-     */
-    if (ctx->inflate_stream) {
-        serf_bucket_destroy(ctx->inflate_stream);
-    }
+    if (ctx->buffer)
+        serf_bucket_mem_free(bucket->allocator, ctx->buffer);
+
     serf_bucket_destroy(ctx->stream);
 
     serf_default_destroy_and_data(bucket);
 }
 
-static apr_status_t serf_deflate_read(serf_bucket_t *bucket,
-                                      apr_size_t requested,
-                                      const char **data, apr_size_t *len)
+/* Inflate into the buffer until it is full, the compressed data ends or
+   the stream has no more data for now. */
+static apr_status_t inflate_buffer(serf_bucket_t *bucket)
+{
+    deflate_context_t *ctx = bucket->data;
+    apr_status_t status;
+    const char *private_data;
+    apr_size_t private_len;
+    int zRC;
+
+    ctx->out = ctx->buffer;
+    ctx->zstream.next_out = ctx->buffer;
+    ctx->zstream.avail_out = (uInt)ctx->bufferSize;
+
+    /* We were asked for more, so try the stream again. */
+    if (APR_STATUS_IS_EAGAIN(ctx->stream_status))
+        ctx->stream_status = APR_SUCCESS;
+
+    while (ctx->zstream.avail_out) {
+        /* It is possible that we maxed out avail_out before exhausting
+           avail_in; therefore, continue using the previous data. Otherwise,
+           fetch more data from our stream bucket. */
+        if (ctx->zstream.avail_in == 0 && ctx->stream_status == APR_SUCCESS) {
+            status = serf_bucket_read(ctx->stream, SERF_READ_ALL_AVAIL,
+                                      &private_data, &private_len);
+            if (SERF_BUCKET_READ_ERROR(status)) {
+                return status;
+            }
+
+            ctx->stream_status = status;
+            ctx->zstream.next_in = (unsigned char*)private_data;
+            ctx->zstream.avail_in = (uInt)private_len;
+
+            if (!private_len && !status)
+                break;
+        }
+
+        /* When we return the inflated data, we'll return this status - this
+           allows us to eventually pass up EAGAINs. */
+        if (ctx->zstream.avail_in == 0 &&
+            APR_STATUS_IS_EAGAIN(ctx->stream_status))
+            break;
+
+        zRC = inflate(&ctx->zstream, Z_NO_FLUSH);
+
+        if (zRC == Z_STREAM_END) {
+            /* Push back the remaining data to be read, so our next read
+               picks it up. */
+            if (ctx->zstream.avail_in) {
+                serf_bucket_t *tmp;
+
+                tmp = serf_bucket_aggregate_create(bucket->allocator);
+                serf_bucket_aggregate_prepend(tmp, ctx->stream);
+                ctx->stream = tmp;
+
+                tmp = SERF_BUCKET_SIMPLE_STRING_LEN(
+                                    (const char*)ctx->zstream.next_in,
+                                                 ctx->zstream.avail_in,
+                                                 bucket->allocator);
+                serf_bucket_aggregate_prepend(ctx->stream, tmp);
+                ctx->zstream.avail_in = 0;
+            }
+
+            switch (ctx->format) {
+            case SERF_DEFLATE_GZIP:
+                ctx->stream_left = ctx->stream_size =
+                    DEFLATE_VERIFY_SIZE;
+                ctx->state++;
+                break;
+            case SERF_DEFLATE_DEFLATE:
+                /* Deflate does not have a verify footer. */
+                ctx->state = STATE_FINISH;
+                break;
+            default:
+                /* Not reachable */
+                return APR_EGENERAL;
+            }
+            break;
+        }
+
+        /* zlib needs more input. If there's no more, the data was
+           incomplete and we have an error. */
+        if (zRC == Z_BUF_ERROR) {
+            if (APR_STATUS_IS_EOF(ctx->stream_status))
+                return SERF_ERROR_DECOMPRESSION_FAILED;
+            continue;
+        }
+
+        /* Any other error? */
+        if (zRC != Z_OK) {
+            return SERF_ERROR_DECOMPRESSION_FAILED;
+        }
+
+        /* As long as zRC == Z_OK, just keep looping. */
+    }
+
+    ctx->crc = crc32(ctx->crc, ctx->out, ctx->zstream.next_out - ctx->out);
+
+    return APR_SUCCESS;
+}
+
+/* Run the state machine until inflated data is available. Returns the
+   status to report if there is none. */
+static apr_status_t deflate_fill(serf_bucket_t *bucket)
 {
     deflate_context_t *ctx = bucket->data;
     apr_status_t status;
@@ -146,7 +272,7 @@ static apr_status_t serf_deflate_read(serf_bucket_t *bucket,
     apr_size_t private_len;
     int zRC;
 
-    while (1) {
+    while (ctx->out == ctx->zstream.next_out) {
         switch (ctx->state) {
         case STATE_READING_HEADER:
         case STATE_READING_VERIFY:
@@ -165,12 +291,10 @@ static apr_status_t serf_deflate_read(serf_bucket_t *bucket,
             if (ctx->stream_left == 0) {
                 ctx->state++;
                 if (APR_STATUS_IS_EAGAIN(status)) {
-                    *len = 0;
                     return status;
                 }
             }
             else if (status) {
-                *len = 0;
                 return status;
             }
             break;
@@ -209,195 +333,424 @@ static apr_status_t serf_deflate_read(serf_bucket_t *bucket,
             if (zRC != Z_OK) {
                 return SERF_ERROR_DECOMPRESSION_FAILED;
             }
-            ctx->zstream.next_out = ctx->buffer;
-            ctx->zstream.avail_out = ctx->bufferSize;
+            ctx->buffer = serf_bucket_mem_alloc(bucket->allocator,
+                                                ctx->bufferSize);
+            ctx->out = ctx->zstream.next_out = ctx->buffer;
             ctx->state++;
             break;
         case STATE_FINISH:
             inflateEnd(&ctx->zstream);
-            serf_bucket_aggregate_prepend(ctx->stream, ctx->inflate_stream);
-            ctx->inflate_stream = 0;
             ctx->state++;
             break;
         case STATE_INFLATE:
-            /* Do we have anything already uncompressed to read? */
-            status = serf_bucket_read(ctx->inflate_stream, requested, data,
-                                      len);
-            if (SERF_BUCKET_READ_ERROR(status)) {
+            status = inflate_buffer(bucket);
+            if (status) {
                 return status;
             }
-            /* Hide EOF. */
-            if (APR_STATUS_IS_EOF(status)) {
-                status = ctx->stream_status;
-                if (APR_STATUS_IS_EOF(status)) {
-                    /* We've read all of the data from our stream, but we
-                     * need to continue to iterate until we flush
-                     * out the zlib buffer.
-                     */
-                    status = APR_SUCCESS;
-                }
-            }
-            if (*len != 0) {
-                return status;
+
+            /* We tried; but nothing was inflated. */
+            if (ctx->out == ctx->zstream.next_out &&
+                ctx->state == STATE_INFLATE) {
+                return APR_STATUS_IS_EAGAIN(ctx->stream_status)
+                       ? APR_EAGAIN : APR_SUCCESS;
             }
+            break;
+        case STATE_DONE:
+            /* We're done inflating; the caller reads what's left of our
+               stream, so that all of it gets consumed. */
+            return APR_EOF;
+        default:
+            /* Not reachable */
+            return APR_EGENERAL;
+        }
+    }
 
-            /* We tried; but we have nothing buffered. Fetch more. */
-
-            /* It is possible that we maxed out avail_out before
-             * exhausting avail_in; therefore, continue using the
-             * previous buffer.  Otherwise, fetch more data from
-             * our stream bucket.
-             */
-            if (ctx->zstream.avail_in == 0) {
-                /* When we empty our inflated stream, we'll return this
-                 * status - this allow us to eventually pass up EAGAINs.
-                 */
-                ctx->stream_status = serf_bucket_read(ctx->stream,
-                                                      ctx->bufferSize,
-                                                      &private_data,
-                                                      &private_len);
-
-                if (SERF_BUCKET_READ_ERROR(ctx->stream_status)) {
-                    return ctx->stream_status;
-                }
+    return APR_SUCCESS;
+}
 
-                if (!private_len && APR_STATUS_IS_EAGAIN(ctx->stream_status)) {
-                    *len = 0;
-                    status = ctx->stream_status;
-                    ctx->stream_status = APR_SUCCESS;
-                    return status;
-                }
+/* The status to return with the last of the inflated data. */
+static apr_status_t drained_status(deflate_context_t *ctx)
+{
+    /* Only pass up an EAGAIN if zlib has nothing left for us either; it
+       may, if it stopped because the buffer was full. */
+    if (ctx->state == STATE_INFLATE && ctx->zstream.avail_out &&
+        ctx->zstream.avail_in == 0 &&
+        APR_STATUS_IS_EAGAIN(ctx->stream_status))
+        return APR_EAGAIN;
+
+    return APR_SUCCESS;
+}
 
-                ctx->zstream.next_in = (unsigned char*)private_data;
-                ctx->zstream.avail_in = private_len;
-            }
+static apr_status_t serf_deflate_read(serf_bucket_t *bucket,
+                                      apr_size_t requested,
+                                      const char **data, apr_size_t *len)
+{
+    deflate_context_t *ctx = bucket->data;
+    apr_status_t status;
+    apr_size_t avail;
+
+    status = deflate_fill(bucket);
+    if (status) {
+        *len = 0;
+        if (APR_STATUS_IS_EOF(status))
+            return serf_bucket_read(ctx->stream, requested, data, len);
+        return status;
+    }
 
-            while (1) {
+    avail = ctx->zstream.next_out - ctx->out;
+    *data = (const char *)ctx->out;
+    *len = (requested == SERF_READ_ALL_AVAIL || requested > avail)
+           ? avail : requested;
+    ctx->out += *len;
 
-                zRC = inflate(&ctx->zstream, Z_NO_FLUSH);
+    return ctx->out == ctx->zstream.next_out ? drained_status(ctx)
+                                             : APR_SUCCESS;
+}
 
-                /* We're full or zlib requires more space. Either case, clear
-                   out our buffer, reset, and return. */
-                if (zRC == Z_BUF_ERROR || ctx->zstream.avail_out == 0) {
-                    serf_bucket_t *tmp;
-                    ctx->zstream.next_out = ctx->buffer;
-                    private_len = ctx->bufferSize - ctx->zstream.avail_out;
+static apr_status_t serf_deflate_read_iovec(serf_bucket_t *bucket,
+                                            apr_size_t requested,
+                                            int vecs_size,
+                                            struct iovec *vecs,
+                                            int *vecs_used)
+{
+    deflate_context_t *ctx = bucket->data;
+    const char *data;
+    apr_size_t len;
+    apr_status_t status;
 
-                    ctx->crc = crc32(ctx->crc, (const Bytef *)ctx->buffer,
-                                     private_len);
+    *vecs_used = 0;
+    if (!vecs_size)
+        return APR_SUCCESS;
 
-                    /* FIXME: There probably needs to be a free func. */
-                    tmp = SERF_BUCKET_SIMPLE_STRING_LEN((char *)ctx->buffer,
-                                                        private_len,
-                                                        bucket->allocator);
-                    serf_bucket_aggregate_append(ctx->inflate_stream, tmp);
-                    ctx->zstream.avail_out = ctx->bufferSize;
-                    break;
-                }
+    if (ctx->state == STATE_DONE)
+        return serf_bucket_read_iovec(ctx->stream, requested, vecs_size,
+                                      vecs, vecs_used);
 
-                if (zRC == Z_STREAM_END) {
-                    serf_bucket_t *tmp;
-
-                    private_len = ctx->bufferSize - ctx->zstream.avail_out;
-                    ctx->crc = crc32(ctx->crc, (const Bytef *)ctx->buffer,
-                                     private_len);
-                    /* FIXME: There probably needs to be a free func. */
-                    tmp = SERF_BUCKET_SIMPLE_STRING_LEN((char *)ctx->buffer,
-                                                        private_len,
-                                                        bucket->allocator);
-                    serf_bucket_aggregate_append(ctx->inflate_stream, tmp);
-
-                    ctx->zstream.avail_out = ctx->bufferSize;
-
-                    /* Push back the remaining data to be read. */
-                    tmp = serf_bucket_aggregate_create(bucket->allocator);
-                    serf_bucket_aggregate_prepend(tmp, ctx->stream);
-                    ctx->stream = tmp;
-
-                    /* We now need to take the remaining avail_in and
-                     * throw it in ctx->stream so our next read picks it up.
-                     */
-                    tmp = SERF_BUCKET_SIMPLE_STRING_LEN(
-                                        (const char*)ctx->zstream.next_in,
-                                                     ctx->zstream.avail_in,
-                                                     bucket->allocator);
-                    serf_bucket_aggregate_prepend(ctx->stream, tmp);
-
-                    switch (ctx->format) {
-                    case SERF_DEFLATE_GZIP:
-                        ctx->stream_left = ctx->stream_size =
-                            DEFLATE_VERIFY_SIZE;
-                        ctx->state++;
-                        break;
-                    case SERF_DEFLATE_DEFLATE:
-                        /* Deflate does not have a verify footer. */
-                        ctx->state = STATE_FINISH;
-                        break;
-                    default:
-                        /* Not reachable */
-                        return APR_EGENERAL;
-                    }
-
-                    break;
-                }
+    status = serf_deflate_read(bucket, requested, &data, &len);
+    if (len) {
+        vecs[0].iov_base = (char *)data;
+        vecs[0].iov_len = len;
+        *vecs_used = 1;
+    }
 
-                /* Any other error? */
-                if (zRC != Z_OK) {
-                    return SERF_ERROR_DECOMPRESSION_FAILED;
-                }
+    return status;
+}
 
-                /* As long as zRC == Z_OK, just keep looping. */
-            }
-            /* Okay, we've inflated.  Try to read. */
-            status = serf_bucket_read(ctx->inflate_stream, requested, data,
-                                      len);
-            /* Hide EOF. */
-            if (APR_STATUS_IS_EOF(status)) {
-                status = ctx->stream_status;
-
-                /* If the inflation wasn't finished, return APR_SUCCESS. */
-                if (zRC != Z_STREAM_END)
-                    return APR_SUCCESS;
-
-                /* If our stream is finished too and all data was inflated,
-                 * return SUCCESS so we'll iterate one more time.
-                 */
-                if (APR_STATUS_IS_EOF(status)) {
-                    /* No more data to read from the stream, and everything
-                       inflated. If all data was received correctly, state
-                       should have been advanced to STATE_READING_VERIFY or
-                       STATE_FINISH. If not, then the data was incomplete
-                       and we have an error. */
-                    if (ctx->state != STATE_INFLATE)
-                        return APR_SUCCESS;
-                    else
-                        return SERF_ERROR_DECOMPRESSION_FAILED;
-                }
-            }
-            return status;
-        case STATE_DONE:
-            /* We're done inflating.  Use our finished buffer. */
-            return serf_bucket_read(ctx->stream, requested, data, len);
-        default:
-            /* Not reachable */
-            return APR_EGENERAL;
-        }
+static apr_status_t serf_deflate_readline(serf_bucket_t *bucket,
+                                          int acceptable, int *found,
+                                          const char **data,
+                                          apr_size_t *len)
+{
+    deflate_context_t *ctx = bucket->data;
+    apr_status_t status;
+    const char *end;
+    apr_size_t remaining;
+
+    status = deflate_fill(bucket);
+    if (status) {
+        *found = SERF_NEWLINE_NONE;
+        *len = 0;
+        if (APR_STATUS_IS_EOF(status))
+            return serf_bucket_readline(ctx->stream, acceptable, found,
+                                        data, len);
+        return status;
     }
 
-    /* NOTREACHED */
+    *data = end = (const char *)ctx->out;
+    remaining = ctx->zstream.next_out - ctx->out;
+    serf_util_readline(&end, &remaining, acceptable, found);
+
+    *len = end - *data;
+    ctx->out += *len;
+
+    return ctx->out == ctx->zstream.next_out ? drained_status(ctx)
+                                             : APR_SUCCESS;
 }
 
-/* ### need to implement */
-#define serf_deflate_readline NULL
-#define serf_deflate_peek NULL
+static apr_status_t serf_deflate_peek(serf_bucket_t *bucket,
+                                      const char **data,
+                                      apr_size_t *len)
+{
+    deflate_context_t *ctx = bucket->data;
+
+    if (ctx->state == STATE_DONE)
+        return serf_bucket_peek(ctx->stream, data, len);
+
+    /* Only what is inflated already; inflating more would mean reading
+       the stream. */
+    *data = (const char *)ctx->out;
+    *len = ctx->zstream.next_out - ctx->out;
+
+    return APR_SUCCESS;
+}
 
 const serf_bucket_type_t serf_bucket_type_deflate = {
     "DEFLATE",
     serf_deflate_read,
     serf_deflate_readline,
-    serf_default_read_iovec,
+    serf_deflate_read_iovec,
     serf_default_read_for_sendfile,
     serf_default_read_bucket,
     serf_deflate_peek,
     serf_deflate_destroy_and_data,
 };
+
+
+/* ==================================================================== */
+
+/* Size of the buffer the compressed data is written to. */
+#define DEFLATE_ENCODE_BUFFER_SIZE 16384
+
+typedef struct {
+    serf_bucket_t *stream;
+
+    int format;
+    int level;
+    int window_bits;
+
+    enum {
+        STATE_ENCODE_INIT,      /* zlib isn't set up yet */
+        STATE_ENCODE,           /* compressing the stream */
+        STATE_ENCODE_DONE       /* all compressed data was produced */
+    } state;
+
+    z_stream zstream;
+
+    /* Status of the last read of the stream. */
+    apr_status_t stream_status;
+
+    /* Compressed data not yet returned: from OUT up to zstream.next_out. */
+    unsigned char *out;
+
+    unsigned char buffer[DEFLATE_ENCODE_BUFFER_SIZE];
+} deflate_encode_context_t;
+
+serf_bucket_t *serf_bucket_deflate_encode_create(
+    serf_bucket_t *stream,
+    serf_bucket_alloc_t *allocator,
+    int format,
+    int level,
+    int window_bits)
+{
+    deflate_encode_context_t *ctx;
+
+    if (format != SERF_DEFLATE_GZIP && format != SERF_DEFLATE_DEFLATE)
+        return NULL;
+
+    ctx = serf_bucket_mem_alloc(allocator, sizeof(*ctx));
+    ctx->stream = stream;
+    ctx->format = format;
+    ctx->level = level;
+    ctx->window_bits = window_bits ? window_bits : 15;
+    ctx->state = STATE_ENCODE_INIT;
+    ctx->stream_status = APR_SUCCESS;
+    ctx->out = ctx->buffer;
+
+    /* zstream must be NULL'd out. */
+    memset(&ctx->zstream, 0, sizeof(ctx->zstream));
+    ctx->zstream.next_out = ctx->buffer;
+
+    return serf_bucket_create(&serf_bucket_type_deflate_encode, allocator, ctx);
+}
+
+static void serf_deflate_encode_destroy(serf_bucket_t *bucket)
+{
+    deflate_encode_context_t *ctx = bucket->data;
+
+    if (ctx->state != STATE_ENCODE_INIT)
+        deflateEnd(&ctx->zstream);
+
+    serf_bucket_destroy(ctx->stream);
+
+    serf_default_destroy_and_data(bucket);
+}
+
+/* Fill the buffer with compressed data of the stream, as much as there is
+   room and input for. zlib copies the input it consumes, so the stream is
+   only read again once all of its previous data was consumed. */
+static apr_status_t compress_stream(deflate_encode_context_t *ctx)
+{
+    int zerr;
+
+    if (ctx->state == STATE_ENCODE_INIT) {
+        /* zlib writes the gzip header and trailer when asked to. */
+        zerr = deflateInit2(&ctx->zstream, ctx->level, Z_DEFLATED,
+                            ctx->format == SERF_DEFLATE_GZIP
+                                ? ctx->window_bits + 16
+                                : -ctx->window_bits,
+                            8, Z_DEFAULT_STRATEGY);
+        if (zerr != Z_OK)
+            return SERF_ERROR_COMPRESSION_FAILED;
+
+        ctx->state = STATE_ENCODE;
+    }
+
+    ctx->out = ctx->buffer;
+    ctx->zstream.next_out = ctx->buffer;
+    ctx->zstream.avail_out = sizeof(ctx->buffer);
+
+    while (ctx->state == STATE_ENCODE && ctx->zstream.avail_out) {
+        if (!ctx->zstream.avail_in &&
+            !APR_STATUS_IS_EOF(ctx->stream_status)) {
+            const char *data;
+            apr_size_t len;
+            apr_status_t status;
+
+            status = serf_bucket_read(ctx->stream, SERF_READ_ALL_AVAIL,
+                                      &data, &len);
+            if (SERF_BUCKET_READ_ERROR(status))
+                return status;
+
+            ctx->stream_status = status;
+            ctx->zstream.next_in = (Bytef *)data;
+            ctx->zstream.avail_in = (uInt)len;
+
+            /* Wait for more input, rather than looping for it. */
+            if (!len && !APR_STATUS_IS_EOF(status))
+                break;
+        }
+
+        zerr = deflate(&ctx->zstream,
+                       APR_STATUS_IS_EOF(ctx->stream_status) ? Z_FINISH
+                                                             : Z_NO_FLUSH);
+        if (zerr == Z_STREAM_END) {
+            ctx->state = STATE_ENCODE_DONE;
+        }
+        else if (zerr != Z_OK && zerr != Z_BUF_ERROR) {
+            return SERF_ERROR_COMPRESSION_FAILED;
+        }
+
+        /* zlib may hold on to all of the input; read more of it, unless
+           the stream told us to wait. */
+        if (!ctx->zstream.avail_in &&
+            APR_STATUS_IS_EAGAIN(ctx->stream_status))
+            break;
+    }
+
+    return APR_SUCCESS;
+}
+
+/* Make compressed data available in the buffer, if we can. Returns the
+   status to report once all of it was returned. */
+static apr_status_t prepare_output(deflate_encode_context_t *ctx,
+                                   apr_status_t *drained_status)
+{
+    apr_status_t status;
+
+    if (ctx->out == ctx->zstream.next_out && ctx->state != STATE_ENCODE_DONE) {
+        status = compress_stream(ctx);
+        if (status)
+            return status;
+    }
+
+    if (ctx->state == STATE_ENCODE_DONE)
+        *drained_status = APR_EOF;
+    else if (!ctx->zstream.avail_in &&
+             APR_STATUS_IS_EAGAIN(ctx->stream_status))
+        *drained_status = APR_EAGAIN;
+    else
+        *drained_status = APR_SUCCESS;
+
+    return APR_SUCCESS;
+}
+
+static apr_status_t serf_deflate_encode_read(serf_bucket_t *bucket,
+                                             apr_size_t requested,
+                                             const char **data,
+                                             apr_size_t *len)
+{
+    deflate_encode_context_t *ctx = bucket->data;
+    apr_status_t drained_status;
+    apr_status_t status;
+    apr_size_t avail;
+
+    *len = 0;
+
+    status = prepare_output(ctx, &drained_status);
+    if (status)
+        return status;
+
+    avail = ctx->zstream.next_out - ctx->out;
+    *data = (const char *)ctx->out;
+    *len = (requested == SERF_READ_ALL_AVAIL || requested > avail)
+           ? avail : requested;
+    ctx->out += *len;
+
+    return ctx->out == ctx->zstream.next_out ? drained_status : APR_SUCCESS;
+}
+
+static apr_status_t serf_deflate_encode_read_iovec(serf_bucket_t *bucket,
+                                                   apr_size_t requested,
+                                                   int vecs_size,
+                                                   struct iovec *vecs,
+                                                   int *vecs_used)
+{
+    const char *data;
+    apr_size_t len;
+    apr_status_t status;
+
+    *vecs_used = 0;
+    if (!vecs_size)
+        return APR_SUCCESS;
+
+    status = serf_deflate_encode_read(bucket, requested, &data, &len);
+    if (len) {
+        vecs[0].iov_base = (char *)data;
+        vecs[0].iov_len = len;
+        *vecs_used = 1;
+    }
+
+    return status;
+}
+
+static apr_status_t serf_deflate_encode_readline(serf_bucket_t *bucket,
+                                                 int acceptable, int *found,
+                                                 const char **data,
+                                                 apr_size_t *len)
+{
+    deflate_encode_context_t *ctx = bucket->data;
+    apr_status_t drained_status;
+    apr_status_t status;
+    const char *end;
+    apr_size_t remaining;
+
+    *found = SERF_NEWLINE_NONE;
+    *len = 0;
+
+    status = prepare_output(ctx, &drained_status);
+    if (status)
+        return status;
+
+    *data = end = (const char *)ctx->out;
+    remaining = ctx->zstream.next_out - ctx->out;
+    serf_util_readline(&end, &remaining, acceptable, found);
+
+    *len = end - *data;
+    ctx->out += *len;
+
+    return ctx->out == ctx->zstream.next_out ? drained_status : APR_SUCCESS;
+}
+
+static apr_status_t serf_deflate_encode_peek(serf_bucket_t *bucket,
+                                             const char **data,
+                                             apr_size_t *len)
+{
+    deflate_encode_context_t *ctx = bucket->data;
+
+    *data = (const char *)ctx->out;
+    *len = ctx->zstream.next_out - ctx->out;
+
+    return (!*len && ctx->state == STATE_ENCODE_DONE) ? APR_EOF
+                                                      : APR_SUCCESS;
+}
+
+const serf_bucket_type_t serf_bucket_type_deflate_encode = {
+    "DEFLATE-ENCODE",
+    serf_deflate_encode_read,
+    serf_deflate_encode_readline,
+    serf_deflate_encode_read_iovec,
+    serf_default_read_for_sendfile,
+    serf_default_read_bucket,
+    serf_deflate_encode_peek,
+    serf_deflate_encode_destroy,
+};
@@ -17,11 +17,22 @@
 
 #include "serf.h"
 #include "serf_bucket_util.h"
+#include "serf_private.h"
 
 typedef struct {
     apr_file_t *file;
 
-    serf_databuf_t databuf;
+    /* Offset in FILE of the next byte to be read into DATABUF, and the
+       size of FILE. Both are only tracked once read_for_sendfile has been
+       used on this bucket; until then SIZE is -1. */
+    apr_off_t offset;
+    apr_off_t size;
+
+    /* The file position was moved by a sendfile consumer, so it must be
+       set back to OFFSET before the next read. */
+    int need_seek;
+
+    serf_dynbuf_t databuf;
 
 } file_context_t;
 
@@ -30,9 +41,24 @@ static apr_status_t file_reader(void *baton, apr_size_t bufsize,
                                 char *buf, apr_size_t *len)
 {
     file_context_t *ctx = baton;
+    apr_status_t status;
+
+    if (ctx->need_seek) {
+        apr_off_t offset = ctx->offset;
+
+        status = apr_file_seek(ctx->file, APR_SET, &offset);
+        if (status)
+            return status;
+        ctx->need_seek = 0;
+    }
 
     *len = bufsize;
-    return apr_file_read(ctx->file, buf, len);
+    status = apr_file_read(ctx->file, buf, len);
+
+    if (ctx->size >= 0)
+        ctx->offset += *len;
+
+    return status;
 }
 
 serf_bucket_t *serf_bucket_file_create(
@@ -62,7 +88,8 @@ serf_bucket_t *serf_bucket_file_create(
                                  serf_bucket_allocator_get_pool(allocator));
 
         if (status == APR_SUCCESS) {
-            return serf_bucket_mmap_create(file_mmap, allocator);
+            return serf__bucket_mmap_create_for_file(file_mmap, file,
+                                                     allocator);
         }
     }
 #endif
@@ -70,21 +97,38 @@ serf_bucket_t *serf_bucket_file_create(
     /* Oh, well. */
     ctx = serf_bucket_mem_alloc(allocator, sizeof(*ctx));
     ctx->file = file;
+    ctx->offset = 0;
+    ctx->size = -1;
+    ctx->need_seek = 0;
 
-    serf_databuf_init(&ctx->databuf);
+    serf_dynbuf_init(&ctx->databuf, allocator, SERF_DATABUF_BUFSIZE,
+                     SERF_DYNBUF_MAX_SIZE);
     ctx->databuf.read = file_reader;
     ctx->databuf.read_baton = ctx;
 
     return serf_bucket_create(&serf_bucket_type_file, allocator, ctx);
 }
 
+void serf_bucket_file_set_buffer_size(
+    serf_bucket_t *bucket,
+    apr_size_t min_size,
+    apr_size_t max_size)
+{
+    file_context_t *ctx = bucket->data;
+
+    if (!SERF_BUCKET_IS_FILE(bucket))
+        return;
+
+    serf_dynbuf_set_size(&ctx->databuf, min_size, max_size);
+}
+
 static apr_status_t serf_file_read(serf_bucket_t *bucket,
                                    apr_size_t requested,
                                    const char **data, apr_size_t *len)
 {
     file_context_t *ctx = bucket->data;
 
-    return serf_databuf_read(&ctx->databuf, requested, data, len);
+    return serf_dynbuf_read(&ctx->databuf, requested, data, len);
 }
 
 static apr_status_t serf_file_readline(serf_bucket_t *bucket,
@@ -93,7 +137,69 @@ static apr_status_t serf_file_readline(serf_bucket_t *bucket,
 {
     file_context_t *ctx = bucket->data;
 
-    return serf_databuf_readline(&ctx->databuf, acceptable, found, data, len);
+    return serf_dynbuf_readline(&ctx->databuf, acceptable, found, data, len);
+}
+
+static apr_status_t serf_file_read_for_sendfile(serf_bucket_t *bucket,
+                                                apr_size_t requested,
+                                                apr_hdtr_t *hdtr,
+                                                apr_file_t **file,
+                                                apr_off_t *offset,
+                                                apr_size_t *len)
+{
+    file_context_t *ctx = bucket->data;
+    apr_off_t avail;
+
+    /* Anything already buffered has to go out first. If the file can't
+       tell us where we are (a pipe, say), keep using plain reads. */
+    if (ctx->databuf.remaining || ctx->databuf.status || ctx->size == -2) {
+        return serf_default_read_for_sendfile(bucket, requested, hdtr,
+                                              file, offset, len);
+    }
+
+    if (ctx->size == -1) {
+        apr_finfo_t finfo;
+        apr_off_t pos = 0;
+
+        /* The buffer is empty, so the file position is where we are. */
+        if (apr_file_seek(ctx->file, APR_CUR, &pos)
+            || apr_file_info_get(&finfo, APR_FINFO_SIZE, ctx->file)) {
+            ctx->size = -2;
+            return serf_default_read_for_sendfile(bucket, requested, hdtr,
+                                                  file, offset, len);
+        }
+        ctx->offset = pos;
+        ctx->size = finfo.size;
+    }
+
+    hdtr->numheaders = 0;
+    hdtr->numtrailers = 0;
+
+    avail = ctx->size - ctx->offset;
+    if (avail <= 0) {
+        *file = NULL;
+        ctx->databuf.status = APR_EOF;
+        return APR_EOF;
+    }
+    if (requested != SERF_READ_ALL_AVAIL && (apr_size_t)avail > requested)
+        avail = requested;
+    if ((apr_uint64_t)avail > REQUESTED_MAX)
+        avail = REQUESTED_MAX;
+
+    *file = ctx->file;
+    *offset = ctx->offset;
+    *len = (apr_size_t)avail;
+
+    /* The data is consumed. The caller may move the file position, so
+       reposition before any later read. */
+    ctx->offset += avail;
+    ctx->need_seek = 1;
+
+    if (ctx->offset == ctx->size) {
+        ctx->databuf.status = APR_EOF;
+        return APR_EOF;
+    }
+    return APR_SUCCESS;
 }
 
 static apr_status_t serf_file_peek(serf_bucket_t *bucket,
@@ -102,7 +208,16 @@ static apr_status_t serf_file_peek(serf_bucket_t *bucket,
 {
     file_context_t *ctx = bucket->data;
 
-    return serf_databuf_peek(&ctx->databuf, data, len);
+    return serf_dynbuf_peek(&ctx->databuf, data, len);
+}
+
+static void serf_file_destroy(serf_bucket_t *bucket)
+{
+    file_context_t *ctx = bucket->data;
+
+    serf_dynbuf_destroy(&ctx->databuf);
+
+    serf_default_destroy_and_data(bucket);
 }
 
 const serf_bucket_type_t serf_bucket_type_file = {
@@ -110,8 +225,8 @@ const serf_bucket_type_t serf_bucket_type_file = {
     serf_file_read,
     serf_file_readline,
     serf_default_read_iovec,
-    serf_default_read_for_sendfile,
+    serf_file_read_for_sendfile,
     serf_default_read_bucket,
     serf_file_peek,
-    serf_default_destroy_and_data,
+    serf_file_destroy,
 };
@@ -16,11 +16,12 @@
 #include <stdlib.h>
 
 #include <apr_general.h>  /* for strcasecmp() */
+#include <apr_lib.h>
 
 #include "serf.h"
 #include "serf_bucket_util.h"
 
-#include "serf_private.h" /* for serf__bucket_headers_remove */
+#include "serf_private.h"
 
 
 typedef struct header_list {
@@ -30,17 +31,49 @@ typedef struct header_list {
     apr_size_t header_size;
     apr_size_t value_size;
 
+    /* Case-insensitive hash of HEADER, see hash_header(). */
+    apr_uint32_t hash;
+
+    /* Well-known name of HEADER, or SERF__HDR_UNKNOWN. */
+    serf__header_token_t token;
+
     int alloc_flags;
 #define ALLOC_HEADER 0x0001  /* header lives in our allocator */
 #define ALLOC_VALUE  0x0002  /* value lives in our allocator */
 
     struct header_list *next;
+
+    /* The following are only valid while the bucket has an index. The
+       first header of a given name is in the index; the others with the
+       same name hang off it through NEXT_DUP. */
+    struct header_list *next_hash;  /* next name in the same index slot */
+    struct header_list *next_dup;   /* next header with the same name */
+    struct header_list *last_dup;   /* first of a name: last with the name */
+
+    /* First of a name: the value get() returned for it, if it joined
+       several. It survives rebuilds of the index, and is only freed when
+       the name is set again or removed, or the bucket is destroyed. */
+    char *joined;
 } header_list_t;
 
+/* Memory handed out by serf__bucket_headers_alloc(). */
+typedef struct header_block {
+    struct header_block *next;
+} header_block_t;
+
 typedef struct {
     header_list_t *list;
     header_list_t *last;
 
+    /* Blocks of memory owned by the bucket, freed on destroy. */
+    header_block_t *blocks;
+
+    /* Index of the headers by name, built on the first lookup. INDEX_SIZE
+       is a power of two; INDEX_NAMES counts the distinct names in it. */
+    header_list_t **index;
+    apr_size_t index_size;
+    apr_size_t index_names;
+
     header_list_t *cur_read;
     enum {
         READ_START,     /* haven't started reading yet */
@@ -53,9 +86,251 @@ typedef struct {
     } state;
     apr_size_t amt_read; /* how much of the current state we've read */
 
+    /* The headers serialized by read_remaining(), if it copied them. */
+    char *flat;
+
 } headers_context_t;
 
 
+/* The smallest index we build. */
+#define MIN_INDEX_SIZE 16
+
+/* Headers of up to this many bytes are copied into one buffer when they
+   are read at once, rather than handed out as four fragments per header. */
+#define FLATTEN_MAX 8192
+
+/* The well-known header names, indexed by serf__header_token_t. */
+static const struct {
+    const char *name;
+    apr_size_t size;
+} well_known[SERF__HDR_COUNT] = {
+    { NULL, 0 },
+    { "Accept", sizeof("Accept") - 1 },
+    { "Accept-Encoding", sizeof("Accept-Encoding") - 1 },
+    { "Accept-Language", sizeof("Accept-Language") - 1 },
+    { "Accept-Ranges", sizeof("Accept-Ranges") - 1 },
+    { "Age", sizeof("Age") - 1 },
+    { "Allow", sizeof("Allow") - 1 },
+    { "Authorization", sizeof("Authorization") - 1 },
+    { "Authentication-Info", sizeof("Authentication-Info") - 1 },
+    { "Cache-Control", sizeof("Cache-Control") - 1 },
+    { "Connection", sizeof("Connection") - 1 },
+    { "Content-Encoding", sizeof("Content-Encoding") - 1 },
+    { "Content-Length", sizeof("Content-Length") - 1 },
+    { "Content-Location", sizeof("Content-Location") - 1 },
+    { "Content-Range", sizeof("Content-Range") - 1 },
+    { "Content-Type", sizeof("Content-Type") - 1 },
+    { "Cookie", sizeof("Cookie") - 1 },
+    { "Date", sizeof("Date") - 1 },
+    { "ETag", sizeof("ETag") - 1 },
+    { "Expect", sizeof("Expect") - 1 },
+    { "Expires", sizeof("Expires") - 1 },
+    { "Host", sizeof("Host") - 1 },
+    { "If-Modified-Since", sizeof("If-Modified-Since") - 1 },
+    { "If-None-Match", sizeof("If-None-Match") - 1 },
+    { "Keep-Alive", sizeof("Keep-Alive") - 1 },
+    { "Last-Modified", sizeof("Last-Modified") - 1 },
+    { "Location", sizeof("Location") - 1 },
+    { "Proxy-Authenticate", sizeof("Proxy-Authenticate") - 1 },
+    { "Proxy-Authentication-Info", sizeof("Proxy-Authentication-Info") - 1 },
+    { "Proxy-Authorization", sizeof("Proxy-Authorization") - 1 },
+    { "Proxy-Connection", sizeof("Proxy-Connection") - 1 },
+    { "Retry-After", sizeof("Retry-After") - 1 },
+    { "Server", sizeof("Server") - 1 },
+    { "Set-Cookie", sizeof("Set-Cookie") - 1 },
+    { "TE", sizeof("TE") - 1 },
+    { "Trailer", sizeof("Trailer") - 1 },
+    { "Transfer-Encoding", sizeof("Transfer-Encoding") - 1 },
+    { "Upgrade", sizeof("Upgrade") - 1 },
+    { "User-Agent", sizeof("User-Agent") - 1 },
+    { "Vary", sizeof("Vary") - 1 },
+    { "Via", sizeof("Via") - 1 },
+    { "WWW-Authenticate", sizeof("WWW-Authenticate") - 1 },
+};
+
+/* Perfect hash of the well-known names: the key built from the first and
+   last character and the length of a name selects one slot of
+   WELL_KNOWN_SLOTS, which holds the only token the name can be. The table
+   has to be regenerated when a name is added. */
+#define WELL_KNOWN_KEY(first, last, size) \
+    (((apr_uint32_t)(first) << 16) | ((apr_uint32_t)(last) << 8) | (size))
+#define WELL_KNOWN_SLOT(key) \
+    ((apr_uint32_t)((key) * 0xca542ae3U) >> 25)
+
+static const unsigned char well_known_slots[128] = {
+     0,  0, 28, 40, 24,  0,  0, 23, 14,  0,  0,  0, 11,  0,  0, 17,
+     1,  0,  0,  0,  0,  0,  0,  0,  0, 27,  0,  0, 34, 22,  0, 25,
+     0, 20, 31, 15,  0,  0,  0,  3,  0,  6,  4, 37,  0,  0,  0,  9,
+    33,  0, 13,  0,  0,  0,  0,  0,  0, 35,  0,  0,  0,  0, 32,  0,
+     0,  0,  0,  0, 16,  0,  0,  0,  0, 30, 26,  0,  0,  0,  0,  0,
+     0,  0, 38, 10,  0,  0,  0,  0,  7,  0,  0, 39, 21, 36,  0,  0,
+     0,  8,  0,  0, 41,  0, 19,  0,  0,  5,  0, 12,  0,  0,  0,  0,
+     0,  0,  0,  0,  0,  0,  0,  0, 29, 18,  0,  0,  2,  0,  0,  0
+};
+
+serf__header_token_t serf__header_token(const char *header,
+                                        apr_size_t header_size)
+{
+    apr_uint32_t key;
+    int token;
+
+    if (header_size == 0 || header_size > 255)
+        return SERF__HDR_UNKNOWN;
+
+    key = WELL_KNOWN_KEY(apr_tolower(header[0]),
+                         apr_tolower(header[header_size - 1]),
+                         header_size);
+    token = well_known_slots[WELL_KNOWN_SLOT(key)];
+
+    if (token != SERF__HDR_UNKNOWN
+        && well_known[token].size == header_size
+        && strncasecmp(well_known[token].name, header, header_size) == 0)
+        return token;
+
+    return SERF__HDR_UNKNOWN;
+}
+
+/* FNV-1a over the ASCII-lowercased header name. */
+static apr_uint32_t hash_header(const char *header, apr_size_t header_size)
+{
+    apr_uint32_t hash = 2166136261U;
+    apr_size_t i;
+
+    for (i = 0; i < header_size; i++) {
+        unsigned char c = header[i];
+
+        if (c >= 'A' && c <= 'Z')
+            c += 'a' - 'A';
+        hash = (hash ^ c) * 16777619U;
+    }
+
+    return hash;
+}
+
+/* Well-known names hash to their token, which spreads them over the
+   index without looking at the name again. */
+static apr_uint32_t header_hash(serf__header_token_t token,
+                                const char *header, apr_size_t header_size)
+{
+    if (token != SERF__HDR_UNKNOWN)
+        return token;
+
+    return hash_header(header, header_size);
+}
+
+static int header_matches(const header_list_t *hdr,
+                          serf__header_token_t token, apr_uint32_t hash,
+                          const char *header, apr_size_t header_size)
+{
+    /* A name is well-known whatever its case, so two names are only
+       equal if their tokens are. */
+    if (hdr->token != token)
+        return 0;
+    if (token != SERF__HDR_UNKNOWN)
+        return 1;
+
+    return hdr->hash == hash
+           && hdr->header_size == header_size
+           && strncasecmp(hdr->header, header, header_size) == 0;
+}
+
+static void free_index(serf_bucket_t *bkt)
+{
+    headers_context_t *ctx = bkt->data;
+
+    if (!ctx->index)
+        return;
+
+    serf_bucket_mem_free(bkt->allocator, ctx->index);
+    ctx->index = NULL;
+    ctx->index_size = 0;
+    ctx->index_names = 0;
+}
+
+/* Add HDR, which must be at the end of the list, to the index of CTX.
+   Returns the first header with the same name, which may be HDR. */
+static header_list_t *index_header(headers_context_t *ctx, header_list_t *hdr)
+{
+    header_list_t **slot = &ctx->index[hdr->hash & (ctx->index_size - 1)];
+    header_list_t *first;
+
+    hdr->next_hash = NULL;
+    hdr->next_dup = NULL;
+    hdr->last_dup = hdr;
+
+    for (first = *slot; first; first = first->next_hash) {
+        if (header_matches(first, hdr->token, hdr->hash, hdr->header,
+                           hdr->header_size)) {
+            first->last_dup->next_dup = hdr;
+            first->last_dup = hdr;
+            return first;
+        }
+    }
+
+    hdr->next_hash = *slot;
+    *slot = hdr;
+    ctx->index_names++;
+
+    return hdr;
+}
+
+/* (Re)build the index of BKT for at least NAMES distinct names. */
+static void build_index(serf_bucket_t *bkt, apr_size_t names)
+{
+    headers_context_t *ctx = bkt->data;
+    apr_size_t size = MIN_INDEX_SIZE;
+    header_list_t *scan;
+
+    free_index(bkt);
+
+    /* Keep the index at most half full. */
+    while (size < names * 2)
+        size *= 2;
+
+    ctx->index = serf_bucket_mem_calloc(bkt->allocator,
+                                        size * sizeof(*ctx->index));
+    ctx->index_size = size;
+
+    for (scan = ctx->list; scan; scan = scan->next)
+        index_header(ctx, scan);
+}
+
+/* Return the first header named HEADER in BKT, or NULL. TOKEN is the
+   well-known token of HEADER. */
+static header_list_t *find_header(serf_bucket_t *bkt,
+                                  serf__header_token_t token,
+                                  const char *header,
+                                  apr_size_t header_size)
+{
+    headers_context_t *ctx = bkt->data;
+    apr_uint32_t hash = header_hash(token, header, header_size);
+    header_list_t *scan;
+
+    if (!ctx->list)
+        return NULL;
+
+    if (!ctx->index)
+        build_index(bkt, 0);
+
+    for (scan = ctx->index[hash & (ctx->index_size - 1)];
+         scan;
+         scan = scan->next_hash) {
+        if (header_matches(scan, token, hash, header, header_size))
+            return scan;
+    }
+
+    return NULL;
+}
+
+static header_list_t *find_header_str(serf_bucket_t *bkt,
+                                      const char *header)
+{
+    apr_size_t header_size = strlen(header);
+
+    return find_header(bkt, serf__header_token(header, header_size),
+                       header, header_size);
+}
+
 serf_bucket_t *serf_bucket_headers_create(
     serf_bucket_alloc_t *allocator)
 {
@@ -64,7 +339,12 @@ serf_bucket_t *serf_bucket_headers_create(
     ctx = serf_bucket_mem_alloc(allocator, sizeof(*ctx));
     ctx->list = NULL;
     ctx->last = NULL;
+    ctx->blocks = NULL;
+    ctx->index = NULL;
+    ctx->index_size = 0;
+    ctx->index_names = 0;
     ctx->state = READ_START;
+    ctx->flat = NULL;
 
     return serf_bucket_create(&serf_bucket_type_headers, allocator, ctx);
 }
@@ -88,10 +368,18 @@ void serf_bucket_headers_setx(
     hdr = serf_bucket_mem_alloc(bkt->allocator, sizeof(*hdr));
     hdr->header_size = header_size;
     hdr->value_size = value_size;
+    hdr->token = serf__header_token(header, header_size);
+    hdr->hash = header_hash(hdr->token, header, header_size);
     hdr->alloc_flags = 0;
     hdr->next = NULL;
+    hdr->joined = NULL;
 
-    if (header_copy) {
+    /* A well-known name in its canonical spelling needs no copy. */
+    if (header_copy && hdr->token != SERF__HDR_UNKNOWN
+        && memcmp(header, well_known[hdr->token].name, header_size) == 0) {
+        hdr->header = well_known[hdr->token].name;
+    }
+    else if (header_copy) {
         hdr->header = serf_bstrmemdup(bkt->allocator, header, header_size);
         hdr->alloc_flags |= ALLOC_HEADER;
     }
@@ -114,6 +402,27 @@ void serf_bucket_headers_setx(
         ctx->list = hdr;
 
     ctx->last = hdr;
+
+    /* Keep an existing index up to date. Without one, no name has a
+       joined value. */
+    if (ctx->index) {
+        header_list_t *first;
+
+        if ((ctx->index_names + 1) * 2 > ctx->index_size) {
+            build_index(bkt, ctx->index_names + 1);
+            first = find_header(bkt, hdr->token, hdr->header,
+                                hdr->header_size);
+        }
+        else {
+            first = index_header(ctx, hdr);
+        }
+
+        /* A new value invalidates the joined value of its name. */
+        if (first->joined) {
+            serf_bucket_mem_free(bkt->allocator, first->joined);
+            first->joined = NULL;
+        }
+    }
 }
 
 void serf_bucket_headers_set(
@@ -146,74 +455,151 @@ void serf_bucket_headers_setn(
                              value, strlen(value), 0);
 }
 
+/* Return the value of FIRST and the other headers of its name. */
+static const char *get_value(serf_bucket_t *headers_bucket,
+                             header_list_t *first)
+{
+    header_list_t *scan;
+    apr_size_t joined_size;
+    char *p;
+
+    if (!first)
+        return NULL;
+    if (!first->next_dup)
+        return first->value;
+    if (first->joined)
+        return first->joined;
+
+    /* The header is present more than once.  RFC 2616, section 4.2
+       indicates that we should join the values, separated by a comma.
+       Reasoning: for headers whose values are known to be comma-separated,
+       that is clearly the correct behavior; for others, the correct
+       behavior is undefined anyway.
+
+       The joined value is kept until the bucket is destroyed or this header
+       is set again or removed, so repeated lookups don't allocate. */
+    joined_size = 0;
+    for (scan = first; scan; scan = scan->next_dup)
+        joined_size += scan->value_size + 1;
+
+    /* The last ',' becomes the terminating '\0'. */
+    p = first->joined = serf_bucket_mem_alloc(headers_bucket->allocator,
+                                              joined_size);
+    for (scan = first; scan; scan = scan->next_dup) {
+        memcpy(p, scan->value, scan->value_size);
+        p += scan->value_size;
+        *p++ = ',';
+    }
+    p[-1] = '\0';
+
+    return first->joined;
+}
+
 const char *serf_bucket_headers_get(
     serf_bucket_t *headers_bucket,
     const char *header)
+{
+    return get_value(headers_bucket, find_header_str(headers_bucket, header));
+}
+
+const char *serf__bucket_headers_get_token(
+    serf_bucket_t *headers_bucket,
+    serf__header_token_t token)
+{
+    return get_value(headers_bucket,
+                     find_header(headers_bucket, token,
+                                 well_known[token].name,
+                                 well_known[token].size));
+}
+
+const char *serf_bucket_headers_iter_first(
+    serf_bucket_headers_iter_t *iter,
+    serf_bucket_t *headers_bucket,
+    const char *header,
+    apr_size_t *value_size)
+{
+    header_list_t *found = find_header_str(headers_bucket, header);
+
+    iter->next = found;
+
+    return serf_bucket_headers_iter_next(iter, value_size);
+}
+
+const char *serf_bucket_headers_iter_next(
+    serf_bucket_headers_iter_t *iter,
+    apr_size_t *value_size)
+{
+    const header_list_t *found = iter->next;
+
+    if (!found)
+        return NULL;
+
+    iter->next = found->next_dup;
+    if (value_size)
+        *value_size = found->value_size;
+
+    return found->value;
+}
+
+void *serf__bucket_headers_alloc(serf_bucket_t *headers_bucket,
+                                 apr_size_t size)
 {
     headers_context_t *ctx = headers_bucket->data;
-    header_list_t *found = ctx->list;
-    const char *val = NULL;
-    int value_size = 0;
-    int val_alloc = 0;
-
-    while (found) {
-        if (strcasecmp(found->header, header) == 0) {
-            if (val) {
-                /* The header is already present.  RFC 2616, section 4.2
-                   indicates that we should append the new value, separated by
-                   a comma.  Reasoning: for headers whose values are known to
-                   be comma-separated, that is clearly the correct behavior;
-                   for others, the correct behavior is undefined anyway. */
-
-                /* The "+1" is for the comma; the +1 in the alloc
-                   call is for the terminating '\0' */
-                apr_size_t new_size = found->value_size + value_size + 1;
-                char *new_val = serf_bucket_mem_alloc(headers_bucket->allocator,
-                                                      new_size + 1);
-                memcpy(new_val, val, value_size);
-                new_val[value_size] = ',';
-                memcpy(new_val + value_size + 1, found->value,
-                       found->value_size);
-                new_val[new_size] = '\0';
-                /* Copy the new value over the already existing value. */
-                if (val_alloc)
-                    serf_bucket_mem_free(headers_bucket->allocator, (void*)val);
-                val_alloc |= ALLOC_VALUE;
-                val = new_val;
-                value_size = new_size;
-            }
-            else {
-                val = found->value;
-                value_size = found->value_size;
-            }
-        }
-        found = found->next;
-    }
+    header_block_t *block;
+
+    block = serf_bucket_mem_alloc(headers_bucket->allocator,
+                                  sizeof(*block) + size);
+    block->next = ctx->blocks;
+    ctx->blocks = block;
 
-    return val;
+    return block + 1;
+}
+
+apr_size_t serf__bucket_headers_alloc_usable(apr_size_t size)
+{
+    return serf__bucket_mem_usable_size(size) - sizeof(header_block_t);
 }
 
 void serf__bucket_headers_remove(serf_bucket_t *bucket, const char *header)
 {
     headers_context_t *ctx = bucket->data;
     header_list_t *scan = ctx->list, *prev = NULL;
+    int had_index = ctx->index != NULL;
+    apr_size_t names = ctx->index_names;
+
+    /* The index is rebuilt below, so that the other names keep their
+       joined values. */
+    free_index(bucket);
 
     /* Find and delete all items with the same header (case insensitive) */
     while (scan) {
+        header_list_t *next_hdr = scan->next;
+
         if (strcasecmp(scan->header, header) == 0) {
             if (prev) {
-                prev->next = scan->next;
+                prev->next = next_hdr;
             } else {
-                ctx->list = scan->next;
+                ctx->list = next_hdr;
             }
             if (ctx->last == scan) {
-                ctx->last = NULL;
+                ctx->last = prev;
             }
+
+            if (scan->alloc_flags & ALLOC_HEADER)
+                serf_bucket_mem_free(bucket->allocator, (void *)scan->header);
+            if (scan->alloc_flags & ALLOC_VALUE)
+                serf_bucket_mem_free(bucket->allocator, (void *)scan->value);
+            if (scan->joined)
+                serf_bucket_mem_free(bucket->allocator, scan->joined);
+            serf_bucket_mem_free(bucket->allocator, scan);
         } else {
             prev = scan;
         }
-        scan = scan->next;
+        scan = next_hdr;
     }
+
+    if (had_index && ctx->list)
+        build_index(bucket, names);
 }
 
 void serf_bucket_headers_do(
@@ -232,11 +618,19 @@ void serf_bucket_headers_do(
     }
 }
 
-static void serf_headers_destroy_and_data(serf_bucket_t *bucket)
+/* Free all headers of BUCKET and the memory they use. */
+static void free_headers(serf_bucket_t *bucket)
 {
     headers_context_t *ctx = bucket->data;
     header_list_t *scan = ctx->list;
 
+    free_index(bucket);
+
+    if (ctx->flat) {
+        serf_bucket_mem_free(bucket->allocator, ctx->flat);
+        ctx->flat = NULL;
+    }
+
     while (scan) {
         header_list_t *next_hdr = scan->next;
 
@@ -244,10 +638,34 @@ static void serf_headers_destroy_and_data(serf_bucket_t *bucket)
             serf_bucket_mem_free(bucket->allocator, (void *)scan->header);
         if (scan->alloc_flags & ALLOC_VALUE)
             serf_bucket_mem_free(bucket->allocator, (void *)scan->value);
+        if (scan->joined)
+            serf_bucket_mem_free(bucket->allocator, scan->joined);
         serf_bucket_mem_free(bucket->allocator, scan);
 
         scan = next_hdr;
     }
+    ctx->list = NULL;
+    ctx->last = NULL;
+
+    while (ctx->blocks) {
+        header_block_t *next_block = ctx->blocks->next;
+
+        serf_bucket_mem_free(bucket->allocator, ctx->blocks);
+        ctx->blocks = next_block;
+    }
+}
+
+void serf__bucket_headers_clear(serf_bucket_t *headers_bucket)
+{
+    headers_context_t *ctx = headers_bucket->data;
+
+    free_headers(headers_bucket);
+    ctx->state = READ_START;
+}
+
+static void serf_headers_destroy_and_data(serf_bucket_t *bucket)
+{
+    free_headers(bucket);
 
     serf_default_destroy_and_data(bucket);
 }
@@ -397,6 +815,95 @@ static apr_status_t serf_headers_readline(serf_bucket_t *bucket,
     return status;
 }
 
+/* If the caller takes all of the remaining headers and we are at the
+   start of one, return them in a single call: copied into one buffer when
+   they are small, or else as fragments if they fit in VECS. Returns
+   non-zero and sets *STATUS when it did. */
+static int read_remaining(serf_bucket_t *bucket,
+                          apr_size_t requested,
+                          int vecs_size,
+                          struct iovec *vecs,
+                          int *vecs_used,
+                          apr_status_t *status)
+{
+    headers_context_t *ctx = bucket->data;
+    header_list_t *first, *scan;
+    apr_size_t total = 2;
+    int count = 0;
+
+    if (ctx->state == READ_START)
+        first = ctx->list;
+    else if (ctx->state == READ_HEADER && ctx->amt_read == 0)
+        first = ctx->cur_read;
+    else
+        return 0;
+
+    for (scan = first; scan; scan = scan->next) {
+        total += scan->header_size + 2 + scan->value_size + 2;
+        count++;
+    }
+
+    if (vecs_size < 1 || requested < total)
+        return 0;
+
+    if (!first) {
+        vecs[0].iov_base = "\r\n";
+        vecs[0].iov_len = 2;
+        *vecs_used = 1;
+    }
+    else if (total <= FLATTEN_MAX) {
+        char *p;
+
+        if (ctx->flat)
+            serf_bucket_mem_free(bucket->allocator, ctx->flat);
+        p = ctx->flat = serf_bucket_mem_alloc(bucket->allocator, total);
+
+        for (scan = first; scan; scan = scan->next) {
+            memcpy(p, scan->header, scan->header_size);
+            p += scan->header_size;
+            *p++ = ':';
+            *p++ = ' ';
+            memcpy(p, scan->value, scan->value_size);
+            p += scan->value_size;
+            *p++ = '\r';
+            *p++ = '\n';
+        }
+        *p++ = '\r';
+        *p++ = '\n';
+
+        vecs[0].iov_base = ctx->flat;
+        vecs[0].iov_len = total;
+        *vecs_used = 1;
+    }
+    else if (count * 4 + 1 <= vecs_size) {
+        struct iovec *v = vecs;
+
+        for (scan = first; scan; scan = scan->next) {
+            v->iov_base = (char *)scan->header;
+            v++->iov_len = scan->header_size;
+            v->iov_base = ": ";
+            v++->iov_len = 2;
+            v->iov_base = (char *)scan->value;
+            v++->iov_len = scan->value_size;
+            v->iov_base = "\r\n";
+            v++->iov_len = 2;
+        }
+        v->iov_base = "\r\n";
+        v++->iov_len = 2;
+
+        *vecs_used = (int)(v - vecs);
+    }
+    else {
+        return 0;
+    }
+
+    ctx->cur_read = NULL;
+    ctx->state = READ_DONE;
+    *status = APR_EOF;
+
+    return 1;
+}
+
 static apr_status_t serf_headers_read_iovec(serf_bucket_t *bucket,
                                             apr_size_t requested,
                                             int vecs_size,
@@ -404,14 +911,18 @@ static apr_status_t serf_headers_read_iovec(serf_bucket_t *bucket,
                                             int *vecs_used)
 {
     apr_size_t avail = requested;
+    apr_status_t status;
     int i;
 
     *vecs_used = 0;
 
+    if (read_remaining(bucket, requested, vecs_size, vecs, vecs_used,
+                       &status))
+        return status;
+
     for (i = 0; i < vecs_size; i++) {
         const char *data;
         apr_size_t len;
-        apr_status_t status;
 
         /* Calling read() would not be a safe opt in the general case, but it
          * is here for the header bucket as it only frees all of the header
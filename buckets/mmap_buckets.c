@@ -26,12 +26,23 @@ typedef struct {
     void *current;
     apr_off_t offset;
     apr_off_t remaining;
+
+    /* The file that MMAP maps from offset 0, if known. */
+    apr_file_t *file;
 } mmap_context_t;
 
 
 serf_bucket_t *serf_bucket_mmap_create(
     apr_mmap_t *file_mmap,
     serf_bucket_alloc_t *allocator)
+{
+    return serf__bucket_mmap_create_for_file(file_mmap, NULL, allocator);
+}
+
+serf_bucket_t *serf__bucket_mmap_create_for_file(
+    apr_mmap_t *file_mmap,
+    apr_file_t *file,
+    serf_bucket_alloc_t *allocator)
 {
     mmap_context_t *ctx;
 
@@ -40,6 +51,7 @@ serf_bucket_t *serf_bucket_mmap_create(
     ctx->current = NULL;
     ctx->offset = 0;
     ctx->remaining = ctx->mmap->size;
+    ctx->file = file;
 
     return serf_bucket_create(&serf_bucket_type_mmap, allocator, ctx);
 }
@@ -99,6 +111,44 @@ static apr_status_t serf_mmap_readline(serf_bucket_t *bucket,
     return APR_SUCCESS;
 }
 
+static apr_status_t serf_mmap_read_for_sendfile(serf_bucket_t *bucket,
+                                                apr_size_t requested,
+                                                apr_hdtr_t *hdtr,
+                                                apr_file_t **file,
+                                                apr_off_t *offset,
+                                                apr_size_t *len)
+{
+    mmap_context_t *ctx = bucket->data;
+
+    /* Without a file, the mapped memory is already as good as it gets. */
+    if (!ctx->file) {
+        return serf_default_read_for_sendfile(bucket, requested, hdtr,
+                                              file, offset, len);
+    }
+
+    hdtr->numheaders = 0;
+    hdtr->numtrailers = 0;
+
+    if (requested == SERF_READ_ALL_AVAIL || requested > ctx->remaining) {
+        *len = ctx->remaining;
+    }
+    else {
+        *len = requested;
+    }
+
+    /* Nothing left; don't make the caller sendfile zero bytes. */
+    *file = *len ? ctx->file : NULL;
+    *offset = ctx->offset;
+
+    ctx->offset += *len;
+    ctx->remaining -= *len;
+
+    if (ctx->remaining == 0) {
+        return APR_EOF;
+    }
+    return APR_SUCCESS;
+}
+
 static apr_status_t serf_mmap_peek(serf_bucket_t *bucket,
                                      const char **data,
                                      apr_size_t *len)
@@ -112,7 +162,7 @@ const serf_bucket_type_t serf_bucket_type_mmap = {
     serf_mmap_read,
     serf_mmap_readline,
     serf_default_read_iovec,
-    serf_default_read_for_sendfile,
+    serf_mmap_read_for_sendfile,
     serf_default_read_bucket,
     serf_mmap_peek,
     serf_default_destroy_and_data,
@@ -126,6 +176,13 @@ serf_bucket_t *serf_bucket_mmap_create(apr_mmap_t *file_mmap,
     return NULL;
 }
 
+serf_bucket_t *serf__bucket_mmap_create_for_file(apr_mmap_t *file_mmap,
+                                                 apr_file_t *file,
+                                                 serf_bucket_alloc_t *allocator)
+{
+    return NULL;
+}
+
 const serf_bucket_type_t serf_bucket_type_mmap = {
     "MMAP",
     NULL,
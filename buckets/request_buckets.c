@@ -18,16 +18,39 @@
 
 #include "serf.h"
 #include "serf_bucket_util.h"
+#include "serf_private.h"
 
 
+struct serf_request_template_t {
+    const char *method;
+    const char *uri;
+
+    /* The request line and headers, without the final CRLF. The URI starts
+       at URI_OFFSET and is followed by the rest at TAIL_OFFSET. */
+    const char *data;
+    apr_size_t size;
+    apr_size_t uri_offset;
+    apr_size_t tail_offset;
+};
+
 typedef struct {
     const char *method;
     const char *uri;
     serf_bucket_t *headers;
     serf_bucket_t *body;
     apr_int64_t len;
+    const serf_request_template_t *tmpl;
+    serf_bucket_t *continue_gate;
 } request_context_t;
 
+/* Holds back the body of a request sent with Expect: 100-continue. */
+typedef struct {
+    serf_bucket_t *stream;
+    int open;
+} continue_gate_context_t;
+
+static const serf_bucket_type_t continue_gate_type;
+
 #define LENGTH_UNKNOWN ((apr_int64_t)-1)
 
 
@@ -45,10 +68,143 @@ serf_bucket_t *serf_bucket_request_create(
     ctx->headers = serf_bucket_headers_create(allocator);
     ctx->body = body;
     ctx->len = LENGTH_UNKNOWN;
+    ctx->tmpl = NULL;
+    ctx->continue_gate = NULL;
 
     return serf_bucket_create(&serf_bucket_type_request, allocator, ctx);
 }
 
+void serf_bucket_request_set_expect_continue(
+    serf_bucket_t *bucket)
+{
+    request_context_t *ctx = (request_context_t *)bucket->data;
+    continue_gate_context_t *gate_ctx;
+
+    if (ctx->body == NULL || ctx->continue_gate != NULL)
+        return;
+
+    serf_bucket_headers_setn(ctx->headers, "Expect", "100-continue");
+
+    gate_ctx = serf_bucket_mem_alloc(bucket->allocator, sizeof(*gate_ctx));
+    gate_ctx->stream = ctx->body;
+    gate_ctx->open = 0;
+
+    ctx->body = ctx->continue_gate =
+        serf_bucket_create(&continue_gate_type, bucket->allocator, gate_ctx);
+}
+
+void serf_bucket_request_set_accept_encoding(
+    serf_bucket_t *bucket)
+{
+    request_context_t *ctx = (request_context_t *)bucket->data;
+
+    serf_bucket_headers_setn(ctx->headers, "Accept-Encoding",
+                             SERF__ACCEPT_ENCODING);
+}
+
+serf_bucket_t *serf__bucket_request_get_continue_gate(serf_bucket_t *bucket)
+{
+    if (!SERF_BUCKET_IS_REQUEST(bucket))
+        return NULL;
+
+    return ((request_context_t *)bucket->data)->continue_gate;
+}
+
+int serf__continue_gate_is_open(serf_bucket_t *gate)
+{
+    return ((continue_gate_context_t *)gate->data)->open;
+}
+
+void serf__continue_gate_open(serf_bucket_t *gate)
+{
+    ((continue_gate_context_t *)gate->data)->open = 1;
+}
+
+/* Add the size of a header line to the apr_size_t at BATON. */
+static int template_header_size(void *baton,
+                                const char *header,
+                                const char *value)
+{
+    *(apr_size_t *)baton += strlen(header) + 2 + strlen(value) + 2;
+
+    return 0;
+}
+
+/* Append a header line at the char pointer at BATON. */
+static int template_header_copy(void *baton,
+                                const char *header,
+                                const char *value)
+{
+    char **p = baton;
+    apr_size_t len;
+
+    len = strlen(header);
+    memcpy(*p, header, len);
+    *p += len;
+    *(*p)++ = ':';
+    *(*p)++ = ' ';
+    len = strlen(value);
+    memcpy(*p, value, len);
+    *p += len;
+    *(*p)++ = '\r';
+    *(*p)++ = '\n';
+
+    return 0;
+}
+
+serf_request_template_t *serf_request_template_create(
+    const char *method,
+    const char *uri,
+    serf_bucket_t *headers,
+    apr_pool_t *pool)
+{
+    serf_request_template_t *tmpl = apr_palloc(pool, sizeof(*tmpl));
+    apr_size_t method_len = strlen(method);
+    apr_size_t uri_len = strlen(uri);
+    apr_size_t headers_size = 0;
+    char *data, *p;
+
+    if (headers)
+        serf_bucket_headers_do(headers, template_header_size, &headers_size);
+
+    tmpl->uri_offset = method_len + 1;
+    tmpl->tail_offset = tmpl->uri_offset + uri_len;
+    tmpl->size = tmpl->tail_offset + sizeof(" HTTP/1.1\r\n") - 1
+                 + headers_size;
+
+    p = data = apr_palloc(pool, tmpl->size);
+    memcpy(p, method, method_len);
+    p += method_len;
+    *p++ = ' ';
+    memcpy(p, uri, uri_len);
+    p += uri_len;
+    memcpy(p, " HTTP/1.1\r\n", sizeof(" HTTP/1.1\r\n") - 1);
+    p += sizeof(" HTTP/1.1\r\n") - 1;
+    if (headers)
+        serf_bucket_headers_do(headers, template_header_copy, &p);
+
+    tmpl->data = data;
+    tmpl->method = apr_pstrmemdup(pool, data, method_len);
+    tmpl->uri = apr_pstrmemdup(pool, data + tmpl->uri_offset, uri_len);
+
+    return tmpl;
+}
+
+serf_bucket_t *serf_bucket_request_create_from_template(
+    const serf_request_template_t *tmpl,
+    const char *uri,
+    serf_bucket_t *body,
+    serf_bucket_alloc_t *allocator)
+{
+    serf_bucket_t *bucket;
+
+    bucket = serf_bucket_request_create(tmpl->method, uri ? uri : tmpl->uri,
+                                        body, allocator);
+    ((request_context_t *)bucket->data)->tmpl = tmpl;
+
+    return bucket;
+}
+
 void serf_bucket_request_set_CL(
     serf_bucket_t *bucket,
     apr_int64_t len)
@@ -85,30 +241,36 @@ void serf_bucket_request_set_root(
                         NULL);
 }
 
+/* Append the request-line and headers of the template of CTX to
+   AGGREGATE, referring to the template's data. */
+static void append_template(serf_bucket_t *aggregate,
+                            request_context_t *ctx)
+{
+    const serf_request_template_t *tmpl = ctx->tmpl;
+    serf_bucket_alloc_t *allocator = aggregate->allocator;
+
+    if (ctx->uri == tmpl->uri) {
+        serf_bucket_aggregate_append(aggregate,
+            serf_bucket_simple_create(tmpl->data, tmpl->size, NULL, NULL,
+                                      allocator));
+        return;
+    }
+
+    serf_bucket_aggregate_append(aggregate,
+        serf_bucket_simple_create(tmpl->data, tmpl->uri_offset, NULL, NULL,
+                                  allocator));
+    serf_bucket_aggregate_append(aggregate,
+        serf_bucket_simple_create(ctx->uri, strlen(ctx->uri), NULL, NULL,
+                                  allocator));
+    serf_bucket_aggregate_append(aggregate,
+        serf_bucket_simple_create(tmpl->data + tmpl->tail_offset,
+                                  tmpl->size - tmpl->tail_offset, NULL, NULL,
+                                  allocator));
+}
+
 static void serialize_data(serf_bucket_t *bucket)
 {
     request_context_t *ctx = bucket->data;
-    serf_bucket_t *new_bucket;
-    const char *new_data;
-    struct iovec iov[4];
-    apr_size_t nbytes;
-
-    /* Serialize the request-line and headers into one mother string,
-     * and wrap a bucket around it.
-     */
-    iov[0].iov_base = (char*)ctx->method;
-    iov[0].iov_len = strlen(ctx->method);
-    iov[1].iov_base = " ";
-    iov[1].iov_len = sizeof(" ") - 1;
-    iov[2].iov_base = (char*)ctx->uri;
-    iov[2].iov_len = strlen(ctx->uri);
-    iov[3].iov_base = " HTTP/1.1\r\n";
-    iov[3].iov_len = sizeof(" HTTP/1.1\r\n") - 1;
-
-    /* Create a new bucket for this string with a flat string.  */
-    new_data = serf_bstrcatv(bucket->allocator, iov, 4, &nbytes);
-    new_bucket = serf_bucket_simple_own_create(new_data, nbytes,
-                                               bucket->allocator);
 
     /* Build up the new bucket structure.
      *
@@ -117,8 +279,34 @@ static void serialize_data(serf_bucket_t *bucket)
      */
     serf_bucket_aggregate_become(bucket);
 
-    /* Insert the two buckets. */
-    serf_bucket_aggregate_append(bucket, new_bucket);
+    if (ctx->tmpl) {
+        /* The template has the request-line and its own headers. */
+        append_template(bucket, ctx);
+    }
+    else {
+        serf_bucket_t *new_bucket;
+        const char *new_data;
+        struct iovec iov[4];
+        apr_size_t nbytes;
+
+        /* Serialize the request-line into one mother string, and wrap a
+         * bucket around it.
+         */
+        iov[0].iov_base = (char*)ctx->method;
+        iov[0].iov_len = strlen(ctx->method);
+        iov[1].iov_base = " ";
+        iov[1].iov_len = sizeof(" ") - 1;
+        iov[2].iov_base = (char*)ctx->uri;
+        iov[2].iov_len = strlen(ctx->uri);
+        iov[3].iov_base = " HTTP/1.1\r\n";
+        iov[3].iov_len = sizeof(" HTTP/1.1\r\n") - 1;
+
+        /* Create a new bucket for this string with a flat string.  */
+        new_data = serf_bstrcatv(bucket->allocator, iov, 4, &nbytes);
+        new_bucket = serf_bucket_simple_own_create(new_data, nbytes,
+                                                   bucket->allocator);
+        serf_bucket_aggregate_append(bucket, new_bucket);
+    }
     serf_bucket_aggregate_append(bucket, ctx->headers);
 
     /* If we know the length, then use C-L and the raw body. Otherwise,
@@ -179,6 +367,22 @@ static apr_status_t serf_request_read_iovec(serf_bucket_t *bucket,
                                   vecs_size, vecs, vecs_used);
 }
 
+static apr_status_t serf_request_read_for_sendfile(serf_bucket_t *bucket,
+                                                   apr_size_t requested,
+                                                   apr_hdtr_t *hdtr,
+                                                   apr_file_t **file,
+                                                   apr_off_t *offset,
+                                                   apr_size_t *len)
+{
+    /* Seralize our private data into a new aggregate bucket. */
+    serialize_data(bucket);
+
+    /* Delegate to the "new" aggregate bucket, which can pass on a file
+       body. */
+    return serf_bucket_read_for_sendfile(bucket, requested, hdtr,
+                                         file, offset, len);
+}
+
 static apr_status_t serf_request_peek(serf_bucket_t *bucket,
                                       const char **data,
                                       apr_size_t *len)
@@ -203,6 +407,9 @@ void serf_bucket_request_become(
     ctx->uri = uri;
     ctx->headers = serf_bucket_headers_create(bucket->allocator);
     ctx->body = body;
+    ctx->len = LENGTH_UNKNOWN;
+    ctx->tmpl = NULL;
+    ctx->continue_gate = NULL;
 
     bucket->type = &serf_bucket_type_request;
     bucket->data = ctx;
@@ -215,9 +422,113 @@ const serf_bucket_type_t serf_bucket_type_request = {
     serf_request_read,
     serf_request_readline,
     serf_request_read_iovec,
-    serf_default_read_for_sendfile,
+    serf_request_read_for_sendfile,
     serf_default_read_bucket,
     serf_request_peek,
     serf_default_destroy_and_data,
 };
 
+/* While closed, the gate has no data yet; once opened it reads through to
+   the body. */
+static apr_status_t serf_continue_gate_read(serf_bucket_t *bucket,
+                                            apr_size_t requested,
+                                            const char **data,
+                                            apr_size_t *len)
+{
+    continue_gate_context_t *ctx = bucket->data;
+
+    if (!ctx->open) {
+        *len = 0;
+        return APR_EAGAIN;
+    }
+
+    return serf_bucket_read(ctx->stream, requested, data, len);
+}
+
+static apr_status_t serf_continue_gate_readline(serf_bucket_t *bucket,
+                                                int acceptable, int *found,
+                                                const char **data,
+                                                apr_size_t *len)
+{
+    continue_gate_context_t *ctx = bucket->data;
+
+    if (!ctx->open) {
+        *found = SERF_NEWLINE_NONE;
+        *len = 0;
+        return APR_EAGAIN;
+    }
+
+    return serf_bucket_readline(ctx->stream, acceptable, found, data, len);
+}
+
+static apr_status_t serf_continue_gate_read_iovec(serf_bucket_t *bucket,
+                                                  apr_size_t requested,
+                                                  int vecs_size,
+                                                  struct iovec *vecs,
+                                                  int *vecs_used)
+{
+    continue_gate_context_t *ctx = bucket->data;
+
+    if (!ctx->open) {
+        *vecs_used = 0;
+        return APR_EAGAIN;
+    }
+
+    return serf_bucket_read_iovec(ctx->stream, requested, vecs_size, vecs,
+                                  vecs_used);
+}
+
+static apr_status_t serf_continue_gate_read_for_sendfile(
+    serf_bucket_t *bucket,
+    apr_size_t requested,
+    apr_hdtr_t *hdtr,
+    apr_file_t **file,
+    apr_off_t *offset,
+    apr_size_t *len)
+{
+    continue_gate_context_t *ctx = bucket->data;
+
+    if (!ctx->open) {
+        hdtr->numheaders = 0;
+        *file = NULL;
+        *len = 0;
+        return APR_EAGAIN;
+    }
+
+    return serf_bucket_read_for_sendfile(ctx->stream, requested, hdtr,
+                                         file, offset, len);
+}
+
+static apr_status_t serf_continue_gate_peek(serf_bucket_t *bucket,
+                                            const char **data,
+                                            apr_size_t *len)
+{
+    continue_gate_context_t *ctx = bucket->data;
+
+    if (!ctx->open) {
+        *len = 0;
+        return APR_EAGAIN;
+    }
+
+    return serf_bucket_peek(ctx->stream, data, len);
+}
+
+static void serf_continue_gate_destroy(serf_bucket_t *bucket)
+{
+    continue_gate_context_t *ctx = bucket->data;
+
+    serf_bucket_destroy(ctx->stream);
+
+    serf_default_destroy_and_data(bucket);
+}
+
+static const serf_bucket_type_t continue_gate_type = {
+    "CONTINUE-GATE",
+    serf_continue_gate_read,
+    serf_continue_gate_readline,
+    serf_continue_gate_read_iovec,
+    serf_continue_gate_read_for_sendfile,
+    serf_default_read_bucket,
+    serf_continue_gate_peek,
+    serf_continue_gate_destroy,
+};
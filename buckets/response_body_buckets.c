@@ -14,16 +14,11 @@
  */
 
 #include <apr_pools.h>
+#include <apr_file_io.h>
 
 #include "serf.h"
 #include "serf_bucket_util.h"
-
-/* Older versions of APR do not have this macro.  */
-#ifdef APR_SIZE_MAX
-#define REQUESTED_MAX APR_SIZE_MAX
-#else
-#define REQUESTED_MAX (~((apr_size_t)0))
-#endif
+#include "serf_private.h"
 
 
 typedef struct {
@@ -78,6 +73,64 @@ static apr_status_t serf_response_body_read(serf_bucket_t *bucket,
     return status;
 }
 
+apr_status_t serf__bucket_response_body_to_file(serf_bucket_t *bucket,
+                                                apr_file_t *file,
+                                                apr_uint64_t *written)
+{
+    body_context_t *ctx = bucket->data;
+    serf_bucket_t *stream = ctx->stream;
+    apr_status_t status;
+
+    *written = 0;
+
+    /* Look through barriers to see if we read straight from a socket. */
+    while (SERF_BUCKET_IS_BARRIER(stream))
+        stream = serf__bucket_barrier_get_stream(stream);
+
+    while (ctx->remaining) {
+        apr_size_t requested;
+        apr_size_t len;
+
+        if (ctx->remaining <= REQUESTED_MAX) {
+            requested = (apr_size_t) ctx->remaining;
+        } else {
+            requested = REQUESTED_MAX;
+        }
+
+        if (SERF_BUCKET_IS_SOCKET(stream)) {
+            status = serf__bucket_socket_to_file(stream, file, requested,
+                                                 &len);
+        }
+        else {
+            const char *data;
+
+            status = serf_bucket_read(ctx->stream, requested, &data, &len);
+            if (!SERF_BUCKET_READ_ERROR(status) && len) {
+                apr_status_t write_status;
+
+                write_status = apr_file_write_full(file, data, len, NULL);
+                if (write_status)
+                    return write_status;
+            }
+        }
+
+        if (SERF_BUCKET_READ_ERROR(status))
+            return status;
+
+        ctx->remaining -= len;
+        *written += len;
+
+        if (APR_STATUS_IS_EOF(status) && ctx->remaining > 0) {
+            /* The server sent less data than expected. */
+            return SERF_ERROR_TRUNCATED_HTTP_RESPONSE;
+        }
+        if (status)
+            return status;
+    }
+
+    return APR_EOF;
+}
+
 static apr_status_t serf_response_body_readline(serf_bucket_t *bucket,
                                                 int acceptable, int *found,
                                                 const char **data,
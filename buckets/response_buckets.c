@@ -37,12 +37,26 @@ typedef struct {
     /* Buffer for accumulating a line from the response. */
     serf_linebuf_t linebuf;
 
+    /* Free space in the current block of the headers bucket that header
+       lines are copied to. */
+    char *raw;
+    apr_size_t raw_avail;
+
     serf_status_line sl;
 
     int chunked;                /* Do we need to read trailers? */
     int head_req;               /* Was this a HEAD request? */
+    int interim;                /* Number of 1xx responses skipped */
 } response_context_t;
 
+/* Returns 1 if the status line read is that of an interim (1xx) response,
+   which is followed by another response to the same request. 101 Switching
+   Protocols is not, as the new protocol follows it. */
+static int is_interim(response_context_t *ctx)
+{
+    return ctx->sl.code >= 100 && ctx->sl.code < 200 && ctx->sl.code != 101;
+}
+
 /* Returns 1 if according to RFC2626 this response can have a body, 0 if it
    must not have a body. */
 static int expect_body(response_context_t *ctx)
@@ -80,6 +94,9 @@ serf_bucket_t *serf_bucket_response_create(
     ctx->state = STATE_STATUS_LINE;
     ctx->chunked = 0;
     ctx->head_req = 0;
+    ctx->interim = 0;
+    ctx->raw = NULL;
+    ctx->raw_avail = 0;
 
     serf_linebuf_init(&ctx->linebuf);
 
@@ -123,64 +140,95 @@ static apr_status_t fetch_line(response_context_t *ctx, int acceptable)
 }
 
 static apr_status_t parse_status_line(response_context_t *ctx,
-                                      serf_bucket_alloc_t *allocator)
+                                      serf_bucket_alloc_t *allocator,
+                                      const char *line,
+                                      apr_size_t line_len)
 {
     int res;
     char *reason; /* ### stupid APR interface makes this non-const */
 
-    /* ctx->linebuf.line should be of form: HTTP/1.1 200 OK */
-    res = apr_date_checkmask(ctx->linebuf.line, "HTTP/#.# ###*");
+    /* line should be of form: HTTP/1.1 200 OK */
+    res = apr_date_checkmask(line, "HTTP/#.# ###*");
     if (!res) {
         /* Not an HTTP response?  Well, at least we won't understand it. */
         return SERF_ERROR_BAD_HTTP_RESPONSE;
     }
 
-    ctx->sl.version = SERF_HTTP_VERSION(ctx->linebuf.line[5] - '0',
-                                        ctx->linebuf.line[7] - '0');
-    ctx->sl.code = apr_strtoi64(ctx->linebuf.line + 8, &reason, 10);
+    ctx->sl.version = SERF_HTTP_VERSION(line[5] - '0', line[7] - '0');
+    ctx->sl.code = apr_strtoi64(line + 8, &reason, 10);
 
     /* Skip leading spaces for the reason string. */
-    if (apr_isspace(*reason)) {
+    if (reason < line + line_len && apr_isspace(*reason)) {
         reason++;
     }
 
     /* Copy the reason value out of the line buffer. */
     ctx->sl.reason = serf_bstrmemdup(allocator, reason,
-                                     ctx->linebuf.used
-                                     - (reason - ctx->linebuf.line));
+                                     line_len - (reason - line));
 
     return APR_SUCCESS;
 }
 
-/* This code should be replaced with header buckets. */
+/* Header lines are copied into blocks owned by the headers bucket, which
+   take this many bytes of the allocator, overhead included, so that they
+   fit its size class. Longer lines get a block of their own. */
+#define HEADER_BLOCK_SIZE 2048
+
+/* Parse a header line, or the end of the headers, from the stream. */
 static apr_status_t fetch_headers(serf_bucket_t *bkt, response_context_t *ctx)
 {
     apr_status_t status;
+    const char *line;
+    apr_size_t line_len;
 
     /* RFC 2616 says that CRLF is the only line ending, but we can easily
      * accept any kind of line ending.
+     *
+     * The line is only copied into the linebuf if it arrived in pieces;
+     * usually we get to look at it in the stream's buffer.
      */
-    status = fetch_line(ctx, SERF_NEWLINE_ANY);
+    status = serf_linebuf_fetch_nocopy(&ctx->linebuf, ctx->stream,
+                                       SERF_NEWLINE_ANY, &line, &line_len);
     if (SERF_BUCKET_READ_ERROR(status)) {
         return status;
     }
     /* Something was read. Process it. */
 
-    if (ctx->linebuf.state == SERF_LINEBUF_READY && ctx->linebuf.used) {
-        const char *end_key;
+    if (ctx->linebuf.state == SERF_LINEBUF_READY && line_len) {
         const char *c;
+        char *raw, *end_key;
 
-        end_key = c = memchr(ctx->linebuf.line, ':', ctx->linebuf.used);
+        c = memchr(line, ':', line_len);
         if (!c) {
             /* Bad headers? */
             return SERF_ERROR_BAD_HTTP_RESPONSE;
         }
 
+        /* Copy the line once, into memory of the headers bucket. Name and
+           value point into the copy; the ':' terminates the name. */
+        if (ctx->raw_avail < line_len + 1) {
+            apr_size_t block_size =
+                serf__bucket_headers_alloc_usable(HEADER_BLOCK_SIZE);
+
+            ctx->raw_avail = line_len + 1 > block_size
+                             ? line_len + 1 : block_size;
+            ctx->raw = serf__bucket_headers_alloc(ctx->headers,
+                                                  ctx->raw_avail);
+        }
+        raw = ctx->raw;
+        memcpy(raw, line, line_len);
+        raw[line_len] = '\0';
+        ctx->raw += line_len + 1;
+        ctx->raw_avail -= line_len + 1;
+
+        end_key = raw + (c - line);
+        *end_key = '\0';
+
         /* Skip over initial ':' */
-        c++;
+        c = end_key + 1;
 
         /* And skip all whitespaces. */
-        for(; c < ctx->linebuf.line + ctx->linebuf.used; c++)
+        for(; c < raw + line_len; c++)
         {
             if (!apr_isspace(*c))
             {
@@ -188,17 +236,204 @@ static apr_status_t fetch_headers(serf_bucket_t *bkt, response_context_t *ctx)
             }
         }
 
-        /* Always copy the headers (from the linebuf into new mem). */
-        /* ### we should be able to optimize some mem copies */
         serf_bucket_headers_setx(
             ctx->headers,
-            ctx->linebuf.line, end_key - ctx->linebuf.line, 1,
-            c, ctx->linebuf.line + ctx->linebuf.used - c, 1);
+            raw, end_key - raw, 0,
+            c, raw + line_len - c, 0);
     }
 
     return status;
 }
 
+/* The headers have been read; set up the body of the response. */
+static apr_status_t start_body(serf_bucket_t *bkt, response_context_t *ctx)
+{
+    const void *v;
+
+    /* An interim response, e.g. 100 Continue, has no body. Forget about it
+       and start reading the next response. */
+    if (is_interim(ctx)) {
+        serf_bucket_mem_free(bkt->allocator, (void*)ctx->sl.reason);
+        serf__bucket_headers_clear(ctx->headers);
+        ctx->raw = NULL;
+        ctx->raw_avail = 0;
+        serf_linebuf_init(&ctx->linebuf);
+        ctx->state = STATE_STATUS_LINE;
+        ctx->interim++;
+        return APR_SUCCESS;
+    }
+
+    /* Advance the state. */
+    ctx->state = STATE_BODY;
+
+    /* If this is a response to a HEAD request, or code == 1xx,204 or304
+       then we don't receive a real body. */
+    if (!expect_body(ctx)) {
+        ctx->body = serf_bucket_simple_create(NULL, 0, NULL, NULL,
+                                              bkt->allocator);
+        return APR_SUCCESS;
+    }
+
+    ctx->body =
+        serf_bucket_barrier_create(ctx->stream, bkt->allocator);
+
+    /* Are we C-L, chunked, or conn close? */
+    v = serf__bucket_headers_get_token(ctx->headers,
+                                       SERF__HDR_CONTENT_LENGTH);
+    if (v) {
+        apr_uint64_t length;
+        length = apr_strtoi64(v, NULL, 10);
+        if (errno == ERANGE) {
+            return APR_FROM_OS_ERROR(ERANGE);
+        }
+        ctx->body = serf_bucket_response_body_create(
+                      ctx->body, length, bkt->allocator);
+    }
+    else {
+        v = serf__bucket_headers_get_token(ctx->headers,
+                                           SERF__HDR_TRANSFER_ENCODING);
+
+        /* Need to handle multiple transfer-encoding. */
+        if (v && strcasecmp("chunked", v) == 0) {
+            ctx->chunked = 1;
+            ctx->body = serf_bucket_dechunk_create(ctx->body,
+                                                   bkt->allocator);
+        }
+    }
+    v = serf__bucket_headers_get_token(ctx->headers,
+                                       SERF__HDR_CONTENT_ENCODING);
+    if (v) {
+        serf_bucket_t *decoder = NULL;
+
+        /* Need to handle multiple content-encoding. */
+        if (strcasecmp("gzip", v) == 0) {
+            decoder = serf_bucket_deflate_create(ctx->body, bkt->allocator,
+                                                 SERF_DEFLATE_GZIP);
+        }
+        else if (strcasecmp("deflate", v) == 0) {
+            decoder = serf_bucket_deflate_create(ctx->body, bkt->allocator,
+                                                 SERF_DEFLATE_DEFLATE);
+        }
+        else if (strcasecmp("br", v) == 0) {
+            decoder = serf_bucket_brotli_create(ctx->body, bkt->allocator);
+        }
+        else if (strcasecmp("zstd", v) == 0) {
+            decoder = serf_bucket_zstd_create(ctx->body, bkt->allocator);
+        }
+
+        /* Codings we can't decode are passed on as they are. */
+        if (decoder)
+            ctx->body = decoder;
+    }
+
+    return APR_SUCCESS;
+}
+
+/* Return the length of the status line and headers at the start of DATA,
+   up to and including the empty line, or 0 if they aren't all there or
+   don't end every line with CRLF. */
+static apr_size_t find_head_end(const char *data, apr_size_t len)
+{
+    const char *p = data;
+    const char *end = data + len;
+    const char *nl;
+
+    while ((nl = memchr(p, '\n', end - p)) != NULL) {
+        /* A lone CR or LF is a line ending too; leave those to the
+           line-by-line parser. */
+        if (nl == p || nl[-1] != '\r' || memchr(p, '\r', nl - 1 - p))
+            return 0;
+
+        if (nl - p == 1)
+            return nl + 1 - data;
+
+        p = nl + 1;
+    }
+
+    return 0;
+}
+
+/* If the stream has the complete status line and headers buffered, parse
+   them without going through the line buffer, and move on to the body. */
+static apr_status_t parse_buffered_head(serf_bucket_t *bkt,
+                                        response_context_t *ctx)
+{
+    apr_status_t status;
+    const char *data;
+    apr_size_t len, head_len;
+    char *raw, *line, *eol;
+
+    if (ctx->linebuf.state != SERF_LINEBUF_EMPTY
+        || ctx->stream->type->peek == NULL)
+        return APR_SUCCESS;
+
+    status = serf_bucket_peek(ctx->stream, &data, &len);
+    if (SERF_BUCKET_READ_ERROR(status))
+        return status;
+
+    head_len = find_head_end(data, len);
+    if (!head_len)
+        return APR_SUCCESS;
+
+    /* Parse the status line where it is. */
+    eol = memchr(data, '\r', head_len);
+    status = parse_status_line(ctx, bkt->allocator, data, eol - data);
+    if (status)
+        return status;
+
+    /* The headers of a 101 response belong to the new protocol. */
+    if (ctx->sl.code == 101) {
+        serf_bucket_mem_free(bkt->allocator, (void *)ctx->sl.reason);
+        return APR_SUCCESS;
+    }
+    ctx->state = STATE_HEADERS;
+
+    /* Copy the header lines, without the final empty line, into memory of
+       the headers bucket and set them pointing into the copy, like
+       fetch_headers does per line. */
+    len = data + head_len - 2 - (eol + 2);
+    raw = serf__bucket_headers_alloc(ctx->headers, len);
+    memcpy(raw, eol + 2, len);
+
+    for (line = raw; line < raw + len; line = eol + 2) {
+        char *end_key;
+        const char *c;
+
+        eol = memchr(line, '\r', raw + len - line);
+        *eol = '\0';
+
+        end_key = memchr(line, ':', eol - line);
+        if (!end_key) {
+            /* Bad headers? */
+            return SERF_ERROR_BAD_HTTP_RESPONSE;
+        }
+        *end_key = '\0';
+
+        /* Skip the ':' and all whitespace. */
+        for (c = end_key + 1; c < eol && apr_isspace(*c); c++)
+            ;
+
+        serf_bucket_headers_setx(ctx->headers,
+                                 line, end_key - line, 0,
+                                 c, eol - c, 0);
+    }
+
+    /* Consume what was parsed. */
+    len = head_len;
+    while (len) {
+        apr_size_t read_len;
+
+        status = serf_bucket_read(ctx->stream, len, &data, &read_len);
+        if (SERF_BUCKET_READ_ERROR(status))
+            return status;
+        len -= read_len;
+        if (status && len)
+            return SERF_ERROR_BAD_HTTP_RESPONSE;
+    }
+
+    return start_body(bkt, ctx);
+}
+
 /* Perform one iteration of the state machine.
  *
  * Will return when one the following conditions occurred:
@@ -210,9 +445,17 @@ static apr_status_t fetch_headers(serf_bucket_t *bkt, response_context_t *ctx)
 static apr_status_t run_machine(serf_bucket_t *bkt, response_context_t *ctx)
 {
     apr_status_t status = APR_SUCCESS; /* initialize to avoid gcc warnings */
+    int interim;
 
     switch (ctx->state) {
     case STATE_STATUS_LINE:
+        /* Usually the whole head of the response is already buffered. */
+        interim = ctx->interim;
+        status = parse_buffered_head(bkt, ctx);
+        if (status || ctx->state != STATE_STATUS_LINE
+            || ctx->interim != interim)
+            return status;
+
         /* RFC 2616 says that CRLF is the only line ending, but we can easily
          * accept any kind of line ending.
          */
@@ -222,7 +465,8 @@ static apr_status_t run_machine(serf_bucket_t *bkt, response_context_t *ctx)
 
         if (ctx->linebuf.state == SERF_LINEBUF_READY) {
             /* The Status-Line is in the line buffer. Process it. */
-            status = parse_status_line(ctx, bkt->allocator);
+            status = parse_status_line(ctx, bkt->allocator,
+                                       ctx->linebuf.line, ctx->linebuf.used);
             if (status)
                 return status;
 
@@ -256,58 +500,10 @@ static apr_status_t run_machine(serf_bucket_t *bkt, response_context_t *ctx)
          * Move on to the body.
          */
         if (ctx->linebuf.state == SERF_LINEBUF_READY && !ctx->linebuf.used) {
-            const void *v;
-
-            /* Advance the state. */
-            ctx->state = STATE_BODY;
-
-            /* If this is a response to a HEAD request, or code == 1xx,204 or304
-               then we don't receive a real body. */
-            if (!expect_body(ctx)) {
-                ctx->body = serf_bucket_simple_create(NULL, 0, NULL, NULL,
-                                                      bkt->allocator);
-                ctx->state = STATE_BODY;
-                break;
-            }
+            apr_status_t body_status = start_body(bkt, ctx);
 
-            ctx->body =
-                serf_bucket_barrier_create(ctx->stream, bkt->allocator);
-
-            /* Are we C-L, chunked, or conn close? */
-            v = serf_bucket_headers_get(ctx->headers, "Content-Length");
-            if (v) {
-                apr_uint64_t length;
-                length = apr_strtoi64(v, NULL, 10);
-                if (errno == ERANGE) {
-                    return APR_FROM_OS_ERROR(ERANGE);
-                }
-                ctx->body = serf_bucket_response_body_create(
-                              ctx->body, length, bkt->allocator);
-            }
-            else {
-                v = serf_bucket_headers_get(ctx->headers, "Transfer-Encoding");
-
-                /* Need to handle multiple transfer-encoding. */
-                if (v && strcasecmp("chunked", v) == 0) {
-                    ctx->chunked = 1;
-                    ctx->body = serf_bucket_dechunk_create(ctx->body,
-                                                           bkt->allocator);
-                }
-            }
-            v = serf_bucket_headers_get(ctx->headers, "Content-Encoding");
-            if (v) {
-                /* Need to handle multiple content-encoding. */
-                if (v && strcasecmp("gzip", v) == 0) {
-                    ctx->body =
-                        serf_bucket_deflate_create(ctx->body, bkt->allocator,
-                                                   SERF_DEFLATE_GZIP);
-                }
-                else if (v && strcasecmp("deflate", v) == 0) {
-                    ctx->body =
-                        serf_bucket_deflate_create(ctx->body, bkt->allocator,
-                                                   SERF_DEFLATE_DEFLATE);
-                }
-            }
+            if (body_status)
+                return body_status;
         }
         break;
     case STATE_BODY:
@@ -353,6 +549,13 @@ static apr_status_t wait_for_body(serf_bucket_t *bkt, response_context_t *ctx)
     return APR_SUCCESS;
 }
 
+int serf__bucket_response_got_interim(serf_bucket_t *bucket)
+{
+    response_context_t *ctx = bucket->data;
+
+    return ctx->interim != 0;
+}
+
 apr_status_t serf_bucket_response_wait_for_headers(
     serf_bucket_t *bucket)
 {
@@ -368,20 +571,26 @@ apr_status_t serf_bucket_response_status(
     response_context_t *ctx = bkt->data;
     apr_status_t status;
 
-    if (ctx->state != STATE_STATUS_LINE) {
+    if (ctx->state != STATE_STATUS_LINE
+        && !(ctx->state == STATE_HEADERS && is_interim(ctx))) {
         /* We already read it and moved on. Just return it. */
         *sline = ctx->sl;
         return APR_SUCCESS;
     }
 
     /* Running the state machine once will advance the machine, or state
-     * that the stream isn't ready with enough data. There isn't ever a
-     * need to run the machine more than once to try and satisfy this. We
-     * have to look at the state to tell whether it advanced, though, as
+     * that the stream isn't ready with enough data. Only interim responses
+     * need more runs, to get past their headers to the next status line.
+     * We have to look at the state to tell whether it advanced, though, as
      * it is quite possible to advance *and* to return APR_EAGAIN.
      */
-    status = run_machine(bkt, ctx);
-    if (ctx->state == STATE_HEADERS) {
+    do {
+        status = run_machine(bkt, ctx);
+    } while (!status && (ctx->state == STATE_STATUS_LINE
+                         || (ctx->state == STATE_HEADERS && is_interim(ctx))));
+
+    if (ctx->state != STATE_STATUS_LINE
+        && !(ctx->state == STATE_HEADERS && is_interim(ctx))) {
         *sline = ctx->sl;
     }
     else {
@@ -424,6 +633,49 @@ static apr_status_t serf_response_read(serf_bucket_t *bucket,
     return rv;
 }
 
+apr_status_t serf_bucket_response_body_to_file(
+    serf_bucket_t *bucket,
+    apr_file_t *file,
+    apr_uint64_t *written)
+{
+    response_context_t *ctx = bucket->data;
+    apr_status_t status;
+
+    *written = 0;
+
+    status = wait_for_body(bucket, ctx);
+    if (status)
+        return status;
+
+    /* A plain Content-Length body; let it find its own way to the file. */
+    if (SERF_BUCKET_IS_RESPONSE_BODY(ctx->body)) {
+        status = serf__bucket_response_body_to_file(ctx->body, file, written);
+        if (APR_STATUS_IS_EOF(status))
+            ctx->state = STATE_DONE;
+        return status;
+    }
+
+    do {
+        const char *data;
+        apr_size_t len;
+
+        status = serf_response_read(bucket, SERF_READ_ALL_AVAIL, &data, &len);
+        if (SERF_BUCKET_READ_ERROR(status))
+            return status;
+
+        if (len) {
+            apr_status_t write_status;
+
+            write_status = apr_file_write_full(file, data, len, NULL);
+            if (write_status)
+                return write_status;
+            *written += len;
+        }
+    } while (!status);
+
+    return status;
+}
+
 static apr_status_t serf_response_readline(serf_bucket_t *bucket,
                                            int acceptable, int *found,
                                            const char **data, apr_size_t *len)
@@ -13,22 +13,45 @@
  * limitations under the License.
  */
 
+/* splice(2) is only declared with _GNU_SOURCE. */
+#if defined(__linux__) && !defined(_GNU_SOURCE)
+#define _GNU_SOURCE
+#endif
+
 #include <apr_pools.h>
 #include <apr_network_io.h>
+#include <apr_file_io.h>
+#include <apr_portable.h>
 
 #include "serf.h"
 #include "serf_private.h"
 #include "serf_bucket_util.h"
 
+#ifdef __linux__
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+#ifdef SPLICE_F_MOVE
+#define SERF__HAVE_SPLICE
+#endif
+#endif
+
 
 typedef struct {
     apr_socket_t *skt;
 
-    serf_databuf_t databuf;
+    serf_dynbuf_t databuf;
 
     /* Progress callback */
     serf_progress_t progress_func;
     void *progress_baton;
+
+#ifdef SERF__HAVE_SPLICE
+    /* Pipe used to move data from the socket to a file, created on first
+       use. NO_SPLICE is set once splice turned out not to work here. */
+    int pipe_fds[2];
+    int no_splice;
+#endif
 } socket_context_t;
 
 
@@ -66,12 +89,19 @@ serf_bucket_t *serf_bucket_socket_create(
     ctx = serf_bucket_mem_alloc(allocator, sizeof(*ctx));
     ctx->skt = skt;
 
-    serf_databuf_init(&ctx->databuf);
+    serf_dynbuf_init(&ctx->databuf, allocator, SERF_DATABUF_BUFSIZE,
+                     SERF_DYNBUF_MAX_SIZE);
     ctx->databuf.read = socket_reader;
     ctx->databuf.read_baton = ctx;
 
     ctx->progress_func = NULL;
     ctx->progress_baton = NULL;
+
+#ifdef SERF__HAVE_SPLICE
+    ctx->pipe_fds[0] = ctx->pipe_fds[1] = -1;
+    ctx->no_splice = 0;
+#endif
+
     return serf_bucket_create(&serf_bucket_type_socket, allocator, ctx);
 }
 
@@ -86,13 +116,26 @@ void serf_bucket_socket_set_read_progress_cb(
     ctx->progress_baton = progress_baton;
 }
 
+void serf_bucket_socket_set_buffer_size(
+    serf_bucket_t *bucket,
+    apr_size_t min_size,
+    apr_size_t max_size)
+{
+    socket_context_t *ctx = bucket->data;
+
+    if (!SERF_BUCKET_IS_SOCKET(bucket))
+        return;
+
+    serf_dynbuf_set_size(&ctx->databuf, min_size, max_size);
+}
+
 static apr_status_t serf_socket_read(serf_bucket_t *bucket,
                                      apr_size_t requested,
                                      const char **data, apr_size_t *len)
 {
     socket_context_t *ctx = bucket->data;
 
-    return serf_databuf_read(&ctx->databuf, requested, data, len);
+    return serf_dynbuf_read(&ctx->databuf, requested, data, len);
 }
 
 static apr_status_t serf_socket_readline(serf_bucket_t *bucket,
@@ -101,7 +144,7 @@ static apr_status_t serf_socket_readline(serf_bucket_t *bucket,
 {
     socket_context_t *ctx = bucket->data;
 
-    return serf_databuf_readline(&ctx->databuf, acceptable, found, data, len);
+    return serf_dynbuf_readline(&ctx->databuf, acceptable, found, data, len);
 }
 
 static apr_status_t serf_socket_peek(serf_bucket_t *bucket,
@@ -110,7 +153,160 @@ static apr_status_t serf_socket_peek(serf_bucket_t *bucket,
 {
     socket_context_t *ctx = bucket->data;
 
-    return serf_databuf_peek(&ctx->databuf, data, len);
+    return serf_dynbuf_peek(&ctx->databuf, data, len);
+}
+
+#ifdef SERF__HAVE_SPLICE
+/* Copy what is left in the pipe of CTX to FILE_FD the slow way. */
+static apr_status_t drain_pipe(socket_context_t *ctx, int file_fd,
+                               apr_size_t len)
+{
+    char buf[1024];
+
+    while (len) {
+        ssize_t n = read(ctx->pipe_fds[0], buf,
+                         len < sizeof(buf) ? len : sizeof(buf));
+        char *p = buf;
+
+        if (n <= 0)
+            return n < 0 ? APR_FROM_OS_ERROR(errno) : APR_EGENERAL;
+        len -= n;
+
+        while (n) {
+            ssize_t w = write(file_fd, p, n);
+
+            if (w < 0)
+                return APR_FROM_OS_ERROR(errno);
+            p += w;
+            n -= w;
+        }
+    }
+
+    return APR_SUCCESS;
+}
+
+/* Move up to REQUESTED bytes from the socket of CTX to FILE through a
+   pipe, without copying them to user space. Returns APR_ENOTIMPL if
+   splice can't be used for this socket and file. */
+static apr_status_t splice_to_file(socket_context_t *ctx, apr_file_t *file,
+                                   apr_size_t requested, apr_size_t *len)
+{
+    apr_os_sock_t skt_fd;
+    apr_os_file_t file_fd;
+    apr_size_t left;
+    ssize_t n;
+    apr_status_t status;
+
+    *len = 0;
+
+    if (ctx->no_splice
+        || apr_os_sock_get(&skt_fd, ctx->skt)
+        || apr_os_file_get(&file_fd, file))
+        return APR_ENOTIMPL;
+
+    if (ctx->pipe_fds[0] == -1 && pipe(ctx->pipe_fds) != 0) {
+        ctx->no_splice = 1;
+        return APR_ENOTIMPL;
+    }
+
+    /* Anything the application wrote through APR must land first. */
+    status = apr_file_flush(file);
+    if (status)
+        return status;
+
+    n = splice(skt_fd, NULL, ctx->pipe_fds[1], NULL, requested,
+               SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+    if (n < 0) {
+        if (errno == EAGAIN)
+            return APR_EAGAIN;
+        if (errno == EINVAL || errno == ENOSYS) {
+            ctx->no_splice = 1;
+            return APR_ENOTIMPL;
+        }
+        return APR_FROM_OS_ERROR(errno);
+    }
+    if (n == 0)
+        return APR_EOF;
+
+    left = n;
+    while (left) {
+        ssize_t out = splice(ctx->pipe_fds[0], NULL, file_fd, NULL, left,
+                             SPLICE_F_MOVE);
+        if (out <= 0) {
+            /* The data is in our pipe now, so it must not get lost. */
+            if (out < 0 && errno != EINVAL && errno != ENOSYS)
+                return APR_FROM_OS_ERROR(errno);
+            ctx->no_splice = 1;
+            status = drain_pipe(ctx, file_fd, left);
+            if (status)
+                return status;
+            break;
+        }
+        left -= out;
+    }
+
+    *len = n;
+
+    serf__log_skt(SOCK_MSG_VERBOSE, __FILE__, ctx->skt,
+                  "--- socket_splice: -(%d)-\n", *len);
+
+    if (ctx->progress_func)
+        ctx->progress_func(ctx->progress_baton, *len, 0);
+
+    return APR_SUCCESS;
+}
+#endif
+
+apr_status_t serf__bucket_socket_to_file(serf_bucket_t *bucket,
+                                         apr_file_t *file,
+                                         apr_size_t requested,
+                                         apr_size_t *len)
+{
+    socket_context_t *ctx = bucket->data;
+    const char *data;
+    apr_status_t status;
+
+    /* Data that is already buffered has to go first. */
+    if (!ctx->databuf.remaining && !ctx->databuf.status) {
+#ifdef SERF__HAVE_SPLICE
+        status = splice_to_file(ctx, file, requested, len);
+        if (status != APR_ENOTIMPL) {
+            if (APR_STATUS_IS_EOF(status))
+                ctx->databuf.status = status;
+            return status;
+        }
+#endif
+    }
+
+    status = serf_dynbuf_read(&ctx->databuf, requested, &data, len);
+    if (SERF_BUCKET_READ_ERROR(status))
+        return status;
+
+    if (*len) {
+        apr_status_t write_status;
+
+        write_status = apr_file_write_full(file, data, *len, NULL);
+        if (write_status)
+            return write_status;
+    }
+
+    return status;
+}
+
+static void serf_socket_destroy(serf_bucket_t *bucket)
+{
+    socket_context_t *ctx = bucket->data;
+
+    serf_dynbuf_destroy(&ctx->databuf);
+
+#ifdef SERF__HAVE_SPLICE
+    if (ctx->pipe_fds[0] != -1) {
+        close(ctx->pipe_fds[0]);
+        close(ctx->pipe_fds[1]);
+    }
+#endif
+
+    serf_default_destroy_and_data(bucket);
 }
 
 const serf_bucket_type_t serf_bucket_type_socket = {
@@ -121,5 +317,5 @@ const serf_bucket_type_t serf_bucket_type_socket = {
     serf_default_read_for_sendfile,
     serf_default_read_bucket,
     serf_socket_peek,
-    serf_default_destroy_and_data,
+    serf_socket_destroy,
 };
@@ -153,6 +153,10 @@ struct serf_ssl_context_t {
     SSL *ssl;
     BIO *bio;
 
+    /* The key of this connection in the session cache of CTX, if it uses
+       that; see serf_ssl_use_session_cache(). */
+    char *session_key;
+
     serf_ssl_stream_t encrypt;
     serf_ssl_stream_t decrypt;
 
@@ -201,7 +205,36 @@ struct serf_ssl_certificate_t {
     int depth;
 };
 
-static void disable_compression(serf_ssl_context_t *ssl_ctx);
+struct serf_ssl_config_t {
+    /* Our reference to the SSL_CTX. Every ssl context created from the
+       config holds one too, so it lives until the last of them is gone. */
+    SSL_CTX *ctx;
+};
+
+/* A TLS session to resume, in the session cache of a shared SSL_CTX. */
+typedef struct ssl_session_entry_t {
+    char *key;                  /* "host:port/server name" */
+    SSL_SESSION *session;
+    apr_time_t stored;          /* when we got the session */
+} ssl_session_entry_t;
+
+/* The session cache lives as long as the SSL_CTX it is stored in, as ex
+   data, so it is allocated with malloc() rather than from a pool. */
+typedef struct ssl_session_cache_t {
+    ssl_session_entry_t *entries;
+    int max_sessions;
+    int nr_of_sessions;
+    apr_interval_time_t max_age;
+} ssl_session_cache_t;
+
+#if OPENSSL_VERSION_NUMBER >= 0x10100000L
+#define ssl_ctx_up_ref(ctx) SSL_CTX_up_ref(ctx)
+#else
+#define ssl_ctx_up_ref(ctx) \
+    CRYPTO_add(&(ctx)->references, 1, CRYPTO_LOCK_SSL_CTX)
+#endif
+
+static void disable_compression(SSL_CTX *ctx);
 static char *
     pstrdup_escape_nul_bytes(const char *buf, int len, apr_pool_t *pool);
 
@@ -711,6 +744,26 @@ static apr_status_t ssl_decrypt(void *baton, apr_size_t bufsize,
         serf_bucket_aggregate_append(ctx->decrypt.pending, tmp);
 
         ssl_len = SSL_read(ctx->ssl, buf, bufsize);
+
+        /* The stream can buffer more than we just read from it, and then
+           won't make the socket readable again for the rest: keep feeding
+           OpenSSL until it has a whole record, or the stream runs dry. */
+        while (ssl_len < 0 && status == APR_SUCCESS &&
+               SSL_get_error(ctx->ssl, ssl_len) == SSL_ERROR_WANT_READ) {
+            status = serf_bucket_read(ctx->decrypt.stream, bufsize, &data,
+                                      &priv_len);
+            if (SERF_BUCKET_READ_ERROR(status) || !priv_len) {
+                *len = 0;
+                return status;
+            }
+
+            tmp = serf_bucket_simple_copy_create(
+                      data, priv_len, ctx->decrypt.pending->allocator);
+            serf_bucket_aggregate_append(ctx->decrypt.pending, tmp);
+
+            ssl_len = SSL_read(ctx->ssl, buf, bufsize);
+        }
+
         if (ssl_len < 0) {
             int ssl_err;
 
@@ -1057,6 +1110,32 @@ enum ssl_init_e
 
 static volatile apr_uint32_t have_init_ssl = INIT_UNINITIALIZED;
 
+/* The SSL_CTX ex data index of the session cache. */
+static int session_cache_index = -1;
+
+static void remove_session(ssl_session_cache_t *cache, int i)
+{
+    free(cache->entries[i].key);
+    SSL_SESSION_free(cache->entries[i].session);
+
+    cache->entries[i] = cache->entries[--cache->nr_of_sessions];
+}
+
+static void free_session_cache(void *parent, void *ptr, CRYPTO_EX_DATA *ad,
+                               int idx, long argl, void *argp)
+{
+    ssl_session_cache_t *cache = ptr;
+
+    if (!cache)
+        return;
+
+    while (cache->nr_of_sessions)
+        remove_session(cache, 0);
+
+    free(cache->entries);
+    free(cache);
+}
+
 static void init_ssl_libraries(void)
 {
     apr_uint32_t val;
@@ -1087,6 +1166,9 @@ static void init_ssl_libraries(void)
         SSL_library_init();
         OpenSSL_add_all_algorithms();
 
+        session_cache_index = SSL_CTX_get_ex_new_index(0, NULL, NULL, NULL,
+                                                       free_session_cache);
+
 #if APR_HAS_THREADS
         numlocks = CRYPTO_num_locks();
         apr_pool_create(&ssl_pool, NULL);
@@ -1305,23 +1387,52 @@ void serf_ssl_server_cert_chain_callback_set(
     context->server_cert_userdata = data;
 }
 
-static serf_ssl_context_t *ssl_init_context(serf_bucket_alloc_t *allocator)
+/* Create the SSL_CTX of a connection, or of a serf_ssl_config_t. */
+static SSL_CTX *ssl_create_ctx(void)
 {
-    serf_ssl_context_t *ssl_ctx;
+    SSL_CTX *ctx;
 
     init_ssl_libraries();
 
+    /* Use the best possible protocol version, but disable the broken SSLv2/3 */
+    ctx = SSL_CTX_new(SSLv23_client_method());
+    SSL_CTX_set_options(ctx, SSL_OP_NO_SSLv2 | SSL_OP_NO_SSLv3);
+
+    SSL_CTX_set_client_cert_cb(ctx, ssl_need_client_cert);
+
+    SSL_CTX_set_verify(ctx, SSL_VERIFY_PEER, validate_server_certificate);
+    SSL_CTX_set_options(ctx, SSL_OP_ALL);
+    /* Disable SSL compression by default. */
+    disable_compression(ctx);
+
+#if SSL_VERBOSE
+    SSL_CTX_set_info_callback(ctx, apps_ssl_info_callback);
+#endif
+
+    return ctx;
+}
+
+/* Create an ssl context with a new SSL_CTX, or using SHARED_CTX. */
+static serf_ssl_context_t *ssl_init_context(serf_bucket_alloc_t *allocator,
+                                            SSL_CTX *shared_ctx)
+{
+    serf_ssl_context_t *ssl_ctx;
+
     ssl_ctx = serf_bucket_mem_alloc(allocator, sizeof(*ssl_ctx));
 
     ssl_ctx->refcount = 0;
     ssl_ctx->pool = serf_bucket_allocator_get_pool(allocator);
     ssl_ctx->allocator = allocator;
 
-    /* Use the best possible protocol version, but disable the broken SSLv2/3 */
-    ssl_ctx->ctx = SSL_CTX_new(SSLv23_client_method());
-    SSL_CTX_set_options(ssl_ctx->ctx, SSL_OP_NO_SSLv2 | SSL_OP_NO_SSLv3);
+    if (shared_ctx) {
+        ssl_ctx_up_ref(shared_ctx);
+        ssl_ctx->ctx = shared_ctx;
+    }
+    else {
+        ssl_ctx->ctx = ssl_create_ctx();
+    }
 
-    SSL_CTX_set_client_cert_cb(ssl_ctx->ctx, ssl_need_client_cert);
+    ssl_ctx->session_key = NULL;
     ssl_ctx->cached_cert = 0;
     ssl_ctx->cached_cert_pw = 0;
     ssl_ctx->pending_err = APR_SUCCESS;
@@ -1329,15 +1440,11 @@ static serf_ssl_context_t *ssl_init_context(serf_bucket_alloc_t *allocator)
 
     ssl_ctx->cert_callback = NULL;
     ssl_ctx->cert_pw_callback = NULL;
+    ssl_ctx->cert_file_success = NULL;
+    ssl_ctx->cert_pw_success = NULL;
     ssl_ctx->server_cert_callback = NULL;
     ssl_ctx->server_cert_chain_callback = NULL;
 
-    SSL_CTX_set_verify(ssl_ctx->ctx, SSL_VERIFY_PEER,
-                       validate_server_certificate);
-    SSL_CTX_set_options(ssl_ctx->ctx, SSL_OP_ALL);
-    /* Disable SSL compression by default. */
-    disable_compression(ssl_ctx);
-
     ssl_ctx->ssl = SSL_new(ssl_ctx->ctx);
     ssl_ctx->bio = BIO_new(&bio_bucket_method);
     ssl_ctx->bio->ptr = ssl_ctx;
@@ -1348,10 +1455,6 @@ static serf_ssl_context_t *ssl_init_context(serf_bucket_alloc_t *allocator)
 
     SSL_set_app_data(ssl_ctx->ssl, ssl_ctx);
 
-#if SSL_VERBOSE
-    SSL_CTX_set_info_callback(ssl_ctx->ctx, apps_ssl_info_callback);
-#endif
-
     ssl_ctx->encrypt.stream = NULL;
     ssl_ctx->encrypt.stream_next = NULL;
     ssl_ctx->encrypt.pending = serf_bucket_aggregate_create(allocator);
@@ -1381,7 +1484,20 @@ static apr_status_t ssl_free_context(
         serf_bucket_destroy(ssl_ctx->encrypt.pending);
     }
 
-    /* SSL_free implicitly frees the underlying BIO. */
+    /* We close connections without sending a close_notify alert, and
+       OpenSSL then marks their session as not resumable. Unless the
+       connection failed, keep it for the session cache. */
+    if (ssl_ctx->session_key) {
+        if (!ssl_ctx->fatal_err) {
+            SSL_set_shutdown(ssl_ctx->ssl,
+                             SSL_SENT_SHUTDOWN | SSL_RECEIVED_SHUTDOWN);
+        }
+        serf_bucket_mem_free(ssl_ctx->allocator, ssl_ctx->session_key);
+        ssl_ctx->session_key = NULL;
+    }
+
+    /* SSL_free implicitly frees the underlying BIO. This drops our
+       reference to a shared SSL_CTX, and frees one of our own. */
     SSL_free(ssl_ctx->ssl);
     SSL_CTX_free(ssl_ctx->ctx);
 
@@ -1399,7 +1515,7 @@ static serf_bucket_t * serf_bucket_ssl_create(
 
     ctx = serf_bucket_mem_alloc(allocator, sizeof(*ctx));
     if (!ssl_ctx) {
-        ctx->ssl_ctx = ssl_init_context(allocator);
+        ctx->ssl_ctx = ssl_init_context(allocator, NULL);
     }
     else {
         ctx->ssl_ctx = ssl_ctx;
@@ -1409,6 +1525,268 @@ static serf_bucket_t * serf_bucket_ssl_create(
     return serf_bucket_create(type, allocator, ctx);
 }
 
+static apr_status_t cleanup_ssl_config(void *data)
+{
+    serf_ssl_config_t *config = data;
+
+    SSL_CTX_free(config->ctx);
+
+    return APR_SUCCESS;
+}
+
+serf_ssl_config_t *serf_ssl_config_create(apr_pool_t *pool)
+{
+    serf_ssl_config_t *config;
+
+    config = apr_palloc(pool, sizeof(*config));
+    config->ctx = ssl_create_ctx();
+
+    apr_pool_cleanup_register(pool, config, cleanup_ssl_config,
+                              apr_pool_cleanup_null);
+
+    return config;
+}
+
+apr_status_t serf_ssl_config_use_default_certificates(
+    serf_ssl_config_t *config)
+{
+    X509_STORE *store = SSL_CTX_get_cert_store(config->ctx);
+
+    int result = X509_STORE_set_default_paths(store);
+
+    return result ? APR_SUCCESS : SERF_ERROR_SSL_CERT_FAILED;
+}
+
+apr_status_t serf_ssl_config_trust_cert(
+    serf_ssl_config_t *config,
+    serf_ssl_certificate_t *cert)
+{
+    X509_STORE *store = SSL_CTX_get_cert_store(config->ctx);
+
+    int result = X509_STORE_add_cert(store, cert->ssl_cert);
+
+    return result ? APR_SUCCESS : SERF_ERROR_SSL_CERT_FAILED;
+}
+
+apr_status_t serf_ssl_config_set_client_cert(
+    serf_ssl_config_t *config,
+    const char *cert_path,
+    const char *password,
+    apr_pool_t *pool)
+{
+    apr_file_t *cert_file;
+    BIO *bio;
+    PKCS12 *p12;
+    X509 *cert;
+    EVP_PKEY *pkey;
+    apr_status_t status;
+    int i;
+
+    status = apr_file_open(&cert_file, cert_path, APR_READ, APR_OS_DEFAULT,
+                           pool);
+    if (status)
+        return status;
+
+    bio = BIO_new(&bio_file_method);
+    bio->ptr = cert_file;
+
+    p12 = d2i_PKCS12_bio(bio, NULL);
+    apr_file_close(cert_file);
+    BIO_free(bio);
+
+    if (!p12) {
+        ERR_clear_error();
+        return SERF_ERROR_SSL_CERT_FAILED;
+    }
+
+    i = PKCS12_parse(p12, password, &pkey, &cert, NULL);
+    PKCS12_free(p12);
+    if (i != 1) {
+        ERR_clear_error();
+        return SERF_ERROR_SSL_CERT_FAILED;
+    }
+
+    /* Both take a reference of their own. */
+    if (SSL_CTX_use_certificate(config->ctx, cert) != 1 ||
+        SSL_CTX_use_PrivateKey(config->ctx, pkey) != 1) {
+        ERR_clear_error();
+        status = SERF_ERROR_SSL_CERT_FAILED;
+    }
+    X509_free(cert);
+    EVP_PKEY_free(pkey);
+
+    return status;
+}
+
+serf_ssl_context_t *serf_ssl_context_create(
+    serf_ssl_config_t *config,
+    serf_bucket_alloc_t *allocator)
+{
+    return ssl_init_context(allocator, config->ctx);
+}
+
+/* Called by OpenSSL for every new session of a connection, which includes
+   each TLS 1.3 session ticket the server sends. */
+static int new_session_cb(SSL *ssl, SSL_SESSION *session)
+{
+    serf_ssl_context_t *ctx = SSL_get_app_data(ssl);
+    ssl_session_cache_t *cache;
+    ssl_session_entry_t *entry;
+    apr_time_t now;
+    int i;
+
+    cache = SSL_CTX_get_ex_data(SSL_get_SSL_CTX(ssl), session_cache_index);
+    if (!cache || !ctx->session_key)
+        return 0;
+
+    now = apr_time_now();
+    entry = NULL;
+
+    for (i = 0; i < cache->nr_of_sessions; i++) {
+        if (strcmp(cache->entries[i].key, ctx->session_key) == 0) {
+            entry = &cache->entries[i];
+            SSL_SESSION_free(entry->session);
+            break;
+        }
+    }
+
+    if (!entry) {
+        char *key = malloc(strlen(ctx->session_key) + 1);
+
+        if (!key)
+            return 0;
+        strcpy(key, ctx->session_key);
+
+        /* When full, make room by dropping the oldest session. */
+        if (cache->nr_of_sessions == cache->max_sessions) {
+            int oldest = 0;
+
+            for (i = 1; i < cache->nr_of_sessions; i++) {
+                if (cache->entries[i].stored < cache->entries[oldest].stored)
+                    oldest = i;
+            }
+            remove_session(cache, oldest);
+        }
+
+        entry = &cache->entries[cache->nr_of_sessions++];
+        entry->key = key;
+    }
+
+    entry->session = session;
+    entry->stored = now;
+
+    /* We keep the reference OpenSSL gave us. */
+    return 1;
+}
+
+apr_status_t serf_ssl_config_cache_sessions(
+    serf_ssl_config_t *config,
+    int max_sessions,
+    apr_interval_time_t max_age)
+{
+    ssl_session_cache_t *cache;
+
+    cache = SSL_CTX_get_ex_data(config->ctx, session_cache_index);
+    if (cache) {
+        SSL_CTX_set_ex_data(config->ctx, session_cache_index, NULL);
+        free_session_cache(config->ctx, cache, NULL, session_cache_index,
+                           0, NULL);
+    }
+
+    if (max_sessions <= 0) {
+        SSL_CTX_set_session_cache_mode(config->ctx, SSL_SESS_CACHE_OFF);
+        SSL_CTX_sess_set_new_cb(config->ctx, NULL);
+        return APR_SUCCESS;
+    }
+
+    cache = malloc(sizeof(*cache));
+    if (cache)
+        cache->entries = malloc(max_sessions * sizeof(*cache->entries));
+    if (!cache || !cache->entries) {
+        free(cache);
+        return APR_ENOMEM;
+    }
+    cache->max_sessions = max_sessions;
+    cache->nr_of_sessions = 0;
+    cache->max_age = max_age;
+
+    SSL_CTX_set_ex_data(config->ctx, session_cache_index, cache);
+
+    /* OpenSSL only hands us the sessions; we do the lookups. */
+    SSL_CTX_set_session_cache_mode(config->ctx,
+                                   SSL_SESS_CACHE_CLIENT |
+                                   SSL_SESS_CACHE_NO_INTERNAL_STORE);
+    SSL_CTX_sess_set_new_cb(config->ctx, new_session_cb);
+
+    return APR_SUCCESS;
+}
+
+apr_status_t serf_ssl_use_session_cache(
+    serf_ssl_context_t *context,
+    const char *host,
+    apr_port_t port)
+{
+    ssl_session_cache_t *cache;
+    const char *server_name = NULL;
+    apr_size_t key_size;
+    apr_time_t now;
+    int i;
+
+    cache = SSL_CTX_get_ex_data(context->ctx, session_cache_index);
+    if (!cache)
+        return APR_SUCCESS;
+
+#ifdef TLSEXT_NAMETYPE_host_name
+    server_name = SSL_get_servername(context->ssl, TLSEXT_NAMETYPE_host_name);
+#endif
+    if (!server_name)
+        server_name = "";
+
+    if (context->session_key) {
+        serf_bucket_mem_free(context->allocator, context->session_key);
+    }
+    key_size = strlen(host) + strlen(server_name) + sizeof(":65535/");
+    context->session_key = serf_bucket_mem_alloc(context->allocator,
+                                                 key_size);
+    apr_snprintf(context->session_key, key_size, "%s:%d/%s",
+                 host, port, server_name);
+
+    now = apr_time_now();
+
+    for (i = 0; i < cache->nr_of_sessions; i++) {
+        ssl_session_entry_t *entry = &cache->entries[i];
+        SSL_SESSION *session = entry->session;
+
+        if (strcmp(entry->key, context->session_key) != 0)
+            continue;
+
+        /* Don't offer a session that we, or the server, consider too old. */
+        if ((cache->max_age && now - entry->stored > cache->max_age) ||
+            apr_time_sec(now) >= (apr_time_t)SSL_SESSION_get_time(session)
+                                 + SSL_SESSION_get_timeout(session)) {
+            remove_session(cache, i);
+            break;
+        }
+
+        SSL_set_session(context->ssl, session);
+
+#ifdef TLS1_3_VERSION
+        /* TLS 1.3 tickets are meant to be used once; the server sends new
+           ones on the resumed connection. */
+        if (SSL_SESSION_get_protocol_version(session) == TLS1_3_VERSION)
+            remove_session(cache, i);
+#endif
+        break;
+    }
+
+    return APR_SUCCESS;
+}
+
+int serf_ssl_session_reused(serf_ssl_context_t *context)
+{
+    return SSL_session_reused(context->ssl);
+}
+
 apr_status_t serf_ssl_set_hostname(serf_ssl_context_t *context,
                                    const char * hostname)
 {
@@ -1768,10 +2146,10 @@ const char *serf_ssl_cert_export(
 }
 
 /* Disables compression for all SSL sessions. */
-static void disable_compression(serf_ssl_context_t *ssl_ctx)
+static void disable_compression(SSL_CTX *ctx)
 {
 #ifdef SSL_OP_NO_COMPRESSION
-    SSL_CTX_set_options(ssl_ctx->ctx, SSL_OP_NO_COMPRESSION);
+    SSL_CTX_set_options(ctx, SSL_OP_NO_COMPRESSION);
 #endif
 }
 
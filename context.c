@@ -269,12 +269,16 @@ apr_status_t serf_context_run(
     apr_int32_t num;
     const apr_pollfd_t *desc;
     serf_pollset_t *ps = (serf_pollset_t*)ctx->pollset_baton;
+    apr_short_interval_time_t wait;
 
     if ((status = serf_context_prerun(ctx)) != APR_SUCCESS) {
         return status;
     }
 
-    if ((status = apr_pollset_poll(ps->pollset, duration, &num,
+    /* Wake up in time to send a body held back for 100 Continue. */
+    wait = serf__continue_poll_duration(ctx, duration);
+
+    if ((status = apr_pollset_poll(ps->pollset, wait, &num,
                                    &desc)) != APR_SUCCESS) {
         /* EINTR indicates a handled signal happened during the poll call,
            ignore, the application can safely retry. */
@@ -290,7 +294,8 @@ apr_status_t serf_context_run(
            handling of the other timeout types when returned from
            serf_event_trigger */
         if (APR_STATUS_IS_TIMEUP(status))
-            return APR_TIMEUP; /* Return the documented error */
+            return wait == duration ? APR_TIMEUP /* the documented error */
+                                    : APR_SUCCESS;
         return status;
     }
 
@@ -319,6 +324,47 @@ void serf_context_set_progress_cb(
 }
 
 
+static void add_allocator_stats(serf_bucket_alloc_stats_t *stats,
+                                const serf_bucket_alloc_t *allocator)
+{
+    serf_bucket_alloc_stats_t one;
+
+    serf_bucket_allocator_stats(&one, allocator);
+
+    stats->bytes_in_use += one.bytes_in_use;
+    stats->peak_bytes_in_use += one.peak_bytes_in_use;
+    stats->allocs_in_use += one.allocs_in_use;
+    stats->blocks += one.blocks;
+    stats->freelist_len += one.freelist_len;
+    stats->large_allocs_in_use += one.large_allocs_in_use;
+    stats->large_allocs_total += one.large_allocs_total;
+}
+
+void serf_context_allocator_stats(
+    serf_bucket_alloc_stats_t *stats,
+    serf_context_t *ctx)
+{
+    int i;
+
+    memset(stats, 0, sizeof(*stats));
+
+    for (i = 0; i < ctx->conns->nelts; i++) {
+        serf_connection_t *conn = GET_CONN(ctx, i);
+        serf_request_t *request;
+        serf__respool_t *rp;
+
+        add_allocator_stats(stats, conn->allocator);
+
+        for (request = conn->requests; request; request = request->next) {
+            if (request->respool_entry)
+                add_allocator_stats(stats, request->allocator);
+        }
+        for (rp = conn->spare_respools; rp; rp = rp->next)
+            add_allocator_stats(stats, rp->allocator);
+    }
+}
+
+
 serf_bucket_t *serf_context_bucket_socket_create(
     serf_context_t *ctx,
     apr_socket_t *skt,
@@ -362,6 +408,8 @@ const char *serf_error_string(apr_status_t errcode)
         return "The server sent a truncated HTTP response body.";
     case SERF_ERROR_ABORTED_CONNECTION:
         return "The server unexpectedly closed the connection.";
+    case SERF_ERROR_COMPRESSION_FAILED:
+        return "An error occurred during compression";
     case SERF_ERROR_SSL_COMM_FAILED:
         return "An error occurred during SSL communication";
     case SERF_ERROR_SSL_CERT_FAILED:
@@ -23,6 +23,9 @@
 
 #include "serf_private.h"
 
+/* How long to hold back a request body waiting for 100 Continue. */
+#define DEFAULT_CONTINUE_TIMEOUT apr_time_from_sec(1)
+
 /* cleanup for sockets */
 static apr_status_t clean_skt(void *data)
 {
@@ -162,7 +165,7 @@ apr_status_t serf__conn_update_pollset(serf_connection_t *conn)
              *   there are any requests that still have buckets to write out,
              *     then we want to write.
              */
-            if (conn->vec_len &&
+            if ((conn->vec_len || conn->sendfile_file) &&
                 conn->state != SERF_CONN_CLOSING)
                 desc.reqevents |= APR_POLLOUT;
             else {
@@ -319,6 +322,66 @@ static apr_status_t prepare_conn_streams(serf_connection_t *conn,
     return APR_SUCCESS;
 }
 
+/* Let the body of REQUEST, held back for 100 Continue, be sent. */
+static void open_continue_gate(serf_request_t *request)
+{
+    serf_connection_t *conn = request->conn;
+
+    serf__continue_gate_open(request->continue_gate);
+    request->continue_gate = NULL;
+
+    conn->continue_deadline = 0;
+    conn->stop_writing = 0;
+    conn->dirty_conn = 1;
+    conn->ctx->dirty_pollset = 1;
+}
+
+/* Send the held back request body of CONN if the server took too long to
+   ask for it. */
+static void check_continue_timeout(serf_connection_t *conn)
+{
+    serf_request_t *request;
+
+    if (!conn->continue_deadline || apr_time_now() < conn->continue_deadline)
+        return;
+
+    for (request = conn->requests; request; request = request->next) {
+        if (request->continue_gate) {
+            serf__log_skt(CONN_VERBOSE, __FILE__, conn->skt,
+                          "No 100 Continue in time, sending body.\n");
+            open_continue_gate(request);
+            break;
+        }
+    }
+    conn->continue_deadline = 0;
+}
+
+apr_short_interval_time_t serf__continue_poll_duration(
+    serf_context_t *ctx,
+    apr_short_interval_time_t duration)
+{
+    apr_time_t now = 0;
+    int i;
+
+    for (i = 0; i < ctx->conns->nelts; i++) {
+        serf_connection_t *conn = GET_CONN(ctx, i);
+        apr_interval_time_t left;
+
+        if (!conn->continue_deadline)
+            continue;
+
+        if (!now)
+            now = apr_time_now();
+        left = conn->continue_deadline - now;
+        if (left < 0)
+            left = 0;
+        if (duration < 0 || left < duration)
+            duration = (apr_short_interval_time_t)left;
+    }
+
+    return duration;
+}
+
 /* Create and connect sockets for any connections which don't have them
  * yet. This is the core of our lazy-connect behavior.
  */
@@ -334,6 +397,8 @@ apr_status_t serf__open_connections(serf_context_t *ctx)
 
         conn->seen_in_pollset = 0;
 
+        check_continue_timeout(conn);
+
         if (conn->skt != NULL) {
 #ifdef SERF_DEBUG_BUCKET_USE
             check_buckets_drained(conn);
@@ -437,6 +502,7 @@ static apr_status_t no_more_writes(serf_connection_t *conn)
 
     /* Clear our iovec. */
     conn->vec_len = 0;
+    conn->sendfile_file = NULL;
 
     /* Update the pollset to know we don't want to write on this socket any
      * more.
@@ -457,7 +523,7 @@ static apr_status_t is_conn_closing(serf_bucket_t *response)
     const char *val;
 
     hdrs = serf_bucket_response_get_headers(response);
-    val = serf_bucket_headers_get(hdrs, "Connection");
+    val = serf__bucket_headers_get_token(hdrs, SERF__HDR_CONNECTION);
     if (val && strcasecmp("close", val) == 0)
         {
             return SERF_ERROR_CLOSING;
@@ -479,6 +545,105 @@ static void link_requests(serf_request_t **list, serf_request_t **tail,
     }
 }
 
+/* The pool owning a response pool and its allocator is being destroyed,
+   most likely along with the connection's pool. */
+static apr_status_t clean_respool_owner(void *data)
+{
+    serf__respool_t *rp = data;
+
+    rp->owner = NULL;
+
+    return APR_SUCCESS;
+}
+
+/* Give REQUEST a response pool and bucket allocator, reusing the ones
+   left behind by an earlier request on the connection if possible. */
+static void acquire_respool(serf_request_t *request)
+{
+    serf_connection_t *conn = request->conn;
+    serf__respool_t *rp = conn->spare_respools;
+
+    if (rp) {
+        conn->spare_respools = rp->next;
+        --conn->num_spare_respools;
+    }
+    else {
+        rp = serf_bucket_mem_alloc(conn->allocator, sizeof(*rp));
+        apr_pool_create(&rp->owner, conn->pool);
+        apr_pool_create(&rp->pool, rp->owner);
+        rp->allocator = serf_bucket_allocator_create(rp->owner, NULL, NULL);
+        /* Buckets allocate per-request data, like stat info and mmaps of
+           file buckets, in the allocator's pool: have that be the pool
+           that is cleared after each request. */
+        serf__bucket_allocator_set_pool(rp->allocator, rp->pool);
+        apr_pool_cleanup_register(rp->owner, rp, clean_respool_owner,
+                                  apr_pool_cleanup_null);
+    }
+    rp->next = NULL;
+
+    request->respool_entry = rp;
+    request->respool = rp->pool;
+    request->allocator = rp->allocator;
+    apr_pool_cleanup_register(request->respool, request,
+                              clean_resp, clean_resp);
+}
+
+static void destroy_respool(serf_connection_t *conn, serf__respool_t *rp)
+{
+    if (rp->owner) {
+        apr_pool_destroy(rp->owner);
+    }
+    serf_bucket_mem_free(conn->allocator, rp);
+}
+
+/* Hand the response pool and bucket allocator of REQUEST back to its
+   connection, so that a later request can reuse them. */
+static void release_respool(serf_request_t *request)
+{
+    serf_connection_t *conn = request->conn;
+    serf__respool_t *rp = request->respool_entry;
+
+    request->respool_entry = NULL;
+
+    /* If the application cleared or destroyed RESPOOL behind our back, we
+       can't tell which of the two happened; don't reuse it. */
+    if (rp->owner == NULL || request->respool == NULL ||
+        conn->num_spare_respools >= MAX_SPARE_RESPOOLS) {
+        destroy_respool(conn, rp);
+        return;
+    }
+
+    /* This runs clean_resp() for REQUEST. */
+    apr_pool_clear(rp->pool);
+
+    rp->next = conn->spare_respools;
+    conn->spare_respools = rp;
+    ++conn->num_spare_respools;
+}
+
+static void destroy_spare_respools(serf_connection_t *conn)
+{
+    while (conn->spare_respools) {
+        serf__respool_t *rp = conn->spare_respools;
+
+        conn->spare_respools = rp->next;
+        destroy_respool(conn, rp);
+    }
+    conn->num_spare_respools = 0;
+}
+
+/* Return unused memory of the connection's bucket allocators, including
+   those of the spare response pools, to APR. */
+static void trim_allocators(serf_connection_t *conn)
+{
+    serf__respool_t *rp;
+
+    serf_bucket_allocator_trim(conn->allocator);
+    for (rp = conn->spare_respools; rp; rp = rp->next) {
+        serf_bucket_allocator_trim(rp->allocator);
+    }
+}
+
 static apr_status_t destroy_request(serf_request_t *request)
 {
     serf_connection_t *conn = request->conn;
@@ -497,9 +662,8 @@ static apr_status_t destroy_request(serf_request_t *request)
     }
 
     serf_debug__bucket_alloc_check(request->allocator);
-    if (request->respool) {
-        /* ### unregister the pool cleanup for self?  */
-        apr_pool_destroy(request->respool);
+    if (request->respool_entry) {
+        release_respool(request);
     }
 
     serf_bucket_mem_free(conn->allocator, request);
@@ -618,6 +782,8 @@ static apr_status_t reset_connection(serf_connection_t *conn,
 
     /* Don't try to resume any writes */
     conn->vec_len = 0;
+    conn->sendfile_file = NULL;
+    conn->continue_deadline = 0;
 
     conn->dirty_conn = 1;
     conn->ctx->dirty_pollset = 1;
@@ -634,6 +800,36 @@ static apr_status_t reset_connection(serf_connection_t *conn,
     return APR_SUCCESS;
 }
 
+/* Drop the first WRITTEN bytes from CONN->vec, which have been sent. */
+static void consume_vec(serf_connection_t *conn, apr_size_t written)
+{
+    apr_size_t len = 0;
+    int i;
+
+    for (i = 0; i < conn->vec_len; i++) {
+        len += conn->vec[i].iov_len;
+        if (written < len) {
+            serf__log_nopref(SOCK_MSG_VERBOSE, "%.*s",
+                               conn->vec[i].iov_len - (len - written),
+                               conn->vec[i].iov_base);
+            if (i) {
+                memmove(conn->vec, &conn->vec[i],
+                        sizeof(struct iovec) * (conn->vec_len - i));
+                conn->vec_len -= i;
+            }
+            conn->vec[0].iov_base = (char *)conn->vec[0].iov_base + (conn->vec[0].iov_len - (len - written));
+            conn->vec[0].iov_len = len - written;
+            break;
+        } else {
+            serf__log_nopref(SOCK_MSG_VERBOSE, "%.*s",
+                               conn->vec[i].iov_len, conn->vec[i].iov_base);
+        }
+    }
+    if (len == written) {
+        conn->vec_len = 0;
+    }
+}
+
 static apr_status_t socket_writev(serf_connection_t *conn)
 {
     apr_size_t written;
@@ -647,34 +843,66 @@ static apr_status_t socket_writev(serf_connection_t *conn)
 
     /* did we write everything? */
     if (written) {
-        apr_size_t len = 0;
-        int i;
-
         serf__log_skt(SOCK_MSG_VERBOSE, __FILE__, conn->skt,
                       "--- socket_sendv:\n");
 
-        for (i = 0; i < conn->vec_len; i++) {
-            len += conn->vec[i].iov_len;
-            if (written < len) {
-                serf__log_nopref(SOCK_MSG_VERBOSE, "%.*s",
-                                   conn->vec[i].iov_len - (len - written),
-                                   conn->vec[i].iov_base);
-                if (i) {
-                    memmove(conn->vec, &conn->vec[i],
-                            sizeof(struct iovec) * (conn->vec_len - i));
-                    conn->vec_len -= i;
-                }
-                conn->vec[0].iov_base = (char *)conn->vec[0].iov_base + (conn->vec[0].iov_len - (len - written));
-                conn->vec[0].iov_len = len - written;
-                break;
-            } else {
-                serf__log_nopref(SOCK_MSG_VERBOSE, "%.*s",
-                                   conn->vec[i].iov_len, conn->vec[i].iov_base);
-            }
+        consume_vec(conn, written);
+
+        serf__log_nopref(SOCK_MSG_VERBOSE, "-(%d)-\n", written);
+
+        /* Log progress information */
+        serf__context_progress_delta(conn->ctx, 0, written);
+    }
+
+    return status;
+}
+
+#if APR_HAS_SENDFILE
+/* Send the data in CONN->vec followed by the pending file region. */
+static apr_status_t socket_sendfile(serf_connection_t *conn)
+{
+    apr_hdtr_t hdtr;
+    apr_off_t offset = conn->sendfile_offset;
+    apr_size_t vec_bytes = 0;
+    apr_size_t written;
+    apr_status_t status;
+    int i;
+
+    for (i = 0; i < conn->vec_len; i++)
+        vec_bytes += conn->vec[i].iov_len;
+
+    hdtr.headers = conn->vec;
+    hdtr.numheaders = conn->vec_len;
+    hdtr.trailers = NULL;
+    hdtr.numtrailers = 0;
+
+    written = conn->sendfile_len;
+    status = apr_socket_sendfile(conn->skt, conn->sendfile_file, &hdtr,
+                                 &offset, &written, 0);
+    if (status && !APR_STATUS_IS_EAGAIN(status))
+        serf__log_skt(SOCK_VERBOSE, __FILE__, conn->skt,
+                      "socket_sendfile error %d\n", status);
+
+    if (written) {
+        serf__log_skt(SOCK_MSG_VERBOSE, __FILE__, conn->skt,
+                      "--- socket_sendfile:\n");
+
+        if (written < vec_bytes) {
+            consume_vec(conn, written);
         }
-        if (len == written) {
-            conn->vec_len = 0;
+        else {
+            apr_size_t file_written = written - vec_bytes;
+
+            consume_vec(conn, vec_bytes);
+
+            serf__log_nopref(SOCK_MSG_VERBOSE, "[%d bytes of file]",
+                             file_written);
+            conn->sendfile_offset += file_written;
+            conn->sendfile_len -= file_written;
+            if (!conn->sendfile_len)
+                conn->sendfile_file = NULL;
         }
+
         serf__log_nopref(SOCK_MSG_VERBOSE, "-(%d)-\n", written);
 
         /* Log progress information */
@@ -683,18 +911,29 @@ static apr_status_t socket_writev(serf_connection_t *conn)
 
     return status;
 }
+#endif
+
+/* Write out the pending data of CONN. */
+static apr_status_t socket_write(serf_connection_t *conn)
+{
+#if APR_HAS_SENDFILE
+    if (conn->sendfile_file)
+        return socket_sendfile(conn);
+#endif
+
+    return socket_writev(conn);
+}
 
 static apr_status_t setup_request(serf_request_t *request)
 {
-    serf_connection_t *conn = request->conn;
     apr_status_t status;
 
-    /* Now that we are about to serve the request, allocate a pool. */
-    apr_pool_create(&request->respool, conn->pool);
-    request->allocator = serf_bucket_allocator_create(request->respool,
-                                                      NULL, NULL);
-    apr_pool_cleanup_register(request->respool, request,
-                              clean_resp, clean_resp);
+    /* Now that we are about to serve the request, get a pool. If the
+       request was set up before, start over with a clean one. */
+    if (request->respool_entry) {
+        release_respool(request);
+    }
+    acquire_respool(request);
 
     /* Fill in the rest of the values for the request. */
     status = request->setup(request, request->setup_baton,
@@ -707,6 +946,63 @@ static apr_status_t setup_request(serf_request_t *request)
     return status;
 }
 
+/* Append REQUEST, and the requests following it which may be pipelined
+   after it, to OSTREAMT. A single read of the outgoing stream can then
+   return the data of all of them, to be written in one go. */
+static apr_status_t append_requests(serf_connection_t *conn,
+                                    serf_request_t *request,
+                                    serf_bucket_t *ostreamt)
+{
+    unsigned int max_requests = conn->max_outstanding_requests;
+    unsigned int queued = 0;
+
+    /* See write_to_connection. */
+    if (conn->state != SERF_CONN_CONNECTED)
+        max_requests = 1;
+
+    for (; request; request = request->next) {
+        apr_status_t status;
+
+        if (queued) {
+            if (max_requests &&
+                conn->completed_requests + queued - conn->completed_responses
+                    >= max_requests)
+                break;
+            if (conn->probable_keepalive_limit &&
+                conn->completed_requests + queued >
+                    conn->probable_keepalive_limit)
+                break;
+        }
+
+        if (request->req_bkt == NULL) {
+            status = setup_request(request);
+            if (status)
+                return status;
+        }
+
+        if (!request->writing_started) {
+            serf_bucket_t *gate;
+
+            /* A body waiting for 100 Continue would hold up the requests
+               queued before it; send it in a round of its own. */
+            gate = serf__bucket_request_get_continue_gate(request->req_bkt);
+            if (gate && queued)
+                break;
+
+            request->writing_started = 1;
+            request->continue_gate = gate;
+            serf_bucket_aggregate_append(ostreamt, request->req_bkt);
+        }
+        queued++;
+
+        /* Nothing may follow a body that waits for 100 Continue. */
+        if (request->continue_gate)
+            break;
+    }
+
+    return APR_SUCCESS;
+}
+
 /* write data out to the connection */
 static apr_status_t write_to_connection(serf_connection_t *conn)
 {
@@ -747,8 +1043,8 @@ static apr_status_t write_to_connection(serf_connection_t *conn)
         }
 
         /* If we have unwritten data, then write what we can. */
-        while (conn->vec_len) {
-            status = socket_writev(conn);
+        while (conn->vec_len || conn->sendfile_file) {
+            status = socket_write(conn);
 
             /* If the write would have blocked, then we're done. Don't try
              * to write anything else to the socket.
@@ -786,30 +1082,44 @@ static apr_status_t write_to_connection(serf_connection_t *conn)
         }
 
         if (request) {
-            if (request->req_bkt == NULL) {
-                read_status = setup_request(request);
-                if (read_status) {
-                    /* Something bad happened. Propagate any errors. */
-                    return read_status;
-                }
-            }
-
-            if (!request->writing_started) {
-                request->writing_started = 1;
-                serf_bucket_aggregate_append(ostreamt, request->req_bkt);
+            status = append_requests(conn, request, ostreamt);
+            if (status) {
+                /* Something bad happened. Propagate any errors. */
+                return status;
             }
         }
 
-        /* ### optimize at some point by using read_for_sendfile */
         /* TODO: now that read_iovec will effectively try to return as much
            data as available, we probably don't want to read ALL_AVAIL, but
            a lower number, like the size of one or a few TCP packets, the
            available TCP buffer size ... */
+#if APR_HAS_SENDFILE
+        /* If the stream exposes a file (e.g. a file request body), let the
+           kernel send it. Encrypting buckets never do, so TLS connections
+           just get their data in the headers. */
+        {
+            apr_hdtr_t hdtr;
+
+            hdtr.headers = conn->vec;
+            hdtr.numheaders = IOV_MAX;
+            hdtr.trailers = NULL;
+            hdtr.numtrailers = 0;
+
+            read_status = serf_bucket_read_for_sendfile(ostreamh,
+                                                        SERF_READ_ALL_AVAIL,
+                                                        &hdtr,
+                                                        &conn->sendfile_file,
+                                                        &conn->sendfile_offset,
+                                                        &conn->sendfile_len);
+            conn->vec_len = hdtr.numheaders;
+        }
+#else
         read_status = serf_bucket_read_iovec(ostreamh,
                                              SERF_READ_ALL_AVAIL,
                                              IOV_MAX,
                                              conn->vec,
                                              &conn->vec_len);
+#endif
 
         if (!conn->hit_eof) {
             if (APR_STATUS_IS_EAGAIN(read_status)) {
@@ -839,8 +1149,8 @@ static apr_status_t write_to_connection(serf_connection_t *conn)
 
         /* If we got some data, then deliver it. */
         /* ### what to do if we got no data?? is that a problem? */
-        if (conn->vec_len > 0) {
-            status = socket_writev(conn);
+        if (conn->vec_len > 0 || conn->sendfile_file) {
+            status = socket_write(conn);
 
             /* If we can't write any more, or an error occurred, then
              * we're done here.
@@ -863,29 +1173,49 @@ static apr_status_t write_to_connection(serf_connection_t *conn)
             conn->dirty_conn = 1;
             conn->ctx->dirty_pollset = 1;
         }
+        else if (request && request->continue_gate &&
+                 APR_STATUS_IS_EAGAIN(read_status) &&
+                 conn->vec_len == 0 && !conn->sendfile_file) {
+            /* The request line and headers are out, and the body waits for
+               100 Continue. Don't look for writability until the server
+               responds or we're tired of waiting. */
+            if (!conn->continue_deadline)
+                conn->continue_deadline = apr_time_now()
+                                          + conn->continue_timeout;
+            conn->stop_writing = 1;
+            conn->dirty_conn = 1;
+            conn->ctx->dirty_pollset = 1;
+        }
         else if (request && read_status && conn->hit_eof &&
-                 conn->vec_len == 0) {
-            /* If we hit the end of the request bucket and all of its data has
-             * been written, then clear it out to signify that we're done
-             * sending the request. On the next iteration through this loop:
+                 conn->vec_len == 0 && !conn->sendfile_file) {
+            /* If we hit the end of the request buckets and all of their data
+             * has been written, then clear them out to signify that we're
+             * done sending the requests. On the next iteration through this
+             * loop:
              * - if there are remaining bytes they will be written, and as the 
              * request bucket will be completely read it will be destroyed then.
              * - we'll see if there are other requests that need to be sent 
              * ("pipelining").
              */
             conn->hit_eof = 0;
-            serf_bucket_destroy(request->req_bkt);
-            request->req_bkt = NULL;
 
-            /* If our connection has async responses enabled, we're not
-             * going to get a reply back, so kill the request.
-             */
-            if (conn->async_responses) {
-                conn->requests = request->next;
-                destroy_request(request);
-            }
+            while (request && request->writing_started && request->req_bkt) {
+                serf_request_t *next = request->next;
 
-            conn->completed_requests++;
+                serf_bucket_destroy(request->req_bkt);
+                request->req_bkt = NULL;
+
+                /* If our connection has async responses enabled, we're not
+                 * going to get a reply back, so kill the request.
+                 */
+                if (conn->async_responses) {
+                    conn->requests = next;
+                    destroy_request(request);
+                }
+
+                conn->completed_requests++;
+                request = next;
+            }
 
             if (conn->probable_keepalive_limit &&
                 conn->completed_requests > conn->probable_keepalive_limit) {
@@ -1125,6 +1455,14 @@ static apr_status_t read_from_connection(serf_connection_t *conn)
 
         status = handle_response(request, tmppool);
 
+        /* 100 Continue, or any other interim response, means the server
+           wants the body we held back. If we can't tell, send it. */
+        if (request->continue_gate &&
+            (!SERF_BUCKET_IS_RESPONSE(request->resp_bkt) ||
+             serf__bucket_response_got_interim(request->resp_bkt))) {
+            open_continue_gate(request);
+        }
+
         /* Some systems will not generate a HUP poll event so we have to
          * handle the ECONNRESET issue and ECONNABORT here.
          */
@@ -1167,6 +1505,11 @@ static apr_status_t read_from_connection(serf_connection_t *conn)
 
         close_connection = is_conn_closing(request->resp_bkt);
 
+        /* The final response came before the body we held back; the server
+           may or may not still read it, so don't reuse the connection. */
+        if (request->continue_gate && APR_STATUS_IS_EOF(status))
+            close_connection = SERF_ERROR_CLOSING;
+
         if (!APR_STATUS_IS_EOF(status) &&
             close_connection != SERF_ERROR_CLOSING) {
             /* Whether success, or an error, there is no more to do unless
@@ -1187,9 +1530,11 @@ static apr_status_t read_from_connection(serf_connection_t *conn)
 
         request = conn->requests;
 
-        /* If we're truly empty, update our tail. */
+        /* If we're truly empty, update our tail, and give back memory
+           left over from earlier bursts of requests. */
         if (request == NULL) {
             conn->requests_tail = NULL;
+            trim_allocators(conn);
         }
 
         conn->completed_responses++;
@@ -1349,6 +1694,7 @@ serf_connection_t *serf_connection_create(
     conn->hit_eof = 0;
     conn->state = SERF_CONN_INIT;
     conn->latency = -1; /* unknown */
+    conn->continue_timeout = DEFAULT_CONTINUE_TIMEOUT;
 
     /* Create a subpool for our connection. */
     apr_pool_create(&conn->skt_pool, conn->pool);
@@ -1436,6 +1782,7 @@ apr_status_t serf_connection_close(
             while (conn->requests) {
                 serf_request_cancel(conn->requests);
             }
+            destroy_spare_respools(conn);
             if (conn->skt != NULL) {
                 remove_connection(ctx, conn);
                 status = apr_socket_close(conn->skt);
@@ -1497,6 +1844,13 @@ void serf_connection_set_max_outstanding_requests(
 }
 
 
+void serf_connection_set_expect_continue_timeout(
+    serf_connection_t *conn,
+    apr_interval_time_t timeout)
+{
+    conn->continue_timeout = timeout;
+}
+
 void serf_connection_set_async_responses(
     serf_connection_t *conn,
     serf_response_acceptor_t acceptor,
@@ -1526,11 +1880,13 @@ create_request(serf_connection_t *conn,
     request->setup_baton = setup_baton;
     request->handler = NULL;
     request->respool = NULL;
+    request->respool_entry = NULL;
     request->req_bkt = NULL;
     request->resp_bkt = NULL;
     request->priority = priority;
     request->writing_started = 0;
     request->ssltunnel = ssltunnel;
+    request->continue_gate = NULL;
     request->next = NULL;
     request->auth_baton = NULL;
 
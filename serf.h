@@ -87,6 +87,8 @@ typedef struct serf_request_t serf_request_t;
 #define SERF_ERROR_SSLTUNNEL_SETUP_FAILED (SERF_ERROR_START + 7)
 /* The server unexpectedly closed the connection prematurely. */
 #define SERF_ERROR_ABORTED_CONNECTION (SERF_ERROR_START + 8)
+/* This code is for when something went wrong during compressing data. */
+#define SERF_ERROR_COMPRESSION_FAILED (SERF_ERROR_START + 9)
 
 /* SSL certificates related errors */
 #define SERF_ERROR_SSL_CERT_FAILED (SERF_ERROR_START + 70)
@@ -502,6 +504,19 @@ void serf_connection_set_max_outstanding_requests(
     serf_connection_t *conn,
     unsigned int max_requests);
 
+/**
+ * Sets how long @a conn holds back the body of a request created with
+ * serf_bucket_request_set_expect_continue() waiting for the server's
+ * 100 Continue. When @a timeout passes without a response, the body is
+ * sent anyway. The default is one second.
+ *
+ * The timeout is checked by serf_context_prerun(), so applications driving
+ * their own pollset should not wait in it much longer than @a timeout.
+ */
+void serf_connection_set_expect_continue_timeout(
+    serf_connection_t *conn,
+    apr_interval_time_t timeout);
+
 void serf_connection_set_async_responses(
     serf_connection_t *conn,
     serf_response_acceptor_t acceptor,
@@ -993,6 +1008,70 @@ serf_bucket_alloc_t *serf_bucket_allocator_create(
 apr_pool_t *serf_bucket_allocator_get_pool(
     const serf_bucket_alloc_t *allocator);
 
+/**
+ * Memory usage statistics of one or more bucket allocators.
+ *
+ * Small allocations are carved out of 8k blocks which the allocator keeps
+ * until it is destroyed; freed small allocations are kept on a freelist
+ * for reuse. Large allocations are obtained from (and returned to) the
+ * APR allocator directly.
+ */
+typedef struct serf_bucket_alloc_stats_t {
+    /** Bytes currently handed out by serf_bucket_mem_alloc(), including
+        the per-allocation overhead. */
+    apr_size_t bytes_in_use;
+
+    /** The highest value @a bytes_in_use has reached. When aggregated over
+        several allocators, this is the sum of their peaks. */
+    apr_size_t peak_bytes_in_use;
+
+    /** Number of allocations that were not freed yet. */
+    apr_size_t allocs_in_use;
+
+    /** Number of 8k blocks held for small allocations. */
+    apr_size_t blocks;
+
+    /** Number of freed small allocations, waiting to be reused. */
+    apr_size_t freelist_len;
+
+    /** Number of large allocations that were not freed yet. */
+    apr_size_t large_allocs_in_use;
+
+    /** Total number of large allocations made. */
+    apr_size_t large_allocs_total;
+} serf_bucket_alloc_stats_t;
+
+/**
+ * Return memory held by @a allocator for small allocations, but no longer
+ * in use, to the APR allocator.
+ *
+ * The allocator holds on to memory of freed small allocations, so that it
+ * can quickly reuse it. After a burst of activity this may be a lot more
+ * than needed for normal operation. Note that the memory is not returned
+ * to the operating system, but to the APR allocator of the pool the bucket
+ * allocator was created in, and thus becomes available to other users of
+ * that APR allocator.
+ *
+ * Connections call this automatically when their request queue drains.
+ */
+void serf_bucket_allocator_trim(
+    serf_bucket_alloc_t *allocator);
+
+/**
+ * Fill in @a stats with the current memory usage of @a allocator.
+ */
+void serf_bucket_allocator_stats(
+    serf_bucket_alloc_stats_t *stats,
+    const serf_bucket_alloc_t *allocator);
+
+/**
+ * Fill in @a stats with the combined memory usage of the bucket allocators
+ * of all connections in @a ctx, and of their requests.
+ */
+void serf_context_allocator_stats(
+    serf_bucket_alloc_stats_t *stats,
+    serf_context_t *ctx);
+
 
 /**
  * Utility structure for reading a complete line of input from a bucket.
@@ -1035,14 +1114,34 @@ void serf_linebuf_init(serf_linebuf_t *linebuf);
  * @a linebuf. @a acceptable specifies the types of newlines which are
  * acceptable for this fetch.
  *
- * ### we should return a data/len pair so that we can avoid a copy,
- * ### rather than having callers look into our state and line buffer.
+ * @see serf_linebuf_fetch_nocopy to avoid copying the line when possible.
  */
 apr_status_t serf_linebuf_fetch(
     serf_linebuf_t *linebuf,
     serf_bucket_t *bucket,
     int acceptable);
 
+/**
+ * Like serf_linebuf_fetch(), but once the line is complete, return it in
+ * @a line and @a line_len (without the newline).
+ *
+ * If the complete line was read from @a bucket in one go, it is not copied
+ * into @a linebuf; @a line then points into the data of @a bucket and is
+ * only valid until the next read from @a bucket. Otherwise @a line points
+ * to the line member of @a linebuf. In both cases the used member of
+ * @a linebuf is set to the length of the line, but only in the latter case
+ * does the line member hold its data.
+ *
+ * @a line and @a line_len are only set when the state of @a linebuf is
+ * SERF_LINEBUF_READY.
+ */
+apr_status_t serf_linebuf_fetch_nocopy(
+    serf_linebuf_t *linebuf,
+    serf_bucket_t *bucket,
+    int acceptable,
+    const char **line,
+    apr_size_t *line_len);
+
 /** @} */
 
 
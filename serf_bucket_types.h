@@ -62,6 +62,31 @@ void serf_bucket_request_become(
     const char *uri,
     serf_bucket_t *body);
 
+/**
+ * Send the request @a bucket with an "Expect: 100-continue" header, and
+ * hold back its body until the server asks for it with 100 Continue.
+ *
+ * When sent over a connection, the body also goes out once the timeout set
+ * with serf_connection_set_expect_continue_timeout() passes. If the server
+ * sends its final response instead, the body is not sent at all and the
+ * connection is closed after that response.
+ *
+ * Does nothing for requests without a body.
+ */
+void serf_bucket_request_set_expect_continue(
+    serf_bucket_t *bucket);
+
+/**
+ * Send the request @a bucket with an Accept-Encoding header listing the
+ * content codings that the response bucket decodes: gzip and deflate, and
+ * br and zstd when serf was built with brotli and zstd support.
+ *
+ * The response bucket picks the decoder from the Content-Encoding header
+ * of the response, so its body is read as if it wasn't encoded.
+ */
+void serf_bucket_request_set_accept_encoding(
+    serf_bucket_t *bucket);
+
 /**
  * Sets the root url of the remote host. If this request contains a relative
  * url, it will be prefixed with the root url to form an absolute url.
@@ -72,6 +97,38 @@ void serf_bucket_request_set_root(
     serf_bucket_t *bucket,
     const char *root_url);
 
+/**
+ * A request line and set of headers serialized once, to create any number
+ * of identical requests from. Templates are immutable and can be shared by
+ * all connections that live no longer than the pool it was created in.
+ */
+typedef struct serf_request_template_t serf_request_template_t;
+
+/**
+ * Create a template in @a pool for requests with @a method and @a uri, and
+ * the headers in the headers bucket @a headers, which may be NULL. The
+ * headers are copied; @a headers is left untouched.
+ */
+serf_request_template_t *serf_request_template_create(
+    const char *method,
+    const char *uri,
+    serf_bucket_t *headers,
+    apr_pool_t *pool);
+
+/**
+ * Create a request bucket from the template @a tmpl, to send @a body. If
+ * @a uri is not NULL it is used instead of the URI of the template.
+ *
+ * The request line and headers of the template are sent without being
+ * copied. Headers set through serf_bucket_request_get_headers() on the
+ * new bucket are sent after those of the template.
+ */
+serf_bucket_t *serf_bucket_request_create_from_template(
+    const serf_request_template_t *tmpl,
+    const char *uri,
+    serf_bucket_t *body,
+    serf_bucket_alloc_t *allocator);
+
 /* ==================================================================== */
 
 
@@ -129,6 +186,26 @@ serf_bucket_t *serf_bucket_response_get_headers(
 void serf_bucket_response_set_head(
     serf_bucket_t *bucket);
 
+/**
+ * Write the body of the @a response to @a file, and set @a written to the
+ * number of bytes written by this call. This is meant to be used from a
+ * response handler, instead of reading the body, once the status line and
+ * headers are dealt with.
+ *
+ * Like a read, this returns APR_EAGAIN when no more data is available for
+ * now, and APR_EOF when the whole body has been written.
+ *
+ * A body with a Content-Length and without a Content-Encoding, that is
+ * read directly from a socket bucket, is moved from the socket to the file
+ * inside the kernel where possible (splice(2) on Linux). Other bodies are
+ * read and written in the normal way. Progress is reported to the socket
+ * bucket's progress callback in both cases.
+ */
+apr_status_t serf_bucket_response_body_to_file(
+    serf_bucket_t *response,
+    apr_file_t *file,
+    apr_uint64_t *written);
+
 /* ==================================================================== */
 
 extern const serf_bucket_type_t serf_bucket_type_response_body;
@@ -257,6 +334,22 @@ serf_bucket_t *serf_bucket_file_create(
     apr_file_t *file,
     serf_bucket_alloc_t *allocator);
 
+/**
+ * Set the size of the buffer the file bucket @a bucket reads into. It
+ * starts at @a min_size bytes and grows up to @a max_size bytes while reads
+ * keep filling it. Pass the same value for both for a fixed size buffer.
+ *
+ * By default the buffer grows from SERF_DATABUF_BUFSIZE to
+ * SERF_DYNBUF_MAX_SIZE bytes.
+ *
+ * serf_bucket_file_create() may return an mmap bucket instead of a file
+ * bucket; for those, this function does nothing.
+ */
+void serf_bucket_file_set_buffer_size(
+    serf_bucket_t *bucket,
+    apr_size_t min_size,
+    apr_size_t max_size);
+
 
 /* ==================================================================== */
 
@@ -281,6 +374,20 @@ void serf_bucket_socket_set_read_progress_cb(
     const serf_progress_t progress_func,
     void *progress_baton);
 
+/**
+ * Set the size of the buffer the socket bucket @a bucket receives into. It
+ * starts at @a min_size bytes and grows up to @a max_size bytes while
+ * reads keep filling it; it is released when the socket has no more data
+ * available. Pass the same value for both for a fixed size buffer.
+ *
+ * By default the buffer grows from SERF_DATABUF_BUFSIZE to
+ * SERF_DYNBUF_MAX_SIZE bytes.
+ */
+void serf_bucket_socket_set_buffer_size(
+    serf_bucket_t *bucket,
+    apr_size_t min_size,
+    apr_size_t max_size);
+
 /* ==================================================================== */
 
 
@@ -336,6 +443,17 @@ serf_bucket_t *serf_bucket_mmap_create(
     apr_mmap_t *mmap,
     serf_bucket_alloc_t *allocator);
 
+/* Creates an mmap bucket for MMAP, which maps FILE from offset 0. The
+   bucket hands out FILE through read_for_sendfile, so the data can be
+   sent without touching the mapping.
+
+   Note: used by serf_bucket_file_create(); keep internal for now.
+  */
+serf_bucket_t *serf__bucket_mmap_create_for_file(
+    apr_mmap_t *mmap,
+    apr_file_t *file,
+    serf_bucket_alloc_t *allocator);
+
 
 /* ==================================================================== */
 
@@ -408,10 +526,54 @@ void serf_bucket_headers_setx(
     apr_size_t value_size,
     int value_copy);
 
+/**
+ * Get the value of @a header from @a headers_bucket, matching the name
+ * case-insensitively. Returns NULL if the header isn't present.
+ *
+ * If the header is present more than once, the values are joined with a
+ * comma (as per RFC 2616, section 4.2). The returned value lives until
+ * the bucket is destroyed or @a header is set again.
+ *
+ * Lookups use an index that is built on the first lookup, so they don't
+ * depend on the number of headers in the bucket.
+ */
 const char *serf_bucket_headers_get(
     serf_bucket_t *headers_bucket,
     const char *header);
 
+/**
+ * Iterator over the values of a header that is present more than once.
+ * @see serf_bucket_headers_iter_first
+ */
+typedef struct serf_bucket_headers_iter_t {
+    const void *next;  /* private */
+} serf_bucket_headers_iter_t;
+
+/**
+ * Start iterating over the values of @a header in @a headers_bucket, in
+ * the order they were set, without joining or copying them.
+ *
+ * Returns the first value, and sets @a value_size to its length if not
+ * NULL, or returns NULL if @a header isn't present. Get the next values
+ * with @see serf_bucket_headers_iter_next, using the same @a iter.
+ *
+ * The bucket must not be changed while iterating.
+ */
+const char *serf_bucket_headers_iter_first(
+    serf_bucket_headers_iter_t *iter,
+    serf_bucket_t *headers_bucket,
+    const char *header,
+    apr_size_t *value_size);
+
+/**
+ * Return the next value of the header that @a iter was started on, and
+ * set @a value_size to its length if not NULL. Returns NULL when there
+ * are no more values.
+ */
+const char *serf_bucket_headers_iter_next(
+    serf_bucket_headers_iter_t *iter,
+    apr_size_t *value_size);
+
 /**
  * @param baton opaque baton as passed to @see serf_bucket_headers_do
  * @param key The header key from this iteration through the table
@@ -448,6 +610,15 @@ serf_bucket_t *serf_bucket_chunk_create(
     serf_bucket_t *stream,
     serf_bucket_alloc_t *allocator);
 
+/**
+ * Limit the chunks created by the chunk @a bucket to @a max_size bytes of
+ * data. By default, and when @a max_size is 0, each chunk holds whatever
+ * a single read of the stream returns.
+ */
+void serf_bucket_chunk_set_max_size(
+    serf_bucket_t *bucket,
+    apr_size_t max_size);
+
 
 /* ==================================================================== */
 
@@ -474,6 +645,75 @@ serf_bucket_t *serf_bucket_deflate_create(
     serf_bucket_alloc_t *allocator,
     int format);
 
+/**
+ * Inflate the data of the deflate @a bucket into a buffer of @a buffer_size
+ * bytes, from 1 KB up to 256 KB; larger sizes are clamped to that range.
+ * Reads return the inflated data from this buffer, so a bigger buffer means
+ * fewer and larger reads for data that compresses well. Pass 0 for the
+ * default of 16 KB.
+ *
+ * This has no effect once the bucket was read from.
+ */
+void serf_bucket_deflate_set_buffer_size(
+    serf_bucket_t *bucket,
+    apr_size_t buffer_size);
+
+extern const serf_bucket_type_t serf_bucket_type_deflate_encode;
+#define SERF_BUCKET_IS_DEFLATE_ENCODE(b) \
+    SERF_BUCKET_CHECK((b), deflate_encode)
+
+/** Use zlib's default compression level. */
+#define SERF_DEFLATE_DEFAULT_LEVEL -1
+
+/**
+ * Create a bucket returning the data of @a stream compressed in @a format,
+ * SERF_DEFLATE_GZIP or SERF_DEFLATE_DEFLATE (raw deflate, as decoded by
+ * serf_bucket_deflate_create()).
+ *
+ * @a level is the compression level, from 0 (none) to 9 (best), or
+ * SERF_DEFLATE_DEFAULT_LEVEL. @a window_bits is the base two logarithm of
+ * the window size, from 9 to 15; pass 0 for the default of 15. A smaller
+ * window uses less memory at the cost of compression.
+ *
+ * To send a compressed request body, pass this bucket as the body of the
+ * request, set the Content-Encoding header and leave the Content-Length
+ * unset; the body is then sent with chunked transfer encoding.
+ */
+serf_bucket_t *serf_bucket_deflate_encode_create(
+    serf_bucket_t *stream,
+    serf_bucket_alloc_t *allocator,
+    int format,
+    int level,
+    int window_bits);
+
+/* ==================================================================== */
+
+extern const serf_bucket_type_t serf_bucket_type_brotli;
+#define SERF_BUCKET_IS_BROTLI(b) SERF_BUCKET_CHECK((b), brotli)
+
+/**
+ * Create a bucket returning the data of @a stream, decoded from the brotli
+ * ("br") content coding.
+ *
+ * Returns NULL if serf was built without brotli support.
+ */
+serf_bucket_t *serf_bucket_brotli_create(
+    serf_bucket_t *stream,
+    serf_bucket_alloc_t *allocator);
+
+extern const serf_bucket_type_t serf_bucket_type_zstd;
+#define SERF_BUCKET_IS_ZSTD(b) SERF_BUCKET_CHECK((b), zstd)
+
+/**
+ * Create a bucket returning the data of @a stream, decoded from the zstd
+ * content coding.
+ *
+ * Returns NULL if serf was built without zstd support.
+ */
+serf_bucket_t *serf_bucket_zstd_create(
+    serf_bucket_t *stream,
+    serf_bucket_alloc_t *allocator);
+
 
 /* ==================================================================== */
 
@@ -500,6 +740,7 @@ extern const serf_bucket_type_t serf_bucket_type_ssl_encrypt;
 
 typedef struct serf_ssl_context_t serf_ssl_context_t;
 typedef struct serf_ssl_certificate_t serf_ssl_certificate_t;
+typedef struct serf_ssl_config_t serf_ssl_config_t;
 
 typedef apr_status_t (*serf_ssl_need_client_cert_t)(
     void *data,
@@ -631,6 +872,102 @@ apr_status_t serf_ssl_use_compression(
     serf_ssl_context_t *ssl_ctx,
     int enabled);
 
+/**
+ * Create an SSL configuration, to share between the connections of a
+ * context. The ssl contexts created from it with serf_ssl_context_create()
+ * use one OpenSSL SSL_CTX, with its options, trusted certificates and
+ * client certificate, so setting up a connection only creates what is
+ * specific to that connection.
+ *
+ * Trusting certificates through one of the ssl contexts, with
+ * serf_ssl_use_default_certificates() or serf_ssl_trust_cert(), trusts them
+ * for all of them. Client certificates are still loaded for each
+ * connection, through its own client cert provider, unless one is set for
+ * all connections with serf_ssl_config_set_client_cert().
+ *
+ * The configuration is released when @a pool is cleaned up; ssl contexts
+ * created from it keep the SSL_CTX alive until they are gone as well.
+ */
+serf_ssl_config_t *serf_ssl_config_create(
+    apr_pool_t *pool);
+
+/**
+ * Like serf_ssl_use_default_certificates(), for all connections using
+ * @a config.
+ */
+apr_status_t serf_ssl_config_use_default_certificates(
+    serf_ssl_config_t *config);
+
+/**
+ * Like serf_ssl_trust_cert(), for all connections using @a config.
+ */
+apr_status_t serf_ssl_config_trust_cert(
+    serf_ssl_config_t *config,
+    serf_ssl_certificate_t *cert);
+
+/**
+ * Send the client certificate in the PKCS12 file @a cert_path, protected
+ * with @a password or NULL, to every server that asks for one on the
+ * connections using @a config. The client cert providers of those
+ * connections are no longer called. Only use this when all connections
+ * using @a config go to servers that may see this certificate.
+ *
+ * Temporary allocations are made in @a pool.
+ */
+apr_status_t serf_ssl_config_set_client_cert(
+    serf_ssl_config_t *config,
+    const char *cert_path,
+    const char *password,
+    apr_pool_t *pool);
+
+/**
+ * Create an ssl context for a connection, using the shared @a config.
+ * Pass it to serf_bucket_ssl_decrypt_create() and
+ * serf_bucket_ssl_encrypt_create(); it is freed along with the last of the
+ * buckets using it.
+ */
+serf_ssl_context_t *serf_ssl_context_create(
+    serf_ssl_config_t *config,
+    serf_bucket_alloc_t *allocator);
+
+/**
+ * Keep the TLS sessions, session IDs as well as session tickets, of the
+ * connections using @a config, so that new connections to the same server
+ * can resume them with an abbreviated handshake. See
+ * serf_ssl_use_session_cache().
+ *
+ * At most @a max_sessions are kept; when there are more, the oldest ones
+ * are dropped. A session is resumed for at most @a max_age after it was
+ * received, or for as long as the server allows if @a max_age is 0. Pass
+ * a @a max_sessions of 0 to stop caching sessions.
+ */
+apr_status_t serf_ssl_config_cache_sessions(
+    serf_ssl_config_t *config,
+    int max_sessions,
+    apr_interval_time_t max_age);
+
+/**
+ * Resume the TLS session of an earlier connection to @a host and @a port,
+ * with the server name set with serf_ssl_set_hostname(), if the session
+ * cache of the configuration of @a context has one. New sessions of this
+ * connection are stored in the cache under the same key.
+ *
+ * Call this after serf_ssl_set_hostname(), before the connection is used.
+ * This does nothing if @a context wasn't created from a configuration that
+ * caches sessions.
+ */
+apr_status_t serf_ssl_use_session_cache(
+    serf_ssl_context_t *context,
+    const char *host,
+    apr_port_t port);
+
+/**
+ * Return non-zero if the handshake of the connection of @a context resumed
+ * an earlier session.
+ */
+int serf_ssl_session_reused(
+    serf_ssl_context_t *context);
+
 serf_bucket_t *serf_bucket_ssl_encrypt_create(
     serf_bucket_t *stream,
     serf_ssl_context_t *ssl_context,
@@ -79,6 +79,18 @@ serf_bucket_t *serf_default_read_bucket(
     serf_bucket_t *bucket,
     const serf_bucket_type_t *type);
 
+/**
+ * Return non-zero if the memory handed out by reads of @a bucket stays
+ * valid until @a bucket is destroyed, instead of only until its next read.
+ *
+ * This holds for buckets serving memory they own or were given, like
+ * simple, iovec, mmap and headers buckets. An aggregate bucket uses it to
+ * keep reading such a child after it returned data, and to move on to the
+ * next child, filling all the vecs of a single read_iovec call.
+ */
+int serf_bucket_data_is_stable(
+    const serf_bucket_t *bucket);
+
 /**
  * Default implementation of the @see destroy functionality.
  *
@@ -287,6 +299,112 @@ apr_status_t serf_databuf_peek(
     apr_size_t *len);
 
 
+/** The default maximum size of the buffer of a @see serf_dynbuf_t. */
+#define SERF_DYNBUF_MAX_SIZE (256 * 1024)
+
+/**
+ * A variant of @see serf_databuf_t whose buffer is allocated from a bucket
+ * allocator, and adapts its size to the data source.
+ *
+ * The buffer starts out at a minimum size. Each time a read from the
+ * source fills it completely, the buffer doubles in size for the next
+ * read, up to a maximum size. When the source has no data available
+ * (APR_EAGAIN without data), a buffer larger than the minimum size is
+ * released and the next one will be half the size, down to the minimum
+ * size. Thus a busy source is read in big chunks, while an idle one holds
+ * at most a buffer of the minimum size.
+ *
+ * This structure should be initialized by calling @see serf_dynbuf_init,
+ * and its buffer released with @see serf_dynbuf_destroy.
+ */
+typedef struct {
+    /** The current data position within the buffer. */
+    const char *current;
+
+    /** Amount of data remaining in the buffer. */
+    apr_size_t remaining;
+
+    /** Callback function. */
+    serf_databuf_reader_t read;
+
+    /** A baton to hold context-specific data. */
+    void *read_baton;
+
+    /** Records the status from the last @see read operation. */
+    apr_status_t status;
+
+    /** Holds the data until it can be returned. NULL if not allocated. */
+    char *buf;
+    apr_size_t bufsize;
+
+    /** The size of the next buffer to allocate, and its bounds. */
+    apr_size_t size;
+    apr_size_t min_size;
+    apr_size_t max_size;
+
+    /** The allocator used for the buffer. */
+    serf_bucket_alloc_t *allocator;
+
+} serf_dynbuf_t;
+
+/**
+ * Initialize the @see serf_dynbuf_t structure specified by @a dynbuf,
+ * allocating its buffer from @a allocator. The buffer size varies between
+ * @a min_size and @a max_size; pass the same value for both to get a
+ * buffer of a fixed size.
+ */
+void serf_dynbuf_init(
+    serf_dynbuf_t *dynbuf,
+    serf_bucket_alloc_t *allocator,
+    apr_size_t min_size,
+    apr_size_t max_size);
+
+/**
+ * Change the bounds of the buffer size of @a dynbuf to @a min_size and
+ * @a max_size. Data already in the buffer is not affected.
+ */
+void serf_dynbuf_set_size(
+    serf_dynbuf_t *dynbuf,
+    apr_size_t min_size,
+    apr_size_t max_size);
+
+/**
+ * Release the buffer held by @a dynbuf.
+ */
+void serf_dynbuf_destroy(
+    serf_dynbuf_t *dynbuf);
+
+/**
+ * Implement a bucket-style read function from the @see serf_dynbuf_t
+ * structure given by @a dynbuf. Works like @see serf_databuf_read.
+ */
+apr_status_t serf_dynbuf_read(
+    serf_dynbuf_t *dynbuf,
+    apr_size_t requested,
+    const char **data,
+    apr_size_t *len);
+
+/**
+ * Implement a bucket-style readline function from the @see serf_dynbuf_t
+ * structure given by @a dynbuf. Works like @see serf_databuf_readline.
+ */
+apr_status_t serf_dynbuf_readline(
+    serf_dynbuf_t *dynbuf,
+    int acceptable,
+    int *found,
+    const char **data,
+    apr_size_t *len);
+
+/**
+ * Implement a bucket-style peek function from the @see serf_dynbuf_t
+ * structure given by @a dynbuf. Works like @see serf_databuf_peek.
+ */
+apr_status_t serf_dynbuf_peek(
+    serf_dynbuf_t *dynbuf,
+    const char **data,
+    apr_size_t *len);
+
+
 #ifdef __cplusplus
 }
 #endif
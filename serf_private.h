@@ -21,6 +21,10 @@
    ### stop, rebuild a pollset, and repopulate it. what suckage.  */
 #define MAX_CONN 16
 
+/* The maximum number of cleared response pools (and bucket allocators) that
+   a connection keeps around for reuse by later requests. */
+#define MAX_SPARE_RESPOOLS 16
+
 /* Windows does not define IOV_MAX, so we need to ensure it is defined. */
 #ifndef IOV_MAX
 /* There is no limit for iovec count on Windows, but apr_socket_sendv
@@ -72,12 +76,28 @@ typedef struct serf_io_baton_t {
     } u;
 } serf_io_baton_t;
 
+/* A response pool together with its bucket allocator. When a request is
+   done, its connection clears the pool and keeps the pair around so the
+   next request can use it without creating a new pool and allocator. */
+typedef struct serf__respool_t {
+    /* Parent of POOL. ALLOCATOR lives in here, so that it survives
+       clearing POOL. NULL once destroyed. */
+    apr_pool_t *owner;
+
+    apr_pool_t *pool;
+    serf_bucket_alloc_t *allocator;
+
+    struct serf__respool_t *next;
+} serf__respool_t;
+
 /* Holds all the information corresponding to a request/response pair. */
 struct serf_request_t {
     serf_connection_t *conn;
 
     apr_pool_t *respool;
     serf_bucket_alloc_t *allocator;
+    /* Where RESPOOL and ALLOCATOR came from. */
+    serf__respool_t *respool_entry;
 
     /* The bucket corresponding to the request. Will be NULL once the
      * bucket has been emptied (for delivery into the socket).
@@ -100,6 +120,10 @@ struct serf_request_t {
     /* 1 if this is a request to setup a SSL tunnel, 0 for normal requests. */
     int ssltunnel;
 
+    /* Holds back the body of REQ_BKT until the server sends 100 Continue,
+       or NULL. See serf_bucket_request_set_expect_continue(). */
+    serf_bucket_t *continue_gate;
+
     /* This baton is currently only used for digest authentication, which
        needs access to the uri of the request in the response handler.
        If serf_request_t is replaced by a serf_http_request_t in the future,
@@ -250,9 +274,19 @@ struct serf_connection_t {
     serf_request_t *requests;
     serf_request_t *requests_tail;
 
+    /* Cleared response pools of finished requests, ready for reuse. */
+    serf__respool_t *spare_respools;
+    unsigned int num_spare_respools;
+
     struct iovec vec[IOV_MAX];
     int vec_len;
 
+    /* A file region from the outgoing stream that still has to be sent
+       after the data in VEC, or NULL. */
+    apr_file_t *sendfile_file;
+    apr_off_t sendfile_offset;
+    apr_size_t sendfile_len;
+
     serf_connection_setup_t setup;
     void *setup_baton;
     serf_connection_closed_t closed;
@@ -281,6 +315,11 @@ struct serf_connection_t {
 
     /* Needs to read first before we can write again. */
     int stop_writing;
+
+    /* How long to wait for 100 Continue before sending a request body
+       anyway, and when that time is up while we wait, or 0. */
+    apr_interval_time_t continue_timeout;
+    apr_time_t continue_deadline;
 };
 
 /*** Internal bucket functions ***/
@@ -295,12 +334,171 @@ struct serf_connection_t {
  */
 apr_status_t serf_response_full_become_aggregate(serf_bucket_t *bucket);
 
+/* The content codings the response bucket decodes, as the value of an
+   Accept-Encoding header. */
+#ifdef SERF_HAVE_BROTLI
+#define SERF__ACCEPT_ENCODING_BR "br, "
+#else
+#define SERF__ACCEPT_ENCODING_BR ""
+#endif
+#ifdef SERF_HAVE_ZSTD
+#define SERF__ACCEPT_ENCODING_ZSTD "zstd, "
+#else
+#define SERF__ACCEPT_ENCODING_ZSTD ""
+#endif
+#define SERF__ACCEPT_ENCODING \
+    SERF__ACCEPT_ENCODING_BR SERF__ACCEPT_ENCODING_ZSTD "gzip, deflate"
+
+/* The well-known HTTP header names, see serf__header_token(). */
+typedef enum {
+    SERF__HDR_UNKNOWN = 0,
+    SERF__HDR_ACCEPT,
+    SERF__HDR_ACCEPT_ENCODING,
+    SERF__HDR_ACCEPT_LANGUAGE,
+    SERF__HDR_ACCEPT_RANGES,
+    SERF__HDR_AGE,
+    SERF__HDR_ALLOW,
+    SERF__HDR_AUTHORIZATION,
+    SERF__HDR_AUTHENTICATION_INFO,
+    SERF__HDR_CACHE_CONTROL,
+    SERF__HDR_CONNECTION,
+    SERF__HDR_CONTENT_ENCODING,
+    SERF__HDR_CONTENT_LENGTH,
+    SERF__HDR_CONTENT_LOCATION,
+    SERF__HDR_CONTENT_RANGE,
+    SERF__HDR_CONTENT_TYPE,
+    SERF__HDR_COOKIE,
+    SERF__HDR_DATE,
+    SERF__HDR_ETAG,
+    SERF__HDR_EXPECT,
+    SERF__HDR_EXPIRES,
+    SERF__HDR_HOST,
+    SERF__HDR_IF_MODIFIED_SINCE,
+    SERF__HDR_IF_NONE_MATCH,
+    SERF__HDR_KEEP_ALIVE,
+    SERF__HDR_LAST_MODIFIED,
+    SERF__HDR_LOCATION,
+    SERF__HDR_PROXY_AUTHENTICATE,
+    SERF__HDR_PROXY_AUTHENTICATION_INFO,
+    SERF__HDR_PROXY_AUTHORIZATION,
+    SERF__HDR_PROXY_CONNECTION,
+    SERF__HDR_RETRY_AFTER,
+    SERF__HDR_SERVER,
+    SERF__HDR_SET_COOKIE,
+    SERF__HDR_TE,
+    SERF__HDR_TRAILER,
+    SERF__HDR_TRANSFER_ENCODING,
+    SERF__HDR_UPGRADE,
+    SERF__HDR_USER_AGENT,
+    SERF__HDR_VARY,
+    SERF__HDR_VIA,
+    SERF__HDR_WWW_AUTHENTICATE,
+    SERF__HDR_COUNT
+} serf__header_token_t;
+
+/**
+ * Return the token of the well-known header name @a header of
+ * @a header_size bytes, compared case-insensitively, or SERF__HDR_UNKNOWN.
+ */
+serf__header_token_t serf__header_token(const char *header,
+                                        apr_size_t header_size);
+
+/**
+ * Like serf_bucket_headers_get(), for the well-known header @a token, which
+ * must not be SERF__HDR_UNKNOWN. The headers are matched without comparing
+ * names.
+ */
+const char *serf__bucket_headers_get_token(serf_bucket_t *headers_bucket,
+                                           serf__header_token_t token);
+
+/**
+ * Allocate @a size bytes that live as long as @a headers_bucket, for names
+ * and values of headers that are set without copying them.
+ */
+void *serf__bucket_headers_alloc(serf_bucket_t *headers_bucket,
+                                 apr_size_t size);
+
+/**
+ * Return how many bytes to ask serf__bucket_headers_alloc() for, so that
+ * the allocation, with the overhead of the headers bucket and of the
+ * allocator, takes @a size bytes.
+ */
+apr_size_t serf__bucket_headers_alloc_usable(apr_size_t size);
+
+/**
+ * Remove all headers from @a headers_bucket, and free the memory they use.
+ */
+void serf__bucket_headers_clear(serf_bucket_t *headers_bucket);
+
 /**
  * Remove the header from the list, do nothing if the header wasn't added.
  */
 void serf__bucket_headers_remove(serf_bucket_t *headers_bucket,
                                  const char *header);
 
+/**
+ * Return the bucket that holds back the body of the request @a bucket
+ * until the server sends 100 Continue, see
+ * serf_bucket_request_set_expect_continue(). Returns NULL if @a bucket is
+ * not a request bucket, or doesn't hold back its body.
+ */
+serf_bucket_t *serf__bucket_request_get_continue_gate(serf_bucket_t *bucket);
+
+/**
+ * Return non-zero if the body behind @a gate may be sent.
+ */
+int serf__continue_gate_is_open(serf_bucket_t *gate);
+
+/**
+ * Let the body behind @a gate be sent.
+ */
+void serf__continue_gate_open(serf_bucket_t *gate);
+
+/**
+ * Return non-zero if the response @a bucket skipped an interim (1xx)
+ * response, such as 100 Continue, while reading the final one.
+ */
+int serf__bucket_response_got_interim(serf_bucket_t *bucket);
+
+/**
+ * Make serf_bucket_allocator_get_pool() return @a pool for @a allocator,
+ * which must not outlive it. The allocator itself stays in the pool it was
+ * created in.
+ */
+void serf__bucket_allocator_set_pool(serf_bucket_alloc_t *allocator,
+                                     apr_pool_t *pool);
+
+/**
+ * Return how many bytes to ask serf_bucket_mem_alloc() for, so that the
+ * allocation, with the allocator's own overhead, takes @a size bytes.
+ */
+apr_size_t serf__bucket_mem_usable_size(apr_size_t size);
+
+/**
+ * Return the bucket wrapped by the barrier @a bucket.
+ */
+serf_bucket_t *serf__bucket_barrier_get_stream(serf_bucket_t *bucket);
+
+/**
+ * Write up to @a requested bytes from the socket @a bucket to @a file, and
+ * set @a len to the amount written. Where the platform allows it, the data
+ * is moved inside the kernel without being read into serf's buffers.
+ * Returns like a read of the bucket.
+ */
+apr_status_t serf__bucket_socket_to_file(serf_bucket_t *bucket,
+                                         apr_file_t *file,
+                                         apr_size_t requested,
+                                         apr_size_t *len);
+
+/**
+ * Write the remaining body of the response_body @a bucket to @a file, and
+ * set @a written to the amount written. Returns APR_EOF once the whole
+ * body is written.
+ */
+apr_status_t serf__bucket_response_body_to_file(serf_bucket_t *bucket,
+                                                apr_file_t *file,
+                                                apr_uint64_t *written);
+
 /*** Authentication handler declarations ***/
 
 typedef enum { PROXY, HOST } peer_t;
@@ -431,6 +629,9 @@ apr_status_t serf__open_connections(serf_context_t *ctx);
 apr_status_t serf__process_connection(serf_connection_t *conn,
                                        apr_int16_t events);
 apr_status_t serf__conn_update_pollset(serf_connection_t *conn);
+apr_short_interval_time_t serf__continue_poll_duration(
+    serf_context_t *ctx,
+    apr_short_interval_time_t duration);
 serf_request_t *serf__ssltunnel_request_create(serf_connection_t *conn,
                                                serf_request_setup_t setup,
                                                void *setup_baton);
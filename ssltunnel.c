@@ -118,7 +118,7 @@ static apr_status_t handle_response(serf_request_t *request,
            response. */
 
         hdrs = serf_bucket_response_get_headers(response);
-        val = serf_bucket_headers_get(hdrs, "Connection");
+        val = serf__bucket_headers_get_token(hdrs, SERF__HDR_CONNECTION);
         if (val && strcasecmp("close", val) == 0) {
             serf__log_skt(CONN_VERBOSE, __FILE__, conn->skt,
                       "Ignore Connection: close header on this reponse, don't "
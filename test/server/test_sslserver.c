@@ -229,6 +229,11 @@ init_ssl_context(serv_ctx_t *serv_ctx,
 
         SSL_CTX_set_mode(ssl_ctx->ctx, SSL_MODE_ENABLE_PARTIAL_WRITE);
 
+        /* Allow clients to resume their sessions, see
+           test_ssl_session_cache. */
+        SSL_CTX_set_session_id_context(ssl_ctx->ctx,
+                                       (const unsigned char *)"serftest", 8);
+
         ssl_ctx->bio = BIO_new(&bio_apr_socket_method);
         ssl_ctx->bio->ptr = serv_ctx;
         init_ssl(serv_ctx);
@@ -319,6 +319,217 @@ static void test_response_bucket_chunked_read(CuTest *tc)
     CuAssertStrEquals(tc, "value", serf_bucket_headers_get(hdrs, "Footer"));
 }
 
+/* Headers are parsed into blocks owned by the headers bucket; check that
+   headers spread over several blocks, and lines that arrive in pieces,
+   come out intact. */
+static void test_response_bucket_header_blocks(CuTest *tc)
+{
+    serf_bucket_t *bkt, *tmp, *hdrs;
+    const char *big, *expected;
+    int i;
+
+    apr_pool_t *test_pool = tc->testBaton;
+    serf_bucket_alloc_t *alloc = serf_bucket_allocator_create(test_pool, NULL,
+                                                              NULL);
+
+    big = apr_psprintf(test_pool, "%03000d", 7);
+    expected = "";
+    for (i = 0; i < 100; i++)
+        expected = apr_psprintf(test_pool, "%sX-Header-%d: value %d" CRLF,
+                                expected, i, i);
+    expected = apr_pstrcat(test_pool,
+                           "Content-Length: 3" CRLF,
+                           expected,
+                           "X-Big: ", big, CRLF, NULL);
+    {
+        mockbkt_action actions[] = {
+            { 1, "HTTP/1.1 200 OK" CRLF "Content-Le", APR_EAGAIN },
+            { 1, "ngth: 3" CRLF, APR_SUCCESS },
+            { 1, NULL, APR_SUCCESS },
+            { 1, CRLF "abc", APR_EOF },
+        };
+        actions[2].data = strchr(expected, '\n') + 1;
+
+        tmp = serf_bucket_mock_create(actions, 4, alloc);
+        bkt = serf_bucket_response_create(tmp, alloc);
+
+        read_and_check_bucket(tc, bkt, "abc");
+    }
+
+    hdrs = serf_bucket_response_get_headers(bkt);
+    CuAssertStrEquals(tc, "3", serf_bucket_headers_get(hdrs, "Content-Length"));
+    CuAssertStrEquals(tc, "value 42",
+                      serf_bucket_headers_get(hdrs, "X-Header-42"));
+    CuAssertStrEquals(tc, big, serf_bucket_headers_get(hdrs, "X-Big"));
+
+    read_and_check_bucket(tc, hdrs, apr_pstrcat(test_pool, expected, CRLF,
+                                                NULL));
+
+    serf_bucket_destroy(bkt);
+}
+
+/* Check that a block of the usable size for 2048 bytes fits the 2048 size
+   class of the allocator, and not a byte more. */
+static void test_bucket_headers_alloc_usable(CuTest *tc)
+{
+    serf_bucket_t *hdrs;
+    serf_bucket_alloc_stats_t before, after;
+    apr_size_t usable;
+
+    apr_pool_t *test_pool = tc->testBaton;
+    serf_bucket_alloc_t *alloc = serf_bucket_allocator_create(test_pool, NULL,
+                                                              NULL);
+
+    hdrs = serf_bucket_headers_create(alloc);
+    usable = serf__bucket_headers_alloc_usable(2048);
+
+    serf_bucket_allocator_stats(&before, alloc);
+    memset(serf__bucket_headers_alloc(hdrs, usable), 'x', usable);
+    serf_bucket_allocator_stats(&after, alloc);
+    CuAssertIntEquals(tc, 2048, after.bytes_in_use - before.bytes_in_use);
+
+    before = after;
+    serf__bucket_headers_alloc(hdrs, usable + 1);
+    serf_bucket_allocator_stats(&after, alloc);
+    CuAssertIntEquals(tc, 4096, after.bytes_in_use - before.bytes_in_use);
+
+    serf_bucket_destroy(hdrs);
+}
+
+/* Responses whose head is buffered completely are parsed in one go;
+   check that this agrees with the line-by-line parser. */
+static void test_response_bucket_buffered_head(CuTest *tc)
+{
+    serf_bucket_t *bkt, *tmp, *hdrs;
+    serf_status_line sl;
+    const char *data;
+    apr_size_t len;
+    apr_status_t status;
+
+    apr_pool_t *test_pool = tc->testBaton;
+    serf_bucket_alloc_t *alloc = serf_bucket_allocator_create(test_pool, NULL,
+                                                              NULL);
+
+    tmp = SERF_BUCKET_SIMPLE_STRING(
+        "HTTP/1.1 200 OK" CRLF
+        "Content-Length: 3" CRLF
+        "X-Empty:" CRLF
+        "X-Spaces:   a b " CRLF
+        CRLF
+        "abc",
+        alloc);
+    bkt = serf_bucket_response_create(tmp, alloc);
+
+    status = serf_bucket_response_status(bkt, &sl);
+    CuAssertIntEquals(tc, APR_SUCCESS, status);
+    CuAssertIntEquals(tc, 200, sl.code);
+    CuAssertStrEquals(tc, "OK", sl.reason);
+
+    read_and_check_bucket(tc, bkt, "abc");
+    hdrs = serf_bucket_response_get_headers(bkt);
+    CuAssertStrEquals(tc, "3", serf_bucket_headers_get(hdrs, "Content-Length"));
+    CuAssertStrEquals(tc, "", serf_bucket_headers_get(hdrs, "X-Empty"));
+    CuAssertStrEquals(tc, "a b ", serf_bucket_headers_get(hdrs, "X-Spaces"));
+    serf_bucket_destroy(bkt);
+
+    /* No headers and no reason. */
+    tmp = SERF_BUCKET_SIMPLE_STRING("HTTP/1.1 204" CRLF CRLF, alloc);
+    bkt = serf_bucket_response_create(tmp, alloc);
+    status = serf_bucket_response_status(bkt, &sl);
+    CuAssertIntEquals(tc, APR_SUCCESS, status);
+    CuAssertIntEquals(tc, 204, sl.code);
+    CuAssertStrEquals(tc, "", sl.reason);
+    read_and_check_bucket(tc, bkt, "");
+    serf_bucket_destroy(bkt);
+
+    /* Bare LF line endings go through the line buffer. */
+    tmp = SERF_BUCKET_SIMPLE_STRING(
+        "HTTP/1.1 200 OK" CRLF
+        "Content-Length: 3" LF
+        "X-Foo: bar" CRLF
+        CRLF
+        "abc",
+        alloc);
+    bkt = serf_bucket_response_create(tmp, alloc);
+    read_and_check_bucket(tc, bkt, "abc");
+    hdrs = serf_bucket_response_get_headers(bkt);
+    CuAssertStrEquals(tc, "bar", serf_bucket_headers_get(hdrs, "X-Foo"));
+    serf_bucket_destroy(bkt);
+
+    /* A header line without ':' is an error either way. */
+    tmp = SERF_BUCKET_SIMPLE_STRING(
+        "HTTP/1.1 200 OK" CRLF
+        "Content-Length 3" CRLF
+        CRLF
+        "abc",
+        alloc);
+    bkt = serf_bucket_response_create(tmp, alloc);
+    status = serf_bucket_read(bkt, SERF_READ_ALL_AVAIL, &data, &len);
+    CuAssertIntEquals(tc, SERF_ERROR_BAD_HTTP_RESPONSE, status);
+    serf_bucket_destroy(bkt);
+}
+
+/* Interim responses, like 100 Continue, are skipped; the status, headers
+   and body are those of the final response. */
+static void test_response_bucket_interim(CuTest *tc)
+{
+    serf_bucket_t *bkt, *tmp, *hdrs;
+    serf_status_line sl;
+    apr_status_t status;
+    apr_pool_t *test_pool = tc->testBaton;
+    serf_bucket_alloc_t *alloc = serf_bucket_allocator_create(test_pool, NULL,
+                                                              NULL);
+
+    tmp = SERF_BUCKET_SIMPLE_STRING(
+        "HTTP/1.1 100 Continue" CRLF
+        "X-Interim: yes" CRLF
+        CRLF
+        "HTTP/1.1 102 Processing" CRLF
+        CRLF
+        "HTTP/1.1 201 Created" CRLF
+        "Content-Length: 3" CRLF
+        CRLF
+        "abc",
+        alloc);
+    bkt = serf_bucket_response_create(tmp, alloc);
+
+    status = serf_bucket_response_status(bkt, &sl);
+    CuAssertIntEquals(tc, APR_SUCCESS, status);
+    CuAssertIntEquals(tc, 201, sl.code);
+    CuAssertStrEquals(tc, "Created", sl.reason);
+    CuAssertTrue(tc, serf__bucket_response_got_interim(bkt));
+
+    read_and_check_bucket(tc, bkt, "abc");
+    hdrs = serf_bucket_response_get_headers(bkt);
+    CuAssertStrEquals(tc, "3", serf_bucket_headers_get(hdrs, "Content-Length"));
+    CuAssertPtrEquals(tc, NULL,
+                      (void *)serf_bucket_headers_get(hdrs, "X-Interim"));
+    serf_bucket_destroy(bkt);
+
+    /* The same, with the interim response arriving in pieces. */
+    {
+        mockbkt_action actions[] = {
+            { 1, "HTTP/1.1 100 Cont", APR_EAGAIN },
+            { 1, "inue" CRLF CRLF, APR_EAGAIN },
+            { 1, "HTTP/1.1 200 OK" CRLF "Content-Length: 3" CRLF CRLF "abc",
+              APR_EOF },
+        };
+        tmp = serf_bucket_mock_create(actions, 3, alloc);
+        bkt = serf_bucket_response_create(tmp, alloc);
+
+        status = serf_bucket_response_status(bkt, &sl);
+        CuAssertIntEquals(tc, APR_EAGAIN, status);
+        CuAssertIntEquals(tc, 0, sl.version);
+        status = serf_bucket_response_status(bkt, &sl);
+        CuAssertIntEquals(tc, APR_EAGAIN, status);
+        CuAssertIntEquals(tc, 0, sl.version);
+        CuAssertTrue(tc, serf__bucket_response_got_interim(bkt));
+
+        read_and_check_bucket(tc, bkt, "abc");
+        serf_bucket_destroy(bkt);
+    }
+}
+
 static void test_bucket_header_set(CuTest *tc)
 {
     apr_pool_t *test_pool = tc->testBaton;
@@ -541,6 +752,7 @@ static void test_aggregate_buckets(CuTest *tc)
     int vecs_used;
     apr_size_t len;
     const char *data;
+    int i;
 
     apr_pool_t *test_pool = tc->testBaton;
     serf_bucket_alloc_t *alloc = serf_bucket_allocator_create(test_pool, NULL,
@@ -612,6 +824,38 @@ static void test_aggregate_buckets(CuTest *tc)
              len > 0 && len <= strlen(BODY) );
     CuAssert(tc, "Data should match first part of body.",
              strncmp(BODY, data, len) == 0);
+
+    /* Test 7: prepend, append and consume buckets while read buckets are
+       pending destruction, until the list of buckets has to grow. */
+    aggbkt = serf_bucket_aggregate_create(alloc);
+
+    for (i = 0; i < 6; i++) {
+        bkt = SERF_BUCKET_SIMPLE_STRING_LEN("abcdef" + i, 1, alloc);
+        serf_bucket_aggregate_append(aggbkt, bkt);
+    }
+    for (i = 0; i < 3; i++) {
+        status = serf_bucket_read(aggbkt, 1, &data, &len);
+        CuAssertIntEquals(tc, APR_SUCCESS, status);
+        CuAssertStrnEquals(tc, "abc" + i, 1, data);
+    }
+
+    bkt = SERF_BUCKET_SIMPLE_STRING("Y", alloc);
+    serf_bucket_aggregate_prepend(aggbkt, bkt);
+    bkt = SERF_BUCKET_SIMPLE_STRING("X", alloc);
+    serf_bucket_aggregate_prepend(aggbkt, bkt);
+
+    bkt = serf_bucket_read_bucket(aggbkt, &serf_bucket_type_simple);
+    CuAssertPtrNotNull(tc, bkt);
+    read_and_check_bucket(tc, bkt, "X");
+    serf_bucket_destroy(bkt);
+
+    for (i = 0; i < 10; i++) {
+        bkt = SERF_BUCKET_SIMPLE_STRING_LEN("ghijklmnop" + i, 1, alloc);
+        serf_bucket_aggregate_append(aggbkt, bkt);
+    }
+
+    read_and_check_bucket(tc, aggbkt, "Ydefghijklmnop");
+    serf_bucket_destroy(aggbkt);
 }
 
 static void test_aggregate_bucket_readline(CuTest *tc)
@@ -650,6 +894,74 @@ static void test_aggregate_bucket_readline(CuTest *tc)
     readlines_and_check_bucket(tc, aggbkt, SERF_NEWLINE_CRLF, BODY, 3);
 }
 
+static apr_status_t stream_eof(void *baton, serf_bucket_t *aggbkt)
+{
+    *(int *)baton = 1;
+    return APR_EAGAIN;
+}
+
+/* Validate that a single read_iovec of a stream holding several requests,
+   like the outgoing stream of a connection, returns all of their data. */
+static void test_aggregate_bucket_gather(CuTest *tc)
+{
+    apr_pool_t *test_pool = tc->testBaton;
+    serf_bucket_alloc_t *alloc = serf_bucket_allocator_create(test_pool, NULL,
+                                                              NULL);
+    serf_bucket_t *stream, *bkt;
+    serf_bucket_t *requests[3];
+    struct iovec vecs[64];
+    const char *expected = "";
+    char *buf;
+    apr_size_t len;
+    int vecs_used;
+    int hit_eof = 0;
+    apr_status_t status;
+    int i;
+
+    bkt = SERF_BUCKET_SIMPLE_STRING("abc", alloc);
+    CuAssertTrue(tc, serf_bucket_data_is_stable(bkt));
+    stream = serf_bucket_barrier_create(bkt, alloc);
+    CuAssertTrue(tc, serf_bucket_data_is_stable(stream));
+    serf_bucket_destroy(stream);
+    serf_bucket_destroy(bkt);
+
+    stream = serf__bucket_stream_create(alloc, stream_eof, &hit_eof);
+    CuAssertTrue(tc, !serf_bucket_data_is_stable(stream));
+
+    for (i = 0; i < 3; i++) {
+        const char *uri = apr_psprintf(test_pool, "/%d", i);
+
+        requests[i] = serf_bucket_request_create("GET", uri, NULL, alloc);
+        serf_bucket_headers_setn(serf_bucket_request_get_headers(requests[i]),
+                                 "Host", "localhost");
+        serf_bucket_aggregate_append(stream, requests[i]);
+
+        expected = apr_pstrcat(test_pool, expected,
+                               "GET ", uri, " HTTP/1.1" CRLF
+                               "Host: localhost" CRLF
+                               CRLF, NULL);
+    }
+
+    status = serf_bucket_read_iovec(stream, SERF_READ_ALL_AVAIL, 64, vecs,
+                                    &vecs_used);
+    CuAssertIntEquals(tc, APR_EAGAIN, status);
+    CuAssertIntEquals(tc, 1, hit_eof);
+
+    buf = apr_palloc(test_pool, strlen(expected) + 1);
+    len = 0;
+    for (i = 0; i < vecs_used; i++) {
+        memcpy(buf + len, vecs[i].iov_base, vecs[i].iov_len);
+        len += vecs[i].iov_len;
+    }
+    buf[len] = '\0';
+    CuAssertStrEquals(tc, expected, buf);
+
+    /* The stream doesn't own the requests. */
+    serf_bucket_destroy(stream);
+    for (i = 0; i < 3; i++)
+        serf_bucket_destroy(requests[i]);
+}
+
 /* Test for issue: the server aborts the connection in the middle of
    streaming the body of the response, where the length was set with the
    Content-Length header. Test that we get a decent error code from the
@@ -1156,6 +1468,130 @@ static void test_dechunk_buckets(CuTest *tc)
     CuAssert(tc, "Read less data than expected.", strlen(expected) == 0);
 }
 
+/* Validate read_iovec, readline and peek of the dechunk bucket; none of
+   them may return data beyond the current chunk. */
+static void test_dechunk_buckets_iovec(CuTest *tc)
+{
+    serf_bucket_t *bkt;
+    apr_pool_t *test_pool = tc->testBaton;
+    serf_bucket_alloc_t *alloc = serf_bucket_allocator_create(test_pool, NULL,
+                                                              NULL);
+    struct iovec vecs[16];
+    const char *data;
+    apr_size_t len;
+    int vecs_used;
+    int found;
+    apr_status_t status;
+
+    bkt = SERF_BUCKET_SIMPLE_STRING("A" CRLF "0123456789" CRLF
+                                    "5" CRLF "ab" CRLF "c" CRLF
+                                    "2" CRLF "de" CRLF
+                                    "0" CRLF CRLF, alloc);
+    bkt = serf_bucket_dechunk_create(bkt, alloc);
+
+    /* Nothing to peek at before the chunk size is read. */
+    status = serf_bucket_peek(bkt, &data, &len);
+    CuAssertIntEquals(tc, APR_SUCCESS, status);
+    CuAssertIntEquals(tc, 0, (int)len);
+
+    /* The whole chunk in one vec. */
+    status = serf_bucket_read_iovec(bkt, SERF_READ_ALL_AVAIL, 16, vecs,
+                                    &vecs_used);
+    CuAssertIntEquals(tc, APR_SUCCESS, status);
+    CuAssertIntEquals(tc, 1, vecs_used);
+    CuAssertStrnEquals(tc, "0123456789", vecs[0].iov_len, vecs[0].iov_base);
+
+    status = serf_bucket_readline(bkt, SERF_NEWLINE_CRLF, &found, &data,
+                                  &len);
+    CuAssertIntEquals(tc, APR_SUCCESS, status);
+    CuAssertIntEquals(tc, SERF_NEWLINE_CRLF, found);
+    CuAssertStrnEquals(tc, "ab" CRLF, len, data);
+
+    status = serf_bucket_peek(bkt, &data, &len);
+    CuAssertIntEquals(tc, APR_SUCCESS, status);
+    CuAssertStrnEquals(tc, "c", len, data);
+
+    /* The line continues in the next chunk. */
+    status = serf_bucket_readline(bkt, SERF_NEWLINE_CRLF, &found, &data,
+                                  &len);
+    CuAssertIntEquals(tc, APR_SUCCESS, status);
+    CuAssertIntEquals(tc, SERF_NEWLINE_NONE, found);
+    CuAssertStrnEquals(tc, "c", len, data);
+
+    read_and_check_bucket(tc, bkt, "de");
+
+    status = serf_bucket_peek(bkt, &data, &len);
+    CuAssertIntEquals(tc, APR_EOF, status);
+    CuAssertIntEquals(tc, 0, (int)len);
+
+    serf_bucket_destroy(bkt);
+}
+
+/* Validate the chunk encoding of a stream, with chunks as large as what the
+   stream returns or limited to a maximum size, and that it reads back. */
+static void test_chunk_buckets(CuTest *tc)
+{
+    serf_bucket_t *mock_bkt, *bkt;
+    apr_pool_t *test_pool = tc->testBaton;
+    serf_bucket_alloc_t *alloc = serf_bucket_allocator_create(test_pool, NULL,
+                                                              NULL);
+    mockbkt_action actions[]= {
+        { 1, "abc", APR_SUCCESS },
+        { 1, "", APR_EAGAIN },
+        { 1, "0123456789abcdefg", APR_EOF },
+    };
+    struct iovec vecs[16];
+    const char *expected, *data;
+    apr_size_t len;
+    int vecs_used;
+    apr_status_t status;
+
+    /* Test 1: chunks as returned by the stream, across EAGAIN. */
+    mock_bkt = serf_bucket_mock_create(actions, 3, alloc);
+    bkt = serf_bucket_chunk_create(mock_bkt, alloc);
+
+    status = serf_bucket_read_iovec(bkt, SERF_READ_ALL_AVAIL, 16, vecs,
+                                    &vecs_used);
+    CuAssertIntEquals(tc, APR_SUCCESS, status);
+    CuAssertIntEquals(tc, 3, vecs_used);
+    CuAssertStrnEquals(tc, "3" CRLF, vecs[0].iov_len, vecs[0].iov_base);
+    CuAssertStrnEquals(tc, "abc", vecs[1].iov_len, vecs[1].iov_base);
+    CuAssertStrnEquals(tc, CRLF, vecs[2].iov_len, vecs[2].iov_base);
+
+    status = serf_bucket_read_iovec(bkt, SERF_READ_ALL_AVAIL, 16, vecs,
+                                    &vecs_used);
+    CuAssertIntEquals(tc, APR_EAGAIN, status);
+    CuAssertIntEquals(tc, 0, vecs_used);
+
+    /* Read the last chunk in parts. */
+    status = serf_bucket_read(bkt, 2, &data, &len);
+    CuAssertIntEquals(tc, APR_SUCCESS, status);
+    CuAssertStrnEquals(tc, "11", len, data);
+    read_and_check_bucket(tc, bkt, CRLF "0123456789abcdefg" CRLF "0" CRLF CRLF);
+    serf_bucket_destroy(bkt);
+
+    /* Test 2: limit the chunk size, and decode again. */
+    expected = "0123456789";
+    bkt = SERF_BUCKET_SIMPLE_STRING(expected, alloc);
+    bkt = serf_bucket_chunk_create(bkt, alloc);
+    serf_bucket_chunk_set_max_size(bkt, 4);
+
+    readlines_and_check_bucket(tc, bkt, SERF_NEWLINE_CRLF,
+                               "4" CRLF "0123" CRLF
+                               "4" CRLF "4567" CRLF
+                               "2" CRLF "89" CRLF
+                               "0" CRLF CRLF, 8);
+    serf_bucket_destroy(bkt);
+
+    bkt = SERF_BUCKET_SIMPLE_STRING(expected, alloc);
+    bkt = serf_bucket_chunk_create(bkt, alloc);
+    serf_bucket_chunk_set_max_size(bkt, 4);
+    bkt = serf_bucket_dechunk_create(bkt, alloc);
+
+    read_and_check_bucket(tc, bkt, expected);
+    serf_bucket_destroy(bkt);
+}
+
 /* Test that the Content-Length header will be ignored when the response
    should not have returned a body. See RFC2616, section 4.4, nbr. 1. */
 static void test_response_no_body_expected(CuTest *tc)
@@ -1172,11 +1608,6 @@ static void test_response_no_body_expected(CuTest *tc)
        next response, in all these cases it should APR_EOF after the empty
        line. */
     test_server_message_t message_list[] = {
-        { "HTTP/1.1 100 Continue" CRLF
-          "Content-Type: text/plain" CRLF
-          "Content-Length: 6500000" CRLF
-          CRLF
-          "blablablablabla" CRLF },
         { "HTTP/1.1 204 No Content" CRLF
             "Content-Type: text/plain" CRLF
             "Content-Length: 6500000" CRLF
@@ -1414,6 +1845,403 @@ static apr_status_t hold_open(void *baton, serf_bucket_t *aggbkt)
     return tb->user_baton_l;
 }
 
+
+/* Reads all data of BKT into BUF, of BUF_SIZE bytes. Stops at EOF, or
+   at EAGAIN when STOP_AT_EAGAIN is set. */
+static apr_size_t read_all_of_bucket(CuTest *tc, serf_bucket_t *bkt,
+                                     char *buf, apr_size_t buf_size,
+                                     int stop_at_eagain)
+{
+    apr_status_t status;
+    apr_size_t total = 0;
+
+    do
+    {
+        const char *data;
+        apr_size_t len;
+
+        status = serf_bucket_read(bkt, SERF_READ_ALL_AVAIL, &data, &len);
+        CuAssert(tc, "Got error during bucket reading.",
+                 !SERF_BUCKET_READ_ERROR(status));
+        CuAssert(tc, "Buffer too small.", total + len <= buf_size);
+
+        memcpy(buf + total, data, len);
+        total += len;
+    } while (!APR_STATUS_IS_EOF(status)
+             && !(stop_at_eagain && APR_STATUS_IS_EAGAIN(status)));
+
+    return total;
+}
+
+static void test_deflate_encode_buckets(CuTest *tc)
+{
+    const char *msg = "This is a line of a request body, to be compressed.\r\n";
+    const apr_size_t msg_len = strlen(msg);
+    const int nr_of_loops = 4000;
+
+    test_baton_t *tb = tc->testBaton;
+    serf_bucket_alloc_t *alloc = serf_bucket_allocator_create(tb->pool, NULL,
+                                                              NULL);
+    apr_size_t body_len = nr_of_loops * msg_len;
+    apr_size_t buf_size = body_len;
+    char *body = apr_palloc(tb->pool, body_len);
+    char *buf = apr_palloc(tb->pool, buf_size);
+    serf_bucket_t *aggbkt, *srcbkt, *bkt;
+    apr_size_t len;
+    int i;
+
+    for (i = 0; i < nr_of_loops; i++)
+        memcpy(body + i * msg_len, msg, msg_len);
+
+    /* 1. gzip at the default level, decoded by the deflate bucket. */
+    srcbkt = serf_bucket_simple_create(body, body_len, NULL, NULL, alloc);
+    bkt = serf_bucket_deflate_encode_create(srcbkt, alloc, SERF_DEFLATE_GZIP,
+                                            SERF_DEFLATE_DEFAULT_LEVEL, 0);
+    CuAssertTrue(tc, SERF_BUCKET_IS_DEFLATE_ENCODE(bkt));
+    len = read_all_of_bucket(tc, bkt, buf, buf_size, 0);
+    serf_bucket_destroy(bkt);
+
+    CuAssertIntEquals(tc, 0x1f, (unsigned char)buf[0]);
+    CuAssertIntEquals(tc, 0x8b, (unsigned char)buf[1]);
+    CuAssertTrue(tc, len < body_len / 50);
+
+    srcbkt = serf_bucket_simple_create(buf, len, NULL, NULL, alloc);
+    bkt = serf_bucket_deflate_create(srcbkt, alloc, SERF_DEFLATE_GZIP);
+    read_bucket_and_check_pattern(tc, bkt, msg, body_len);
+    serf_bucket_destroy(bkt);
+
+    /* 2. Raw deflate with a small window, from a stream that isn't complete
+          yet: the encoder should return EAGAIN until it is. */
+    tb->user_baton_l = APR_EAGAIN;
+    aggbkt = serf_bucket_aggregate_create(alloc);
+    serf_bucket_aggregate_hold_open(aggbkt, hold_open, tb);
+    srcbkt = serf_bucket_simple_create(body, body_len / 2, NULL, NULL, alloc);
+    serf_bucket_aggregate_append(aggbkt, srcbkt);
+
+    bkt = serf_bucket_deflate_encode_create(aggbkt, alloc,
+                                            SERF_DEFLATE_DEFLATE, 1, 9);
+    len = read_all_of_bucket(tc, bkt, buf, buf_size, 1);
+
+    srcbkt = serf_bucket_simple_create(body + body_len / 2,
+                                       body_len - body_len / 2,
+                                       NULL, NULL, alloc);
+    serf_bucket_aggregate_append(aggbkt, srcbkt);
+    tb->user_baton_l = APR_EOF;
+    len += read_all_of_bucket(tc, bkt, buf + len, buf_size - len, 0);
+    serf_bucket_destroy(bkt);
+
+    srcbkt = serf_bucket_simple_create(buf, len, NULL, NULL, alloc);
+    bkt = serf_bucket_deflate_create(srcbkt, alloc, SERF_DEFLATE_DEFLATE);
+    read_bucket_and_check_pattern(tc, bkt, msg, body_len);
+    serf_bucket_destroy(bkt);
+
+    /* 3. Sent with chunked transfer encoding, as a request body would be. */
+    srcbkt = serf_bucket_simple_create(body, body_len, NULL, NULL, alloc);
+    bkt = serf_bucket_deflate_encode_create(srcbkt, alloc, SERF_DEFLATE_GZIP,
+                                            9, 0);
+    bkt = serf_bucket_chunk_create(bkt, alloc);
+    len = read_all_of_bucket(tc, bkt, buf, buf_size, 0);
+    serf_bucket_destroy(bkt);
+
+    srcbkt = serf_bucket_simple_create(buf, len, NULL, NULL, alloc);
+    bkt = serf_bucket_dechunk_create(srcbkt, alloc);
+    bkt = serf_bucket_deflate_create(bkt, alloc, SERF_DEFLATE_GZIP);
+    read_bucket_and_check_pattern(tc, bkt, msg, body_len);
+    serf_bucket_destroy(bkt);
+}
+
+#if defined(SERF_HAVE_BROTLI) || defined(SERF_HAVE_ZSTD)
+/* 2000 times the 50 bytes "1234567890...", compressed with brotli at
+   quality 11 and with zstd at level 19. */
+#define DECOMPRESS_PATTERN \
+    "12345678901234567890123456789012345678901234567890"
+#define DECOMPRESS_PATTERN_LEN (2000 * 50)
+
+static const unsigned char brotli_data[] = {
+    0x5b, 0x9f, 0x86, 0x81, 0x5f, 0xdc, 0x60, 0x6c, 0x5e, 0xd2, 0x88, 0x03,
+    0x43, 0x01, 0xa0, 0xfc, 0x02, 0x28, 0xa7, 0xb3, 0xf7, 0x00,
+};
+/* "hello, brotli", which decodes in one go. */
+static const unsigned char brotli_small_data[] = {
+    0x0b, 0x06, 0x80, 0x68, 0x65, 0x6c, 0x6c, 0x6f, 0x2c, 0x20, 0x62, 0x72,
+    0x6f, 0x74, 0x6c, 0x69, 0x03,
+};
+static const unsigned char zstd_data[] = {
+    0x28, 0xb5, 0x2f, 0xfd, 0xa0, 0xa0, 0x86, 0x01, 0x00, 0x95, 0x00, 0x00,
+    0x50, 0x31, 0x32, 0x33, 0x34, 0x35, 0x36, 0x37, 0x38, 0x39, 0x30, 0x01,
+    0x00, 0x93, 0x86, 0xcd, 0x0b, 0x12,
+};
+
+typedef serf_bucket_t *(*decompress_create_t)(serf_bucket_t *stream,
+                                              serf_bucket_alloc_t *alloc);
+
+/* Decode the LEN bytes of DATA with the bucket made by CREATE, handing the
+   data over a few bytes at a time with EAGAIN in between. Returns the
+   first error, or APR_EOF. */
+static apr_status_t decompress_in_pieces(CuTest *tc,
+                                         decompress_create_t create,
+                                         const unsigned char *data,
+                                         apr_size_t len,
+                                         char *buf, apr_size_t *buf_len)
+{
+    test_baton_t *tb = tc->testBaton;
+    serf_bucket_alloc_t *alloc = serf_bucket_allocator_create(tb->pool, NULL,
+                                                              NULL);
+    serf_bucket_t *aggbkt, *bkt;
+    apr_size_t pos = 0, total = 0;
+    apr_status_t status;
+
+    tb->user_baton_l = APR_EAGAIN;
+    aggbkt = serf_bucket_aggregate_create(alloc);
+    serf_bucket_aggregate_hold_open(aggbkt, hold_open, tb);
+    bkt = create(aggbkt, alloc);
+
+    do
+    {
+        const char *out;
+        apr_size_t out_len;
+
+        status = serf_bucket_read(bkt, SERF_READ_ALL_AVAIL, &out, &out_len);
+        if (SERF_BUCKET_READ_ERROR(status))
+            break;
+
+        CuAssert(tc, "Read more data than expected.",
+                 total + out_len <= *buf_len);
+        memcpy(buf + total, out, out_len);
+        total += out_len;
+
+        if (APR_STATUS_IS_EAGAIN(status)) {
+            apr_size_t piece = len - pos < 3 ? len - pos : 3;
+            serf_bucket_t *strbkt;
+
+            if (!piece)
+                tb->user_baton_l = APR_EOF;
+            strbkt = serf_bucket_simple_create((const char *)data + pos,
+                                               piece, NULL, NULL, alloc);
+            serf_bucket_aggregate_append(aggbkt, strbkt);
+            pos += piece;
+        }
+    } while (!APR_STATUS_IS_EOF(status));
+
+    serf_bucket_destroy(bkt);
+    *buf_len = total;
+
+    return status;
+}
+
+static void decompress_buckets(CuTest *tc, decompress_create_t create,
+                               const unsigned char *data, apr_size_t len)
+{
+    test_baton_t *tb = tc->testBaton;
+    apr_size_t buf_len = DECOMPRESS_PATTERN_LEN;
+    char *buf = apr_palloc(tb->pool, buf_len);
+    apr_size_t i;
+
+    CuAssertIntEquals(tc, APR_EOF,
+                      decompress_in_pieces(tc, create, data, len,
+                                           buf, &buf_len));
+    CuAssertIntEquals(tc, DECOMPRESS_PATTERN_LEN, buf_len);
+    for (i = 0; i < buf_len; i += 50)
+        CuAssert(tc, "Read data is not equal to expected.",
+                 memcmp(buf + i, DECOMPRESS_PATTERN, 50) == 0);
+
+    /* Truncated content is an error. */
+    buf_len = DECOMPRESS_PATTERN_LEN;
+    CuAssertIntEquals(tc, SERF_ERROR_DECOMPRESSION_FAILED,
+                      decompress_in_pieces(tc, create, data, len - 2,
+                                           buf, &buf_len));
+}
+
+/* Read a response with the body of LEN bytes DATA in CODING through the
+   response bucket, which should decode it to EXPECTED_LEN bytes of
+   PATTERN. If CHUNKED, the body is sent as one chunk. All of the response
+   should be read, and nothing of the next one. */
+static void decompress_response(CuTest *tc, const char *coding,
+                                const unsigned char *data, apr_size_t len,
+                                const char *pattern, apr_size_t expected_len,
+                                int chunked)
+{
+    test_baton_t *tb = tc->testBaton;
+    serf_bucket_alloc_t *alloc = serf_bucket_allocator_create(tb->pool, NULL,
+                                                              NULL);
+    serf_bucket_t *aggbkt, *bkt;
+    const char *head, *next = "HTTP/1.1 200 OK" CRLF;
+    const char *data_left;
+    apr_size_t len_left;
+    apr_status_t status;
+
+    if (chunked)
+        head = apr_psprintf(tb->pool,
+                            "HTTP/1.1 200 OK" CRLF
+                            "Content-Encoding: %s" CRLF
+                            "Transfer-Encoding: chunked" CRLF
+                            CRLF
+                            "%" APR_UINT64_T_HEX_FMT CRLF,
+                            coding, (apr_uint64_t)len);
+    else
+        head = apr_psprintf(tb->pool,
+                            "HTTP/1.1 200 OK" CRLF
+                            "Content-Encoding: %s" CRLF
+                            "Content-Length: %" APR_SIZE_T_FMT CRLF
+                            CRLF, coding, len);
+    aggbkt = serf_bucket_aggregate_create(alloc);
+    serf_bucket_aggregate_append(aggbkt,
+        serf_bucket_simple_create(head, strlen(head), NULL, NULL, alloc));
+    serf_bucket_aggregate_append(aggbkt,
+        serf_bucket_simple_create((const char *)data, len, NULL, NULL,
+                                  alloc));
+    if (chunked)
+        serf_bucket_aggregate_append(aggbkt,
+            serf_bucket_simple_create(CRLF "0" CRLF CRLF, 7, NULL, NULL,
+                                      alloc));
+    serf_bucket_aggregate_append(aggbkt,
+        serf_bucket_simple_create(next, strlen(next), NULL, NULL, alloc));
+
+    bkt = serf_bucket_response_create(aggbkt, alloc);
+    read_bucket_and_check_pattern(tc, bkt, pattern, expected_len);
+
+    status = serf_bucket_peek(aggbkt, &data_left, &len_left);
+    CuAssert(tc, "Got error during bucket reading.",
+             !SERF_BUCKET_READ_ERROR(status));
+    CuAssertIntEquals(tc, strlen(next), len_left);
+    CuAssert(tc, "Read data is not equal to expected.",
+             strncmp(data_left, next, len_left) == 0);
+
+    serf_bucket_destroy(bkt);
+}
+#endif
+
+/* Test the brotli and zstd decoding buckets, and the use of them by the
+   response bucket, as far as serf was built with support for them. */
+static void test_decompress_buckets(CuTest *tc)
+{
+    test_baton_t *tb = tc->testBaton;
+    serf_bucket_alloc_t *alloc = serf_bucket_allocator_create(tb->pool, NULL,
+                                                              NULL);
+    serf_bucket_t *req, *hdrs;
+    const char *accept;
+
+    req = serf_bucket_request_create("GET", "/", NULL, alloc);
+    serf_bucket_request_set_accept_encoding(req);
+    hdrs = serf_bucket_request_get_headers(req);
+    accept = serf_bucket_headers_get(hdrs, "Accept-Encoding");
+    CuAssertPtrNotNull(tc, accept);
+    CuAssertPtrNotNull(tc, strstr(accept, "gzip"));
+
+#ifdef SERF_HAVE_BROTLI
+    CuAssertPtrNotNull(tc, strstr(accept, "br"));
+    decompress_buckets(tc, serf_bucket_brotli_create,
+                       brotli_data, sizeof(brotli_data));
+    decompress_response(tc, "br", brotli_data, sizeof(brotli_data),
+                        DECOMPRESS_PATTERN, DECOMPRESS_PATTERN_LEN, 0);
+    decompress_response(tc, "br", brotli_data, sizeof(brotli_data),
+                        DECOMPRESS_PATTERN, DECOMPRESS_PATTERN_LEN, 1);
+    /* The content ends before the chunked body does. */
+    decompress_response(tc, "br", brotli_small_data,
+                        sizeof(brotli_small_data), "hello, brotli", 13, 1);
+#else
+    CuAssertPtrEquals(tc, NULL, serf_bucket_brotli_create(NULL, alloc));
+#endif
+
+#ifdef SERF_HAVE_ZSTD
+    CuAssertPtrNotNull(tc, strstr(accept, "zstd"));
+    decompress_buckets(tc, serf_bucket_zstd_create,
+                       zstd_data, sizeof(zstd_data));
+    decompress_response(tc, "zstd", zstd_data, sizeof(zstd_data),
+                        DECOMPRESS_PATTERN, DECOMPRESS_PATTERN_LEN, 0);
+    decompress_response(tc, "zstd", zstd_data, sizeof(zstd_data),
+                        DECOMPRESS_PATTERN, DECOMPRESS_PATTERN_LEN, 1);
+#else
+    CuAssertPtrEquals(tc, NULL, serf_bucket_zstd_create(NULL, alloc));
+#endif
+
+    serf_bucket_destroy(req);
+}
+
+/* The deflate bucket returns as much as fits its buffer in one read; peek,
+   readline and read_iovec return inflated data that wasn't read yet. */
+static void test_deflate_buckets_buffer_size(CuTest *tc)
+{
+    const char *msg = "This is a line of the inflated body.\r\n";
+    const apr_size_t msg_len = strlen(msg);
+    const int nr_of_loops = 20000;
+
+    test_baton_t *tb = tc->testBaton;
+    serf_bucket_alloc_t *alloc = serf_bucket_allocator_create(tb->pool, NULL,
+                                                              NULL);
+    apr_size_t body_len = nr_of_loops * msg_len;
+    char *body = apr_palloc(tb->pool, body_len);
+    char *buf = apr_palloc(tb->pool, body_len);
+    serf_bucket_t *srcbkt, *bkt;
+    struct iovec vecs[4];
+    int vecs_used;
+    const char *data;
+    apr_size_t len, pos;
+    apr_status_t status;
+    int found;
+    int i;
+
+    for (i = 0; i < nr_of_loops; i++)
+        memcpy(body + i * msg_len, msg, msg_len);
+
+    srcbkt = serf_bucket_simple_create(body, body_len, NULL, NULL, alloc);
+    bkt = serf_bucket_deflate_encode_create(srcbkt, alloc, SERF_DEFLATE_GZIP,
+                                            SERF_DEFLATE_DEFAULT_LEVEL, 0);
+    len = read_all_of_bucket(tc, bkt, buf, body_len, 0);
+    serf_bucket_destroy(bkt);
+
+    srcbkt = serf_bucket_simple_create(buf, len, NULL, NULL, alloc);
+    bkt = serf_bucket_deflate_create(srcbkt, alloc, SERF_DEFLATE_GZIP);
+    /* Clamped to 256 KB. */
+    serf_bucket_deflate_set_buffer_size(bkt, 1024 * 1024);
+
+    status = serf_bucket_read(bkt, SERF_READ_ALL_AVAIL, &data, &len);
+    CuAssertIntEquals(tc, APR_SUCCESS, status);
+    CuAssertIntEquals(tc, 256 * 1024, len);
+    CuAssert(tc, "Read data is not equal to expected.",
+             memcmp(data, body, len) == 0);
+    pos = len;
+
+    /* The rest of the line that didn't fit. */
+    status = serf_bucket_readline(bkt, SERF_NEWLINE_CRLF, &found,
+                                  &data, &len);
+    CuAssertIntEquals(tc, APR_SUCCESS, status);
+    CuAssertIntEquals(tc, SERF_NEWLINE_CRLF, found);
+    CuAssertIntEquals(tc, msg_len - pos % msg_len, len);
+    CuAssert(tc, "Read data is not equal to expected.",
+             memcmp(data, body + pos, len) == 0);
+    pos += len;
+
+    status = serf_bucket_peek(bkt, &data, &len);
+    CuAssertIntEquals(tc, APR_SUCCESS, status);
+    CuAssertIntEquals(tc, 256 * 1024 - (msg_len - 256 * 1024 % msg_len),
+                      len);
+    CuAssert(tc, "Peeked data is not equal to expected.",
+             memcmp(data, body + pos, len) == 0);
+
+    status = serf_bucket_read_iovec(bkt, 100, 4, vecs, &vecs_used);
+    CuAssertIntEquals(tc, APR_SUCCESS, status);
+    CuAssertIntEquals(tc, 1, vecs_used);
+    CuAssertIntEquals(tc, 100, vecs[0].iov_len);
+    CuAssert(tc, "Read data is not equal to expected.",
+             memcmp(vecs[0].iov_base, body + pos, 100) == 0);
+    pos += 100;
+
+    do
+    {
+        status = serf_bucket_read(bkt, SERF_READ_ALL_AVAIL, &data, &len);
+        CuAssert(tc, "Got error during bucket reading.",
+                 !SERF_BUCKET_READ_ERROR(status));
+        CuAssert(tc, "Read more data than expected.", pos + len <= body_len);
+        CuAssert(tc, "Read data is not equal to expected.",
+                 memcmp(data, body + pos, len) == 0);
+        pos += len;
+    } while (!APR_STATUS_IS_EOF(status));
+
+    CuAssertIntEquals(tc, body_len, pos);
+    serf_bucket_destroy(bkt);
+}
+
 static void put_32bit(unsigned char *buf, unsigned long x)
 {
     buf[0] = (unsigned char)(x & 0xFF);
@@ -1561,6 +2389,735 @@ static void test_deflate_4GBplus_buckets(CuTest *tc)
 #undef BUFSIZE
 }
 
+/* Test that the bucket allocator hands out usable memory for all the small
+   size classes, and recycles freed nodes of the same size class. */
+static void test_bucket_allocator_size_classes(CuTest *tc)
+{
+    static const apr_size_t sizes[] = {
+        1, 24, 48, 100, 200, 500, 1000, 2000, 4000, 8000, 20000
+    };
+#define NR_OF_SIZES (sizeof(sizes) / sizeof(sizes[0]))
+    apr_pool_t *test_pool = tc->testBaton;
+    serf_bucket_alloc_t *alloc = serf_bucket_allocator_create(test_pool, NULL,
+                                                              NULL);
+    char *blocks[NR_OF_SIZES];
+    int i;
+
+    for (i = 0; i < NR_OF_SIZES; i++) {
+        blocks[i] = serf_bucket_mem_alloc(alloc, sizes[i]);
+        CuAssertPtrNotNull(tc, blocks[i]);
+        memset(blocks[i], 'a' + i, sizes[i]);
+    }
+
+    /* None of the allocations should have overwritten another. */
+    for (i = 0; i < NR_OF_SIZES; i++) {
+        CuAssertIntEquals(tc, 'a' + i, blocks[i][0]);
+        CuAssertIntEquals(tc, 'a' + i, blocks[i][sizes[i] - 1]);
+    }
+
+    /* A freed node is reused for the next allocation of its size class. */
+    for (i = 0; i < NR_OF_SIZES; i++) {
+        char *old = blocks[i];
+
+        serf_bucket_mem_free(alloc, old);
+        blocks[i] = serf_bucket_mem_alloc(alloc, sizes[i]);
+        if (sizes[i] < 4000)
+            CuAssertPtrEquals(tc, old, blocks[i]);
+    }
+
+    for (i = 0; i < NR_OF_SIZES; i++)
+        serf_bucket_mem_free(alloc, blocks[i]);
+#undef NR_OF_SIZES
+}
+
+/* Test that the bucket allocator keeps track of its memory usage. */
+static void test_bucket_allocator_stats(CuTest *tc)
+{
+    apr_pool_t *test_pool = tc->testBaton;
+    serf_bucket_alloc_t *alloc = serf_bucket_allocator_create(test_pool, NULL,
+                                                              NULL);
+    serf_bucket_alloc_stats_t stats;
+    void *small, *large;
+    apr_size_t peak;
+
+    serf_bucket_allocator_stats(&stats, alloc);
+    CuAssertIntEquals(tc, 0, stats.bytes_in_use);
+    CuAssertIntEquals(tc, 0, stats.allocs_in_use);
+    CuAssertIntEquals(tc, 0, stats.blocks);
+
+    small = serf_bucket_mem_alloc(alloc, 10);
+    large = serf_bucket_mem_alloc(alloc, 20000);
+
+    serf_bucket_allocator_stats(&stats, alloc);
+    CuAssert(tc, "bytes in use too low", stats.bytes_in_use >= 20010);
+    CuAssertIntEquals(tc, 2, stats.allocs_in_use);
+    CuAssertIntEquals(tc, 1, stats.blocks);
+    CuAssertIntEquals(tc, 0, stats.freelist_len);
+    CuAssertIntEquals(tc, 1, stats.large_allocs_in_use);
+    CuAssertIntEquals(tc, 1, stats.large_allocs_total);
+    peak = stats.peak_bytes_in_use;
+    CuAssertIntEquals(tc, stats.bytes_in_use, peak);
+
+    serf_bucket_mem_free(alloc, large);
+    serf_bucket_mem_free(alloc, small);
+
+    serf_bucket_allocator_stats(&stats, alloc);
+    CuAssertIntEquals(tc, 0, stats.bytes_in_use);
+    CuAssertIntEquals(tc, 0, stats.allocs_in_use);
+    CuAssertIntEquals(tc, 1, stats.blocks);
+    CuAssertIntEquals(tc, 1, stats.freelist_len);
+    CuAssertIntEquals(tc, 0, stats.large_allocs_in_use);
+    CuAssertIntEquals(tc, 1, stats.large_allocs_total);
+    CuAssertIntEquals(tc, peak, stats.peak_bytes_in_use);
+}
+
+/* Test that trimming the bucket allocator releases the blocks that are no
+   longer in use, and only those. */
+static void test_bucket_allocator_trim(CuTest *tc)
+{
+#define NR_OF_ALLOCS 1000
+    apr_pool_t *test_pool = tc->testBaton;
+    serf_bucket_alloc_t *alloc = serf_bucket_allocator_create(test_pool, NULL,
+                                                              NULL);
+    serf_bucket_alloc_stats_t stats;
+    char *blocks[NR_OF_ALLOCS];
+    int i;
+
+    for (i = 0; i < NR_OF_ALLOCS; i++) {
+        blocks[i] = serf_bucket_mem_alloc(alloc, 100);
+        memset(blocks[i], 'x', 100);
+    }
+
+    serf_bucket_allocator_stats(&stats, alloc);
+    CuAssert(tc, "expected multiple blocks", stats.blocks > 3);
+
+    /* Keep one allocation of an old block alive. */
+    for (i = 1; i < NR_OF_ALLOCS; i++)
+        serf_bucket_mem_free(alloc, blocks[i]);
+
+    serf_bucket_allocator_trim(alloc);
+
+    serf_bucket_allocator_stats(&stats, alloc);
+    CuAssertIntEquals(tc, 2, stats.blocks);
+    CuAssertIntEquals(tc, 1, stats.allocs_in_use);
+    CuAssertIntEquals(tc, 'x', blocks[0][99]);
+
+    /* The allocator is still usable after trimming. */
+    for (i = 1; i < NR_OF_ALLOCS; i++)
+        blocks[i] = serf_bucket_mem_alloc(alloc, 100);
+    for (i = 0; i < NR_OF_ALLOCS; i++)
+        serf_bucket_mem_free(alloc, blocks[i]);
+
+    serf_bucket_allocator_trim(alloc);
+
+    serf_bucket_allocator_stats(&stats, alloc);
+    CuAssertIntEquals(tc, 1, stats.blocks);
+    CuAssertIntEquals(tc, 0, stats.bytes_in_use);
+#undef NR_OF_ALLOCS
+}
+
+/* Test serf_util_readline with all newline modes, on lines long enough to
+   be scanned in multiple strides. */
+static void test_util_readline_modes(CuTest *tc)
+{
+    const char *line = "0123456789abcdefghijklmnopqrstuvwxyz"
+                       "0123456789abcdefghijklmnopqrstuvwxyz";
+    const char *input;
+    const char *data;
+    apr_size_t len, line_len = strlen(line);
+    int found;
+
+    input = apr_pstrcat(tc->testBaton, line, "\r", line, "\r\n", line, "\n",
+                        line, "\r", NULL);
+
+    /* Only CRLF skips the bare CR. */
+    data = input;
+    len = strlen(input);
+    serf_util_readline(&data, &len, SERF_NEWLINE_CRLF, &found);
+    CuAssertIntEquals(tc, SERF_NEWLINE_CRLF, found);
+    CuAssertPtrEquals(tc, (void *)(input + 2 * line_len + 3), (void *)data);
+
+    /* ANY stops at the bare CR, then finds CRLF, LF and a split CRLF. */
+    data = input;
+    len = strlen(input);
+    serf_util_readline(&data, &len, SERF_NEWLINE_ANY, &found);
+    CuAssertIntEquals(tc, SERF_NEWLINE_CR, found);
+    CuAssertPtrEquals(tc, (void *)(input + line_len + 1), (void *)data);
+    serf_util_readline(&data, &len, SERF_NEWLINE_ANY, &found);
+    CuAssertIntEquals(tc, SERF_NEWLINE_CRLF, found);
+    serf_util_readline(&data, &len, SERF_NEWLINE_ANY, &found);
+    CuAssertIntEquals(tc, SERF_NEWLINE_LF, found);
+    serf_util_readline(&data, &len, SERF_NEWLINE_ANY, &found);
+    CuAssertIntEquals(tc, SERF_NEWLINE_CRLF_SPLIT, found);
+    CuAssertIntEquals(tc, 0, len);
+
+    /* LF only ignores all CR's. */
+    data = input;
+    len = strlen(input);
+    serf_util_readline(&data, &len, SERF_NEWLINE_LF, &found);
+    CuAssertIntEquals(tc, SERF_NEWLINE_LF, found);
+    CuAssertPtrEquals(tc, (void *)(input + 2 * line_len + 3), (void *)data);
+
+    /* CRLF or LF: the CRLF is reported as such, not as LF. */
+    data = input;
+    len = strlen(input);
+    serf_util_readline(&data, &len, SERF_NEWLINE_CRLF | SERF_NEWLINE_LF,
+                       &found);
+    CuAssertIntEquals(tc, SERF_NEWLINE_CRLF, found);
+    serf_util_readline(&data, &len, SERF_NEWLINE_CRLF | SERF_NEWLINE_LF,
+                       &found);
+    CuAssertIntEquals(tc, SERF_NEWLINE_LF, found);
+
+    /* No newline at all. */
+    data = line;
+    len = line_len;
+    serf_util_readline(&data, &len, SERF_NEWLINE_ANY, &found);
+    CuAssertIntEquals(tc, SERF_NEWLINE_NONE, found);
+    CuAssertIntEquals(tc, 0, len);
+    CuAssertPtrEquals(tc, (void *)(line + line_len), (void *)data);
+}
+
+/* Reader for test_dynbuf_adapts_size: returns tb->user_baton_l bytes, or
+   APR_EAGAIN if there are none. */
+static apr_status_t dynbuf_test_reader(void *baton, apr_size_t bufsize,
+                                       char *buf, apr_size_t *len)
+{
+    test_baton_t *tb = baton;
+
+    *len = tb->user_baton_l < bufsize ? tb->user_baton_l : bufsize;
+    memset(buf, 'x', *len);
+    tb->user_baton_l -= *len;
+
+    return tb->user_baton_l ? APR_SUCCESS : APR_EAGAIN;
+}
+
+/* Test that a serf_dynbuf_t grows while reads fill it, and releases a
+   bigger than minimum buffer when the source has no data. */
+static void test_dynbuf_adapts_size(CuTest *tc)
+{
+    test_baton_t tb;
+    apr_pool_t *test_pool = tc->testBaton;
+    serf_bucket_alloc_t *alloc = serf_bucket_allocator_create(test_pool, NULL,
+                                                              NULL);
+    serf_dynbuf_t dynbuf;
+    const char *data;
+    apr_size_t len;
+    apr_status_t status;
+
+    serf_dynbuf_init(&dynbuf, alloc, 1000, 4000);
+    dynbuf.read = dynbuf_test_reader;
+    dynbuf.read_baton = &tb;
+
+    tb.user_baton_l = 100000;
+
+    status = serf_dynbuf_read(&dynbuf, SERF_READ_ALL_AVAIL, &data, &len);
+    CuAssertIntEquals(tc, APR_SUCCESS, status);
+    CuAssertIntEquals(tc, 1000, len);
+    status = serf_dynbuf_read(&dynbuf, SERF_READ_ALL_AVAIL, &data, &len);
+    CuAssertIntEquals(tc, 2000, len);
+    status = serf_dynbuf_read(&dynbuf, SERF_READ_ALL_AVAIL, &data, &len);
+    CuAssertIntEquals(tc, 4000, len);
+    status = serf_dynbuf_read(&dynbuf, SERF_READ_ALL_AVAIL, &data, &len);
+    CuAssertIntEquals(tc, 4000, len);
+
+    /* Drain the source, then find it empty. */
+    tb.user_baton_l = 10;
+    status = serf_dynbuf_read(&dynbuf, SERF_READ_ALL_AVAIL, &data, &len);
+    CuAssertIntEquals(tc, APR_EAGAIN, status);
+    CuAssertIntEquals(tc, 10, len);
+    status = serf_dynbuf_read(&dynbuf, SERF_READ_ALL_AVAIL, &data, &len);
+    CuAssertIntEquals(tc, APR_EAGAIN, status);
+    CuAssertIntEquals(tc, 0, len);
+    CuAssertPtrEquals(tc, NULL, dynbuf.buf);
+
+    /* The next buffer is smaller. */
+    tb.user_baton_l = 100000;
+    status = serf_dynbuf_read(&dynbuf, SERF_READ_ALL_AVAIL, &data, &len);
+    CuAssertIntEquals(tc, APR_SUCCESS, status);
+    CuAssertIntEquals(tc, 2000, len);
+    serf_dynbuf_destroy(&dynbuf);
+
+    /* A buffer of the minimum size is kept while the source is idle. */
+    serf_dynbuf_init(&dynbuf, alloc, 1000, 4000);
+    dynbuf.read = dynbuf_test_reader;
+    dynbuf.read_baton = &tb;
+
+    tb.user_baton_l = 10;
+    status = serf_dynbuf_read(&dynbuf, SERF_READ_ALL_AVAIL, &data, &len);
+    CuAssertIntEquals(tc, APR_EAGAIN, status);
+    CuAssertIntEquals(tc, 10, len);
+    status = serf_dynbuf_read(&dynbuf, SERF_READ_ALL_AVAIL, &data, &len);
+    CuAssertIntEquals(tc, APR_EAGAIN, status);
+    CuAssertIntEquals(tc, 0, len);
+    CuAssert(tc, "Buffer of the minimum size was released", dynbuf.buf != NULL);
+    CuAssertIntEquals(tc, 1000, dynbuf.bufsize);
+
+    serf_dynbuf_destroy(&dynbuf);
+}
+
+/* Test that serf_linebuf_fetch_nocopy returns lines in the source bucket's
+   data when possible, and in the linebuf otherwise. */
+static void test_linebuf_fetch_nocopy(CuTest *tc)
+{
+    serf_bucket_t *mock_bkt;
+    serf_linebuf_t linebuf;
+    const char *line;
+    apr_size_t line_len;
+    apr_status_t status;
+    apr_pool_t *test_pool = tc->testBaton;
+    serf_bucket_alloc_t *alloc = serf_bucket_allocator_create(test_pool, NULL,
+                                                              NULL);
+
+    mockbkt_action actions[]= {
+        { 1, "Content-Type: text/plain" CRLF "Transfer-", APR_SUCCESS },
+        { 1, "Encoding: chunked" CRLF, APR_SUCCESS },
+    };
+
+    mock_bkt = serf_bucket_mock_create(actions, 2, alloc);
+    serf_linebuf_init(&linebuf);
+
+    status = serf_linebuf_fetch_nocopy(&linebuf, mock_bkt, SERF_NEWLINE_ANY,
+                                       &line, &line_len);
+    CuAssertIntEquals(tc, APR_SUCCESS, status);
+    CuAssertIntEquals(tc, SERF_LINEBUF_READY, linebuf.state);
+    CuAssertIntEquals(tc, strlen("Content-Type: text/plain"), line_len);
+    CuAssertIntEquals(tc, line_len, linebuf.used);
+    CuAssert(tc, "line should not have been copied", line != linebuf.line);
+    CuAssert(tc, "unexpected line content",
+             strncmp(line, "Content-Type: text/plain", line_len) == 0);
+
+    status = serf_linebuf_fetch_nocopy(&linebuf, mock_bkt, SERF_NEWLINE_ANY,
+                                       &line, &line_len);
+    CuAssertIntEquals(tc, SERF_LINEBUF_READY, linebuf.state);
+    CuAssertIntEquals(tc, strlen("Transfer-Encoding: chunked"), line_len);
+    CuAssertPtrEquals(tc, linebuf.line, (void *)line);
+    CuAssert(tc, "unexpected line content",
+             strncmp(line, "Transfer-Encoding: chunked", line_len) == 0);
+
+    serf_bucket_destroy(mock_bkt);
+}
+
+/* Reads everything from BKT with read_for_sendfile, and checks that the
+   concatenated headers and file regions match EXPECTED. Returns the number
+   of file regions handed out. */
+static int read_for_sendfile_and_check(CuTest *tc, serf_bucket_t *bkt,
+                                       const char *expected,
+                                       apr_pool_t *pool)
+{
+    apr_size_t expected_len = strlen(expected);
+    char *buf = apr_palloc(pool, expected_len + 1);
+    apr_size_t buf_len = 0;
+    int file_regions = 0;
+    apr_status_t status;
+
+    do {
+        struct iovec vecs[16];
+        apr_hdtr_t hdtr;
+        apr_file_t *file;
+        apr_off_t offset;
+        apr_size_t len;
+        int i;
+
+        hdtr.headers = vecs;
+        hdtr.numheaders = 16;
+        hdtr.trailers = NULL;
+        hdtr.numtrailers = 0;
+
+        status = serf_bucket_read_for_sendfile(bkt, SERF_READ_ALL_AVAIL,
+                                               &hdtr, &file, &offset, &len);
+        CuAssert(tc, "Got error during read_for_sendfile",
+                 !SERF_BUCKET_READ_ERROR(status));
+
+        for (i = 0; i < hdtr.numheaders; i++) {
+            CuAssert(tc, "Read more data than expected",
+                     buf_len + vecs[i].iov_len <= expected_len);
+            memcpy(buf + buf_len, vecs[i].iov_base, vecs[i].iov_len);
+            buf_len += vecs[i].iov_len;
+        }
+        CuAssertIntEquals(tc, 0, hdtr.numtrailers);
+
+        if (file) {
+            apr_size_t read_len = len;
+
+            CuAssert(tc, "Read more data than expected",
+                     buf_len + len <= expected_len);
+            CuAssertIntEquals(tc, APR_SUCCESS,
+                              apr_file_seek(file, APR_SET, &offset));
+            CuAssertIntEquals(tc, APR_SUCCESS,
+                              apr_file_read_full(file, buf + buf_len, len,
+                                                 &read_len));
+            buf_len += read_len;
+            file_regions++;
+        }
+    } while (!APR_STATUS_IS_EOF(status));
+
+    CuAssertIntEquals(tc, (int)expected_len, (int)buf_len);
+    buf[buf_len] = '\0';
+    CuAssertStrEquals(tc, expected, buf);
+
+    return file_regions;
+}
+
+/* Validate that file buckets, also the ones that became mmap buckets, hand
+   out their file through read_for_sendfile, also via an aggregate bucket,
+   and that normal reads and read_for_sendfile can be mixed. */
+static void test_file_buckets_read_for_sendfile(CuTest *tc)
+{
+    apr_pool_t *test_pool = tc->testBaton;
+    serf_bucket_alloc_t *alloc = serf_bucket_allocator_create(test_pool, NULL,
+                                                              NULL);
+    const char *fname = "test_file_buckets_sendfile.tmp";
+    apr_file_t *file;
+    serf_bucket_t *bkt, *aggbkt;
+    const char *body, *data;
+    apr_off_t offset = 0;
+    apr_size_t len;
+    apr_status_t status;
+    int i;
+
+    body = "";
+    for (i = 0; i < 1000; i++)
+        body = apr_psprintf(test_pool, "%s%04d;", body, i);
+
+    status = apr_file_open(&file, fname,
+                           APR_FOPEN_WRITE | APR_FOPEN_CREATE
+                           | APR_FOPEN_TRUNCATE | APR_FOPEN_BINARY,
+                           APR_OS_DEFAULT, test_pool);
+    CuAssertIntEquals(tc, APR_SUCCESS, status);
+    CuAssertIntEquals(tc, APR_SUCCESS,
+                      apr_file_write_full(file, body, strlen(body), NULL));
+    apr_file_close(file);
+
+    status = apr_file_open(&file, fname, APR_FOPEN_READ | APR_FOPEN_BINARY,
+                           APR_OS_DEFAULT, test_pool);
+    CuAssertIntEquals(tc, APR_SUCCESS, status);
+
+    /* A request-like stream: some data, then the file. */
+    aggbkt = serf_bucket_aggregate_create(alloc);
+    bkt = SERF_BUCKET_SIMPLE_STRING("HEAD" CRLF, alloc);
+    serf_bucket_aggregate_append(aggbkt, bkt);
+    serf_bucket_aggregate_append(aggbkt, serf_bucket_file_create(file,
+                                                                 alloc));
+    CuAssert(tc, "No file handed out",
+             read_for_sendfile_and_check(tc, aggbkt,
+                                         apr_pstrcat(test_pool, "HEAD" CRLF,
+                                                     body, NULL),
+                                         test_pool) > 0);
+    serf_bucket_destroy(aggbkt);
+
+    /* Read a part first; the rest still goes out as a file. Keep the
+       buffer small, so that not all of it is buffered by that read. */
+    CuAssertIntEquals(tc, APR_SUCCESS, apr_file_seek(file, APR_SET, &offset));
+    bkt = serf_bucket_file_create(file, alloc);
+    serf_bucket_file_set_buffer_size(bkt, 64, 64);
+    status = serf_bucket_read(bkt, 10, &data, &len);
+    CuAssertIntEquals(tc, APR_SUCCESS, status);
+    CuAssertIntEquals(tc, 10, (int)len);
+    CuAssert(tc, "Unexpected data", strncmp(body, data, len) == 0);
+
+    read_for_sendfile_and_check(tc, bkt, body + 10, test_pool);
+    serf_bucket_destroy(bkt);
+
+    apr_file_close(file);
+    apr_file_remove(fname, test_pool);
+}
+
+/* Validate header lookups through the index, also after it had to grow or
+   was dropped, and iterating over the values of a repeated header. */
+static void test_bucket_header_index(CuTest *tc)
+{
+    apr_pool_t *test_pool = tc->testBaton;
+    serf_bucket_alloc_t *alloc = serf_bucket_allocator_create(test_pool, NULL,
+                                                              NULL);
+    serf_bucket_t *hdrs = serf_bucket_headers_create(alloc);
+    serf_bucket_headers_iter_t iter;
+    const char *val, *joined;
+    apr_size_t len;
+    int i;
+
+    CuAssertPtrEquals(tc, NULL, (void *)serf_bucket_headers_get(hdrs, "Foo"));
+
+    serf_bucket_headers_setn(hdrs, "Foo", "bar");
+    serf_bucket_headers_setn(hdrs, "Connection", "close");
+    serf_bucket_headers_setn(hdrs, "Set-Cookie", "a=1");
+
+    /* The first lookup builds the index; add enough names to grow it. */
+    CuAssertStrEquals(tc, "bar", serf_bucket_headers_get(hdrs, "foo"));
+    for (i = 0; i < 40; i++) {
+        const char *name = apr_psprintf(test_pool, "X-Header-%d", i);
+        serf_bucket_headers_setc(hdrs, name, name);
+    }
+    serf_bucket_headers_setn(hdrs, "set-cookie", "b=2");
+    serf_bucket_headers_setn(hdrs, "SET-COOKIE", "c=3");
+
+    for (i = 0; i < 40; i++) {
+        const char *name = apr_psprintf(test_pool, "x-header-%d", i);
+        CuAssertStrEquals(tc, apr_psprintf(test_pool, "X-Header-%d", i),
+                          serf_bucket_headers_get(hdrs, name));
+    }
+    CuAssertStrEquals(tc, "close", serf_bucket_headers_get(hdrs, "CONNECTION"));
+    CuAssertPtrEquals(tc, NULL,
+                      (void *)serf_bucket_headers_get(hdrs, "X-Header-40"));
+
+    /* Joined values are built once. */
+    joined = serf_bucket_headers_get(hdrs, "Set-Cookie");
+    CuAssertStrEquals(tc, "a=1,b=2,c=3", joined);
+    CuAssertPtrEquals(tc, (void *)joined,
+                      (void *)serf_bucket_headers_get(hdrs, "set-cookie"));
+
+    /* The iterator returns the separate values, in order. */
+    val = serf_bucket_headers_iter_first(&iter, hdrs, "set-cookie", &len);
+    CuAssertStrEquals(tc, "a=1", val);
+    CuAssertIntEquals(tc, 3, (int)len);
+    CuAssertStrEquals(tc, "b=2", serf_bucket_headers_iter_next(&iter, NULL));
+    CuAssertStrEquals(tc, "c=3", serf_bucket_headers_iter_next(&iter, &len));
+    CuAssertPtrEquals(tc, NULL,
+                      (void *)serf_bucket_headers_iter_next(&iter, &len));
+    CuAssertPtrEquals(tc, NULL,
+                      (void *)serf_bucket_headers_iter_first(&iter, hdrs,
+                                                             "Cookie", &len));
+
+    /* A new value replaces the joined value. */
+    serf_bucket_headers_setn(hdrs, "Set-Cookie", "d=4");
+    CuAssertStrEquals(tc, "a=1,b=2,c=3,d=4",
+                      serf_bucket_headers_get(hdrs, "Set-Cookie"));
+
+    /* Removing headers rebuilds the index; new headers still end up in the
+       right place. */
+    serf__bucket_headers_remove(hdrs, "Set-Cookie");
+    CuAssertPtrEquals(tc, NULL,
+                      (void *)serf_bucket_headers_get(hdrs, "Set-Cookie"));
+    serf_bucket_headers_setn(hdrs, "Set-Cookie", "e=5");
+    CuAssertStrEquals(tc, "e=5", serf_bucket_headers_get(hdrs, "Set-Cookie"));
+    CuAssertStrEquals(tc, "bar", serf_bucket_headers_get(hdrs, "Foo"));
+
+    serf_bucket_destroy(hdrs);
+}
+
+/* A joined value stays valid while other names are set, which grows the
+   index, or removed. */
+static void test_bucket_header_joined_lifetime(CuTest *tc)
+{
+    apr_pool_t *test_pool = tc->testBaton;
+    serf_bucket_alloc_t *alloc = serf_bucket_allocator_create(test_pool, NULL,
+                                                              NULL);
+    serf_bucket_t *hdrs = serf_bucket_headers_create(alloc);
+    const char *joined;
+    int i;
+
+    serf_bucket_headers_setn(hdrs, "X-Multi", "first-value");
+    serf_bucket_headers_setn(hdrs, "X-Multi", "second-value");
+    serf_bucket_headers_setn(hdrs, "X-Other", "other");
+
+    joined = serf_bucket_headers_get(hdrs, "X-Multi");
+    CuAssertStrEquals(tc, "first-value,second-value", joined);
+
+    /* More than fit the smallest index. */
+    for (i = 0; i < 20; i++) {
+        const char *name = apr_psprintf(test_pool, "X-Header-%d", i);
+        serf_bucket_headers_setc(hdrs, name, "ZZZZZZZZZZZZZZZZZZZZZZZZ");
+    }
+    CuAssertStrEquals(tc, "first-value,second-value", joined);
+    CuAssertPtrEquals(tc, (void *)joined,
+                      (void *)serf_bucket_headers_get(hdrs, "x-multi"));
+
+    serf__bucket_headers_remove(hdrs, "X-Other");
+    serf_bucket_headers_setc(hdrs, "X-Header-20", "ZZZZZZZZZZZZZZZZZZZZZZZZ");
+    CuAssertStrEquals(tc, "first-value,second-value", joined);
+    CuAssertPtrEquals(tc, (void *)joined,
+                      (void *)serf_bucket_headers_get(hdrs, "X-Multi"));
+
+    /* Setting the name itself again does change the value. */
+    serf_bucket_headers_setn(hdrs, "X-Multi", "third-value");
+    CuAssertStrEquals(tc, "first-value,second-value,third-value",
+                      serf_bucket_headers_get(hdrs, "X-Multi"));
+
+    serf_bucket_destroy(hdrs);
+}
+
+/* Recognize the well-known header names in any case, and look them up by
+   token. */
+static void test_bucket_header_tokens(CuTest *tc)
+{
+    apr_pool_t *test_pool = tc->testBaton;
+    serf_bucket_alloc_t *alloc = serf_bucket_allocator_create(test_pool, NULL,
+                                                              NULL);
+    serf_bucket_t *hdrs = serf_bucket_headers_create(alloc);
+
+    CuAssertIntEquals(tc, SERF__HDR_CONTENT_LENGTH,
+                      serf__header_token("Content-Length", 14));
+    CuAssertIntEquals(tc, SERF__HDR_CONTENT_LENGTH,
+                      serf__header_token("content-LENGTH", 14));
+    CuAssertIntEquals(tc, SERF__HDR_TE, serf__header_token("te", 2));
+    CuAssertIntEquals(tc, SERF__HDR_WWW_AUTHENTICATE,
+                      serf__header_token("WWW-Authenticate", 16));
+    CuAssertIntEquals(tc, SERF__HDR_PROXY_AUTHENTICATION_INFO,
+                      serf__header_token("Proxy-Authentication-Info", 25));
+    CuAssertIntEquals(tc, SERF__HDR_ETAG, serf__header_token("Etag", 4));
+
+    /* Names that share the slot of a well-known name. */
+    CuAssertIntEquals(tc, SERF__HDR_UNKNOWN, serf__header_token("Dote", 4));
+    CuAssertIntEquals(tc, SERF__HDR_UNKNOWN,
+                      serf__header_token("Content-Lengths", 15));
+    CuAssertIntEquals(tc, SERF__HDR_UNKNOWN,
+                      serf__header_token("Content-Length", 13));
+    CuAssertIntEquals(tc, SERF__HDR_UNKNOWN, serf__header_token("", 0));
+    CuAssertIntEquals(tc, SERF__HDR_UNKNOWN, serf__header_token("X-Foo", 5));
+
+    serf_bucket_headers_setc(hdrs, "content-length", "10");
+    serf_bucket_headers_setc(hdrs, "Connection", "keep-alive");
+    serf_bucket_headers_setc(hdrs, "Connectiom", "other");
+    serf_bucket_headers_setc(hdrs, "CONNECTION", "close");
+
+    CuAssertStrEquals(tc, "10",
+                      serf__bucket_headers_get_token(
+                          hdrs, SERF__HDR_CONTENT_LENGTH));
+    CuAssertStrEquals(tc, "10",
+                      serf_bucket_headers_get(hdrs, "Content-Length"));
+    CuAssertStrEquals(tc, "keep-alive,close",
+                      serf__bucket_headers_get_token(hdrs,
+                                                     SERF__HDR_CONNECTION));
+    CuAssertStrEquals(tc, "other",
+                      serf_bucket_headers_get(hdrs, "connectiom"));
+    CuAssertPtrEquals(tc, NULL,
+                      (void *)serf__bucket_headers_get_token(
+                                  hdrs, SERF__HDR_TRANSFER_ENCODING));
+
+    /* The names are written out as they were set. */
+    read_and_check_bucket(tc, hdrs,
+                          "content-length: 10" CRLF
+                          "Connection: keep-alive" CRLF
+                          "Connectiom: other" CRLF
+                          "CONNECTION: close" CRLF
+                          CRLF);
+
+    serf_bucket_destroy(hdrs);
+}
+
+/* Read all headers with one read_iovec call, either copied into one
+   buffer or as separate fragments. */
+static void test_bucket_headers_read_iovec(CuTest *tc)
+{
+    apr_pool_t *test_pool = tc->testBaton;
+    serf_bucket_alloc_t *alloc = serf_bucket_allocator_create(test_pool, NULL,
+                                                              NULL);
+    serf_bucket_t *hdrs;
+    struct iovec vecs[64];
+    const char *expected, *big;
+    apr_status_t status;
+    int vecs_used;
+    int i;
+
+    /* Small headers come back in one vec. */
+    hdrs = serf_bucket_headers_create(alloc);
+    serf_bucket_headers_setn(hdrs, "Host", "localhost");
+    serf_bucket_headers_setn(hdrs, "User-Agent", "serf");
+    serf_bucket_headers_setn(hdrs, "X-Foo", "bar");
+    expected = "Host: localhost" CRLF "User-Agent: serf" CRLF
+               "X-Foo: bar" CRLF CRLF;
+
+    status = serf_bucket_read_iovec(hdrs, SERF_READ_ALL_AVAIL, 64, vecs,
+                                    &vecs_used);
+    CuAssertIntEquals(tc, APR_EOF, status);
+    CuAssertIntEquals(tc, 1, vecs_used);
+    CuAssertIntEquals(tc, (int)strlen(expected), (int)vecs[0].iov_len);
+    CuAssert(tc, "unexpected headers",
+             strncmp(expected, vecs[0].iov_base, vecs[0].iov_len) == 0);
+    serf_bucket_destroy(hdrs);
+
+    /* Once reading started, the rest is returned too. */
+    hdrs = serf_bucket_headers_create(alloc);
+    serf_bucket_headers_setn(hdrs, "Host", "localhost");
+    serf_bucket_headers_setn(hdrs, "X-Foo", "bar");
+    {
+        const char *data;
+        apr_size_t len;
+
+        status = serf_bucket_read(hdrs, 2, &data, &len);
+        CuAssertIntEquals(tc, APR_SUCCESS, status);
+    }
+    read_and_check_bucket(tc, hdrs,
+                          "st: localhost" CRLF "X-Foo: bar" CRLF CRLF);
+    serf_bucket_destroy(hdrs);
+
+    /* Large headers are handed out in place, if there are enough vecs. */
+    big = apr_pstrcat(test_pool,
+                      apr_psprintf(test_pool, "%05000d", 0),
+                      apr_psprintf(test_pool, "%05000d", 1), NULL);
+    hdrs = serf_bucket_headers_create(alloc);
+    for (i = 0; i < 3; i++)
+        serf_bucket_headers_setn(hdrs, "X-Big", big);
+
+    status = serf_bucket_read_iovec(hdrs, SERF_READ_ALL_AVAIL, 64, vecs,
+                                    &vecs_used);
+    CuAssertIntEquals(tc, APR_EOF, status);
+    CuAssertIntEquals(tc, 13, vecs_used);
+    CuAssertPtrEquals(tc, (void *)big, vecs[2].iov_base);
+    CuAssertIntEquals(tc, 10000, (int)vecs[10].iov_len);
+    serf_bucket_destroy(hdrs);
+
+    /* ... and in pieces otherwise. */
+    hdrs = serf_bucket_headers_create(alloc);
+    for (i = 0; i < 3; i++)
+        serf_bucket_headers_setn(hdrs, "X-Big", big);
+
+    status = serf_bucket_read_iovec(hdrs, SERF_READ_ALL_AVAIL, 4, vecs,
+                                    &vecs_used);
+    CuAssertIntEquals(tc, APR_SUCCESS, status);
+    CuAssertIntEquals(tc, 4, vecs_used);
+    read_and_check_bucket(tc, hdrs,
+                          apr_pstrcat(test_pool,
+                                      "X-Big: ", big, CRLF,
+                                      "X-Big: ", big, CRLF, CRLF, NULL));
+    serf_bucket_destroy(hdrs);
+}
+
+/* Create requests from a template, with and without overrides. */
+static void test_request_template(CuTest *tc)
+{
+    apr_pool_t *test_pool = tc->testBaton;
+    serf_bucket_alloc_t *alloc = serf_bucket_allocator_create(test_pool, NULL,
+                                                              NULL);
+    serf_request_template_t *tmpl;
+    serf_bucket_t *hdrs, *bkt, *body;
+
+    hdrs = serf_bucket_headers_create(alloc);
+    serf_bucket_headers_setn(hdrs, "Host", "localhost:12345");
+    serf_bucket_headers_setn(hdrs, "Accept", "*/*");
+    tmpl = serf_request_template_create("GET", "/poll", hdrs, test_pool);
+    serf_bucket_destroy(hdrs);
+
+    bkt = serf_bucket_request_create_from_template(tmpl, NULL, NULL, alloc);
+    read_and_check_bucket(tc, bkt,
+                          "GET /poll HTTP/1.1" CRLF
+                          "Host: localhost:12345" CRLF
+                          "Accept: */*" CRLF
+                          CRLF);
+    serf_bucket_destroy(bkt);
+
+    body = SERF_BUCKET_SIMPLE_STRING("abc", alloc);
+    bkt = serf_bucket_request_create_from_template(tmpl, "/poll?id=2", body,
+                                                   alloc);
+    serf_bucket_request_set_CL(bkt, 3);
+    serf_bucket_headers_setn(serf_bucket_request_get_headers(bkt),
+                             "X-Id", "2");
+    read_and_check_bucket(tc, bkt,
+                          "GET /poll?id=2 HTTP/1.1" CRLF
+                          "Host: localhost:12345" CRLF
+                          "Accept: */*" CRLF
+                          "X-Id: 2" CRLF
+                          "Content-Length: 3" CRLF
+                          CRLF
+                          "abc");
+    serf_bucket_destroy(bkt);
+
+    /* Without headers. */
+    tmpl = serf_request_template_create("HEAD", "/", NULL, test_pool);
+    bkt = serf_bucket_request_create_from_template(tmpl, NULL, NULL, alloc);
+    read_and_check_bucket(tc, bkt, "HEAD / HTTP/1.1" CRLF CRLF);
+    serf_bucket_destroy(bkt);
+}
+
 CuSuite *test_buckets(void)
 {
     CuSuite *suite = CuSuiteNew();
@@ -1571,6 +3128,10 @@ CuSuite *test_buckets(void)
     SUITE_ADD_TEST(suite, test_response_bucket_read);
     SUITE_ADD_TEST(suite, test_response_bucket_headers);
     SUITE_ADD_TEST(suite, test_response_bucket_chunked_read);
+    SUITE_ADD_TEST(suite, test_response_bucket_header_blocks);
+    SUITE_ADD_TEST(suite, test_bucket_headers_alloc_usable);
+    SUITE_ADD_TEST(suite, test_response_bucket_buffered_head);
+    SUITE_ADD_TEST(suite, test_response_bucket_interim);
     SUITE_ADD_TEST(suite, test_response_body_too_small_cl);
     SUITE_ADD_TEST(suite, test_response_body_too_small_chunked);
     SUITE_ADD_TEST(suite, test_response_body_chunked_no_crlf);
@@ -1581,12 +3142,30 @@ CuSuite *test_buckets(void)
     SUITE_ADD_TEST(suite, test_iovec_buckets);
     SUITE_ADD_TEST(suite, test_aggregate_buckets);
     SUITE_ADD_TEST(suite, test_aggregate_bucket_readline);
+    SUITE_ADD_TEST(suite, test_aggregate_bucket_gather);
     SUITE_ADD_TEST(suite, test_header_buckets);
     SUITE_ADD_TEST(suite, test_linebuf_crlf_split);
     SUITE_ADD_TEST(suite, test_random_eagain_in_response);
     SUITE_ADD_TEST(suite, test_dechunk_buckets);
+    SUITE_ADD_TEST(suite, test_dechunk_buckets_iovec);
+    SUITE_ADD_TEST(suite, test_chunk_buckets);
     SUITE_ADD_TEST(suite, test_response_no_body_expected);
     SUITE_ADD_TEST(suite, test_deflate_buckets);
+    SUITE_ADD_TEST(suite, test_deflate_buckets_buffer_size);
+    SUITE_ADD_TEST(suite, test_deflate_encode_buckets);
+    SUITE_ADD_TEST(suite, test_decompress_buckets);
+    SUITE_ADD_TEST(suite, test_bucket_allocator_size_classes);
+    SUITE_ADD_TEST(suite, test_bucket_allocator_stats);
+    SUITE_ADD_TEST(suite, test_bucket_allocator_trim);
+    SUITE_ADD_TEST(suite, test_util_readline_modes);
+    SUITE_ADD_TEST(suite, test_dynbuf_adapts_size);
+    SUITE_ADD_TEST(suite, test_linebuf_fetch_nocopy);
+    SUITE_ADD_TEST(suite, test_file_buckets_read_for_sendfile);
+    SUITE_ADD_TEST(suite, test_bucket_header_index);
+    SUITE_ADD_TEST(suite, test_bucket_header_joined_lifetime);
+    SUITE_ADD_TEST(suite, test_bucket_header_tokens);
+    SUITE_ADD_TEST(suite, test_bucket_headers_read_iovec);
+    SUITE_ADD_TEST(suite, test_request_template);
 #if 0
     /* This test for issue #152 takes a lot of time generating 4GB+ of random
        data so it's disabled by default. */
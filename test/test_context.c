@@ -1002,6 +1002,501 @@ static void test_connection_large_request(CuTest *tc)
                                        test_pool);
 }
 
+/* Validate that a connection hands the cleared pool and bucket allocator of
+   a finished request to the next request. */
+static void test_connection_reuses_respools(CuTest *tc)
+{
+    test_baton_t *tb;
+    handler_baton_t handler_ctx[2];
+    const int num_requests = sizeof(handler_ctx)/sizeof(handler_ctx[0]);
+    serf__respool_t *spare;
+    serf_bucket_alloc_stats_t stats, spare_stats;
+    apr_status_t status;
+
+    test_server_message_t message_list[] = {
+        {CHUNKED_REQUEST(1, "1")},
+        {CHUNKED_REQUEST(1, "2")},
+    };
+
+    test_server_action_t action_list[] = {
+        {SERVER_RESPOND, CHUNKED_EMPTY_RESPONSE},
+        {SERVER_RESPOND, CHUNKED_EMPTY_RESPONSE},
+    };
+
+    apr_pool_t *test_pool = tc->testBaton;
+
+    /* Set up a test context with a server */
+    status = test_http_server_setup(&tb,
+                                    message_list, num_requests,
+                                    action_list, num_requests, 0, NULL,
+                                    test_pool);
+    CuAssertIntEquals(tc, APR_SUCCESS, status);
+
+    create_new_request(tb, &handler_ctx[0], "GET", "/", 1);
+    status = test_helper_run_requests_no_check(tc, tb, 1, &handler_ctx[0],
+                                               test_pool);
+    CuAssertIntEquals(tc, APR_SUCCESS, status);
+
+    CuAssertIntEquals(tc, 1, tb->connection->num_spare_respools);
+    spare = tb->connection->spare_respools;
+
+    create_new_request(tb, &handler_ctx[1], "GET", "/", 2);
+    status = test_helper_run_requests_no_check(tc, tb, 1, &handler_ctx[1],
+                                               test_pool);
+    CuAssertIntEquals(tc, APR_SUCCESS, status);
+    CuAssertIntEquals(tc, num_requests, tb->handled_requests->nelts);
+
+    /* The second request used, and gave back, the first one's pool. */
+    CuAssertIntEquals(tc, 1, tb->connection->num_spare_respools);
+    CuAssertPtrEquals(tc, spare, tb->connection->spare_respools);
+
+    /* The context's statistics include the spare's allocator. */
+    serf_context_allocator_stats(&stats, tb->context);
+    serf_bucket_allocator_stats(&spare_stats, spare->allocator);
+    CuAssert(tc, "spare allocator missing from context stats",
+             stats.blocks > spare_stats.blocks);
+}
+
+/* Counts the response pools cleared after setup_request_root(). */
+static apr_status_t count_cleared_respool(void *baton)
+{
+    test_baton_t *tb = baton;
+
+    tb->user_baton_l++;
+
+    return APR_SUCCESS;
+}
+
+static apr_status_t setup_request_root(serf_request_t *request,
+                                       void *setup_baton,
+                                       serf_bucket_t **req_bkt,
+                                       serf_response_acceptor_t *acceptor,
+                                       void **acceptor_baton,
+                                       serf_response_handler_t *handler,
+                                       void **handler_baton,
+                                       apr_pool_t *pool)
+{
+    handler_baton_t *ctx = setup_baton;
+    apr_pool_t *alloc_pool;
+    apr_status_t status;
+
+    status = setup_request(request, setup_baton, req_bkt, acceptor,
+                           acceptor_baton, handler, handler_baton, pool);
+    if (status)
+        return status;
+
+    /* Whatever buckets allocate in the pool of the request's allocator,
+       like the uri below, must go away with the request. */
+    alloc_pool = serf_bucket_allocator_get_pool(serf_request_get_alloc(request));
+    if (alloc_pool != pool)
+        return APR_EGENERAL;
+    apr_pool_cleanup_register(alloc_pool, ctx->tb, count_cleared_respool,
+                              apr_pool_cleanup_null);
+
+    serf_bucket_request_set_root(*req_bkt, "http://localhost:12345");
+
+    return APR_SUCCESS;
+}
+
+/* Validate that the pool of a request's bucket allocator is cleared once
+   the request is done, also when the allocator is reused by later requests
+   on the same connection. */
+static void test_connection_respool_allocator_pool(CuTest *tc)
+{
+    test_baton_t *tb;
+    handler_baton_t handler_ctx[3];
+    const int num_requests = sizeof(handler_ctx)/sizeof(handler_ctx[0]);
+    apr_status_t status;
+    int i;
+
+    test_server_message_t message_list[] = {
+        {CHUNKED_REQUEST_URI("http://localhost:12345/index", 1, "1")},
+        {CHUNKED_REQUEST_URI("http://localhost:12345/index", 1, "2")},
+        {CHUNKED_REQUEST_URI("http://localhost:12345/index", 1, "3")},
+    };
+
+    test_server_action_t action_list[] = {
+        {SERVER_RESPOND, CHUNKED_EMPTY_RESPONSE},
+        {SERVER_RESPOND, CHUNKED_EMPTY_RESPONSE},
+        {SERVER_RESPOND, CHUNKED_EMPTY_RESPONSE},
+    };
+
+    apr_pool_t *test_pool = tc->testBaton;
+
+    /* Set up a test context with a server */
+    status = test_http_server_setup(&tb,
+                                    message_list, num_requests,
+                                    action_list, num_requests, 0, NULL,
+                                    test_pool);
+    CuAssertIntEquals(tc, APR_SUCCESS, status);
+    tb->user_baton_l = 0;
+
+    /* One request at a time, so that each reuses the allocator of the
+       previous one. */
+    for (i = 0; i < num_requests; i++) {
+        setup_handler(tb, &handler_ctx[i], "GET", "/index", i + 1, NULL);
+        serf_connection_request_create(tb->connection,
+                                       setup_request_root,
+                                       &handler_ctx[i]);
+        status = test_helper_run_requests_no_check(tc, tb, 1, &handler_ctx[i],
+                                                   test_pool);
+        CuAssertIntEquals(tc, APR_SUCCESS, status);
+
+        /* The request's pool, with the uri and anything else allocated by
+           its buckets, was cleared when it was done. */
+        CuAssertIntEquals(tc, i + 1, tb->user_baton_l);
+        CuAssertIntEquals(tc, 1, tb->connection->num_spare_respools);
+    }
+    CuAssertIntEquals(tc, num_requests, tb->handled_requests->nelts);
+}
+
+static apr_status_t setup_request_file_body(serf_request_t *request,
+                                            void *setup_baton,
+                                            serf_bucket_t **req_bkt,
+                                            serf_response_acceptor_t *acceptor,
+                                            void **acceptor_baton,
+                                            serf_response_handler_t *handler,
+                                            void **handler_baton,
+                                            apr_pool_t *pool)
+{
+    handler_baton_t *ctx = setup_baton;
+    serf_bucket_alloc_t *alloc = serf_request_get_alloc(request);
+    apr_file_t *file;
+    apr_finfo_t finfo;
+    apr_status_t status;
+
+    status = apr_file_open(&file, ctx->tb->user_baton,
+                           APR_FOPEN_READ | APR_FOPEN_BINARY,
+                           APR_OS_DEFAULT, pool);
+    if (status)
+        return status;
+    status = apr_file_info_get(&finfo, APR_FINFO_SIZE, file);
+    if (status)
+        return status;
+
+    *req_bkt = serf_request_bucket_request_create(request,
+                                                  ctx->method, ctx->path,
+                                                  serf_bucket_file_create(
+                                                      file, alloc),
+                                                  alloc);
+    serf_bucket_request_set_CL(*req_bkt, finfo.size);
+
+    APR_ARRAY_PUSH(ctx->sent_requests, int) = ctx->req_id;
+
+    *acceptor = ctx->acceptor;
+    *acceptor_baton = ctx;
+    *handler = ctx->handler;
+    *handler_baton = ctx;
+
+    return APR_SUCCESS;
+}
+
+/* Validate that a file request body, which the connection passes to
+   sendfile on plain connections, arrives intact after the headers. */
+static void test_connection_file_request_body(CuTest *tc)
+{
+    test_baton_t *tb;
+    handler_baton_t handler_ctx[1];
+    const int num_requests = sizeof(handler_ctx)/sizeof(handler_ctx[0]);
+    const char *fname = "test_connection_file_body.tmp";
+    const char *body;
+    apr_file_t *file;
+    apr_status_t status;
+    int i;
+
+    test_server_message_t message_list[1];
+    test_server_action_t action_list[] = {
+        {SERVER_RESPOND, CHUNKED_EMPTY_RESPONSE},
+    };
+
+    apr_pool_t *test_pool = tc->testBaton;
+
+    body = "";
+    for (i = 0; i < 500; i++)
+        body = apr_psprintf(test_pool, "%s%04d;", body, i);
+
+    status = apr_file_open(&file, fname,
+                           APR_FOPEN_WRITE | APR_FOPEN_CREATE
+                           | APR_FOPEN_TRUNCATE | APR_FOPEN_BINARY,
+                           APR_OS_DEFAULT, test_pool);
+    CuAssertIntEquals(tc, APR_SUCCESS, status);
+    CuAssertIntEquals(tc, APR_SUCCESS,
+                      apr_file_write_full(file, body, strlen(body), NULL));
+    apr_file_close(file);
+
+    message_list[0].text = apr_psprintf(test_pool,
+                                        "PUT / HTTP/1.1" CRLF
+                                        "Host: localhost:12345" CRLF
+                                        "Content-Length: %d" CRLF
+                                        CRLF
+                                        "%s", (int)strlen(body), body);
+
+    /* Set up a test context with a server */
+    status = test_http_server_setup(&tb,
+                                    message_list, num_requests,
+                                    action_list, num_requests, 0, NULL,
+                                    test_pool);
+    CuAssertIntEquals(tc, APR_SUCCESS, status);
+    tb->user_baton = (void *)fname;
+
+    setup_handler(tb, &handler_ctx[0], "PUT", "/", 1, NULL);
+    serf_connection_request_create(tb->connection,
+                                   setup_request_file_body,
+                                   &handler_ctx[0]);
+
+    test_helper_run_requests_expect_ok(tc, tb, num_requests, handler_ctx,
+                                       test_pool);
+
+    apr_file_remove(fname, test_pool);
+}
+
+static apr_status_t handle_response_to_file(serf_request_t *request,
+                                            serf_bucket_t *response,
+                                            void *handler_baton,
+                                            apr_pool_t *pool)
+{
+    handler_baton_t *ctx = handler_baton;
+    apr_uint64_t written;
+    apr_status_t status;
+
+    if (! response)
+        return APR_SUCCESS;
+
+    status = serf_bucket_response_body_to_file(response,
+                                               ctx->tb->user_baton,
+                                               &written);
+    if (APR_STATUS_IS_EOF(status)) {
+        APR_ARRAY_PUSH(ctx->handled_requests, int) = ctx->req_id;
+        ctx->done = TRUE;
+    }
+
+    return status;
+}
+
+/* Validate that serf_bucket_response_body_to_file writes both a plain
+   Content-Length body, which can be spliced from the socket, and a chunked
+   body to a file. */
+static void test_connection_response_body_to_file(CuTest *tc)
+{
+    test_baton_t *tb;
+    handler_baton_t handler_ctx[2];
+    const int num_requests = sizeof(handler_ctx)/sizeof(handler_ctx[0]);
+    const char *fname = "test_connection_body_to_file.tmp";
+    const char *body, *expected;
+    apr_file_t *file;
+    apr_off_t offset = 0;
+    apr_size_t len;
+    char *buf;
+    apr_status_t status;
+    int i;
+
+    test_server_message_t message_list[] = {
+        {CHUNKED_REQUEST(1, "1")},
+        {CHUNKED_REQUEST(1, "2")},
+    };
+    test_server_action_t action_list[2];
+
+    apr_pool_t *test_pool = tc->testBaton;
+
+    /* Large enough to not be read completely with the headers. */
+    buf = apr_palloc(test_pool, 40000 * 6 + 1);
+    for (i = 0; i < 40000; i++)
+        sprintf(buf + i * 6, "%05d;", i);
+    body = buf;
+
+    action_list[0].kind = SERVER_RESPOND;
+    action_list[0].text = apr_psprintf(test_pool,
+                                       "HTTP/1.1 200 OK" CRLF
+                                       "Content-Length: %d" CRLF
+                                       CRLF
+                                       "%s", (int)strlen(body), body);
+    action_list[1].kind = SERVER_RESPOND;
+    action_list[1].text = CHUNKED_RESPONSE(5, "chunk");
+    expected = apr_pstrcat(test_pool, body, "chunk", NULL);
+
+    status = apr_file_open(&file, fname,
+                           APR_FOPEN_READ | APR_FOPEN_WRITE | APR_FOPEN_CREATE
+                           | APR_FOPEN_TRUNCATE | APR_FOPEN_BINARY,
+                           APR_OS_DEFAULT, test_pool);
+    CuAssertIntEquals(tc, APR_SUCCESS, status);
+
+    /* Set up a test context with a server */
+    status = test_http_server_setup(&tb,
+                                    message_list, num_requests,
+                                    action_list, num_requests, 0, NULL,
+                                    test_pool);
+    CuAssertIntEquals(tc, APR_SUCCESS, status);
+    tb->user_baton = file;
+
+    create_new_request_with_resp_hdlr(tb, &handler_ctx[0], "GET", "/", 1,
+                                      handle_response_to_file);
+    create_new_request_with_resp_hdlr(tb, &handler_ctx[1], "GET", "/", 2,
+                                      handle_response_to_file);
+
+    test_helper_run_requests_expect_ok(tc, tb, num_requests, handler_ctx,
+                                       test_pool);
+
+    len = strlen(expected);
+    buf = apr_pcalloc(test_pool, len + 2);
+    CuAssertIntEquals(tc, APR_SUCCESS, apr_file_seek(file, APR_SET, &offset));
+    status = apr_file_read_full(file, buf, len + 1, &len);
+    CuAssertIntEquals(tc, APR_EOF, status);
+    CuAssertIntEquals(tc, (int)strlen(expected), (int)len);
+    CuAssertStrEquals(tc, expected, buf);
+
+    apr_file_close(file);
+    apr_file_remove(fname, test_pool);
+}
+
+#define EXPECT_CONTINUE_BODY "0123456789abcdef"
+#define EXPECT_CONTINUE_HEAD "PUT / HTTP/1.1" CRLF\
+                             "Host: localhost:12345" CRLF\
+                             "Expect: 100-continue" CRLF\
+                             "Content-Length: 16" CRLF\
+                             CRLF
+
+static apr_status_t setup_request_expect_continue(
+    serf_request_t *request,
+    void *setup_baton,
+    serf_bucket_t **req_bkt,
+    serf_response_acceptor_t *acceptor,
+    void **acceptor_baton,
+    serf_response_handler_t *handler,
+    void **handler_baton,
+    apr_pool_t *pool)
+{
+    handler_baton_t *ctx = setup_baton;
+    serf_bucket_alloc_t *alloc = serf_request_get_alloc(request);
+    serf_bucket_t *body;
+
+    body = SERF_BUCKET_SIMPLE_STRING(EXPECT_CONTINUE_BODY, alloc);
+    *req_bkt = serf_request_bucket_request_create(request,
+                                                  ctx->method, ctx->path,
+                                                  body, alloc);
+    serf_bucket_request_set_CL(*req_bkt, strlen(EXPECT_CONTINUE_BODY));
+    serf_bucket_request_set_expect_continue(*req_bkt);
+
+    APR_ARRAY_PUSH(ctx->sent_requests, int) = ctx->req_id;
+
+    *acceptor = ctx->acceptor;
+    *acceptor_baton = ctx;
+    *handler = ctx->handler;
+    *handler_baton = ctx;
+
+    return APR_SUCCESS;
+}
+
+/* Send a request with Expect: 100-continue; the body follows the server's
+   100 Continue. */
+static void test_connection_expect_continue(CuTest *tc)
+{
+    test_baton_t *tb;
+    handler_baton_t handler_ctx[1];
+    apr_status_t status;
+
+    test_server_message_t message_list[] = {
+        {EXPECT_CONTINUE_HEAD},
+        {EXPECT_CONTINUE_BODY},
+    };
+    test_server_action_t action_list[] = {
+        {SERVER_RESPOND, "HTTP/1.1 100 Continue" CRLF CRLF},
+        {SERVER_RESPOND, CHUNKED_EMPTY_RESPONSE},
+    };
+
+    apr_pool_t *test_pool = tc->testBaton;
+
+    /* Set up a test context with a server */
+    status = test_http_server_setup(&tb,
+                                    message_list, 2,
+                                    action_list, 2, 0, NULL,
+                                    test_pool);
+    CuAssertIntEquals(tc, APR_SUCCESS, status);
+
+    /* Don't let the timeout send the body. */
+    serf_connection_set_expect_continue_timeout(tb->connection,
+                                                apr_time_from_sec(60));
+
+    setup_handler(tb, &handler_ctx[0], "PUT", "/", 1, NULL);
+    serf_connection_request_create(tb->connection,
+                                   setup_request_expect_continue,
+                                   &handler_ctx[0]);
+
+    test_helper_run_requests_expect_ok(tc, tb, 1, handler_ctx, test_pool);
+}
+
+/* A final response instead of 100 Continue means the body is never sent.
+   The test server fails on any data it didn't expect. */
+static void test_connection_expect_continue_rejected(CuTest *tc)
+{
+    test_baton_t *tb;
+    handler_baton_t handler_ctx[1];
+    apr_status_t status;
+
+    test_server_message_t message_list[] = {
+        {EXPECT_CONTINUE_HEAD},
+    };
+    test_server_action_t action_list[] = {
+        {SERVER_RESPOND, "HTTP/1.1 413 Request Entity Too Large" CRLF
+                         "Content-Length: 0" CRLF
+                         CRLF},
+    };
+
+    apr_pool_t *test_pool = tc->testBaton;
+
+    /* Set up a test context with a server */
+    status = test_http_server_setup(&tb,
+                                    message_list, 1,
+                                    action_list, 1, 0, NULL,
+                                    test_pool);
+    CuAssertIntEquals(tc, APR_SUCCESS, status);
+
+    serf_connection_set_expect_continue_timeout(tb->connection,
+                                                apr_time_from_sec(60));
+
+    setup_handler(tb, &handler_ctx[0], "PUT", "/", 1, NULL);
+    serf_connection_request_create(tb->connection,
+                                   setup_request_expect_continue,
+                                   &handler_ctx[0]);
+
+    test_helper_run_requests_expect_ok(tc, tb, 1, handler_ctx, test_pool);
+}
+
+/* A server that ignores the expectation gets the body after the timeout. */
+static void test_connection_expect_continue_timeout(CuTest *tc)
+{
+    test_baton_t *tb;
+    handler_baton_t handler_ctx[1];
+    apr_status_t status;
+
+    test_server_message_t message_list[] = {
+        {EXPECT_CONTINUE_HEAD},
+        {EXPECT_CONTINUE_BODY},
+    };
+    test_server_action_t action_list[] = {
+        {SERVER_RECV, NULL},
+        {SERVER_RESPOND, CHUNKED_EMPTY_RESPONSE},
+    };
+
+    apr_pool_t *test_pool = tc->testBaton;
+
+    /* Set up a test context with a server */
+    status = test_http_server_setup(&tb,
+                                    message_list, 2,
+                                    action_list, 2, 0, NULL,
+                                    test_pool);
+    CuAssertIntEquals(tc, APR_SUCCESS, status);
+
+    serf_connection_set_expect_continue_timeout(tb->connection,
+                                                apr_time_from_msec(100));
+
+    setup_handler(tb, &handler_ctx[0], "PUT", "/", 1, NULL);
+    serf_connection_request_create(tb->connection,
+                                   setup_request_expect_continue,
+                                   &handler_ctx[0]);
+
+    test_helper_run_requests_expect_ok(tc, tb, 1, handler_ctx, test_pool);
+}
+
 /*****************************************************************************
  * SSL handshake tests
  *****************************************************************************/
@@ -1710,6 +2205,331 @@ static void test_ssl_client_certificate(CuTest *tc)
     CuAssertTrue(tc, tb->result_flags & TEST_RESULT_CLIENT_CERTPWCB_CALLED);
 }
 
+/* Set up the ssl context of a connection from the serf_ssl_config_t in
+   tb->user_baton. */
+static apr_status_t
+https_shared_config_conn_setup(apr_socket_t *skt,
+                               serf_bucket_t **input_bkt,
+                               serf_bucket_t **output_bkt,
+                               void *setup_baton,
+                               apr_pool_t *pool)
+{
+    test_baton_t *tb = setup_baton;
+    serf_ssl_config_t *config = tb->user_baton;
+
+    tb->ssl_context = serf_ssl_context_create(config, tb->bkt_alloc);
+
+    *input_bkt = serf_bucket_socket_create(skt, tb->bkt_alloc);
+    *input_bkt = serf_bucket_ssl_decrypt_create(*input_bkt, tb->ssl_context,
+                                                tb->bkt_alloc);
+
+    if (output_bkt) {
+        *output_bkt = serf_bucket_ssl_encrypt_create(*output_bkt,
+                                                     tb->ssl_context,
+                                                     tb->bkt_alloc);
+    }
+
+    if (tb->server_cert_cb)
+        serf_ssl_server_cert_callback_set(tb->ssl_context,
+                                          tb->server_cert_cb,
+                                          tb);
+
+    serf_ssl_set_hostname(tb->ssl_context, "localhost");
+
+    return APR_SUCCESS;
+}
+
+static apr_status_t
+shared_config_client_cert_conn_setup(apr_socket_t *skt,
+                                     serf_bucket_t **input_bkt,
+                                     serf_bucket_t **output_bkt,
+                                     void *setup_baton,
+                                     apr_pool_t *pool)
+{
+    test_baton_t *tb = setup_baton;
+    apr_status_t status;
+
+    status = https_shared_config_conn_setup(skt, input_bkt, output_bkt,
+                                            setup_baton, pool);
+    if (status)
+        return status;
+
+    /* No cache pools, so that the callbacks are asked on every
+       connection. */
+    serf_ssl_client_cert_provider_set(tb->ssl_context,
+                                      client_cert_cb,
+                                      tb,
+                                      NULL);
+
+    serf_ssl_client_cert_password_set(tb->ssl_context,
+                                      client_cert_pw_cb,
+                                      tb,
+                                      NULL);
+
+    return APR_SUCCESS;
+}
+
+/* Create a serf_ssl_config_t that trusts our self-signed root ca. */
+static serf_ssl_config_t *create_trusting_ssl_config(CuTest *tc,
+                                                     apr_pool_t *pool)
+{
+    serf_ssl_config_t *config;
+    serf_ssl_certificate_t *rootcacert;
+
+    config = serf_ssl_config_create(pool);
+
+    CuAssertIntEquals(tc, APR_SUCCESS,
+                      serf_ssl_load_cert_file(&rootcacert,
+                                              "test/server/serfrootcacert.pem",
+                                              pool));
+    CuAssertIntEquals(tc, APR_SUCCESS,
+                      serf_ssl_config_trust_cert(config, rootcacert));
+
+    return config;
+}
+
+/* Validate that connections using a shared configuration validate the
+   server certificate with the CA trusted through that configuration. */
+static void test_ssl_shared_config(CuTest *tc)
+{
+    test_baton_t *tb;
+    handler_baton_t handler_ctx[2];
+    const int num_requests = sizeof(handler_ctx)/sizeof(handler_ctx[0]);
+    apr_status_t status;
+    test_server_message_t message_list[] = {
+        {CHUNKED_REQUEST(1, "1")},
+        {CHUNKED_REQUEST(1, "2")},
+    };
+
+    test_server_action_t action_list[] = {
+        {SERVER_RESPOND, CHUNKED_EMPTY_RESPONSE},
+        {SERVER_RESPOND, CHUNKED_EMPTY_RESPONSE},
+    };
+
+    /* Set up a test context with a server */
+    apr_pool_t *test_pool = tc->testBaton;
+    status = test_https_server_setup(&tb,
+                                     message_list, num_requests,
+                                     action_list, num_requests, 0,
+                                     https_shared_config_conn_setup,
+                                     "test/server/serfserverkey.pem",
+                                     server_certs,
+                                     NULL, /* no client cert */
+                                     ssl_server_cert_cb_expect_allok,
+                                     test_pool);
+    CuAssertIntEquals(tc, APR_SUCCESS, status);
+    tb->user_baton = create_trusting_ssl_config(tc, test_pool);
+
+    create_new_request(tb, &handler_ctx[0], "GET", "/", 1);
+    status = test_helper_run_requests_no_check(tc, tb, 1, &handler_ctx[0],
+                                               test_pool);
+    CuAssertIntEquals(tc, APR_SUCCESS, status);
+    CuAssertTrue(tc, tb->result_flags & TEST_RESULT_SERVERCERTCB_CALLED);
+
+    /* The second connection validates the certificate with the same
+       configuration. */
+    tb->result_flags = 0;
+    use_new_connection(tb, test_pool);
+
+    create_new_request(tb, &handler_ctx[1], "GET", "/", 2);
+    status = test_helper_run_requests_no_check(tc, tb, 1, &handler_ctx[1],
+                                               test_pool);
+    CuAssertIntEquals(tc, APR_SUCCESS, status);
+    CuAssertTrue(tc, tb->result_flags & TEST_RESULT_SERVERCERTCB_CALLED);
+    CuAssertIntEquals(tc, num_requests, tb->handled_requests->nelts);
+}
+
+/* Validate that each connection using a shared configuration asks its own
+   client cert provider for a certificate. */
+static void test_ssl_shared_config_client_cert_provider(CuTest *tc)
+{
+    test_baton_t *tb;
+    handler_baton_t handler_ctx[2];
+    const int num_requests = sizeof(handler_ctx)/sizeof(handler_ctx[0]);
+    apr_status_t status;
+    test_server_message_t message_list[] = {
+        {CHUNKED_REQUEST(1, "1")},
+        {CHUNKED_REQUEST(1, "2")},
+    };
+
+    test_server_action_t action_list[] = {
+        {SERVER_RESPOND, CHUNKED_EMPTY_RESPONSE},
+        {SERVER_RESPOND, CHUNKED_EMPTY_RESPONSE},
+    };
+
+    /* Set up a test context with a server */
+    apr_pool_t *test_pool = tc->testBaton;
+    status = test_https_server_setup(&tb,
+                                     message_list, num_requests,
+                                     action_list, num_requests, 0,
+                                     shared_config_client_cert_conn_setup,
+                                     "test/server/serfserverkey.pem",
+                                     all_server_certs,
+                                     "Serf Client",
+                                     NULL, /* No server cert callback */
+                                     test_pool);
+    CuAssertIntEquals(tc, APR_SUCCESS, status);
+    tb->user_baton = create_trusting_ssl_config(tc, test_pool);
+
+    create_new_request(tb, &handler_ctx[0], "GET", "/", 1);
+    status = test_helper_run_requests_no_check(tc, tb, 1, &handler_ctx[0],
+                                               test_pool);
+    CuAssertIntEquals(tc, APR_SUCCESS, status);
+    CuAssertTrue(tc, tb->result_flags & TEST_RESULT_CLIENT_CERTCB_CALLED);
+
+    /* The certificate of the first connection is not reused. */
+    tb->result_flags = 0;
+    use_new_connection(tb, test_pool);
+
+    create_new_request(tb, &handler_ctx[1], "GET", "/", 2);
+    status = test_helper_run_requests_no_check(tc, tb, 1, &handler_ctx[1],
+                                               test_pool);
+    CuAssertIntEquals(tc, APR_SUCCESS, status);
+    CuAssertTrue(tc, tb->result_flags & TEST_RESULT_CLIENT_CERTCB_CALLED);
+    CuAssertIntEquals(tc, num_requests, tb->handled_requests->nelts);
+}
+
+/* Validate that the client certificate set on a shared configuration is
+   sent without asking the connection. */
+static void test_ssl_shared_config_client_cert(CuTest *tc)
+{
+    test_baton_t *tb;
+    handler_baton_t handler_ctx[1];
+    const int num_requests = sizeof(handler_ctx)/sizeof(handler_ctx[0]);
+    serf_ssl_config_t *config;
+    apr_status_t status;
+    test_server_message_t message_list[] = {
+        {CHUNKED_REQUEST(1, "1")},
+    };
+
+    test_server_action_t action_list[] = {
+        {SERVER_RESPOND, CHUNKED_EMPTY_RESPONSE},
+    };
+
+    /* Set up a test context with a server */
+    apr_pool_t *test_pool = tc->testBaton;
+    status = test_https_server_setup(&tb,
+                                     message_list, num_requests,
+                                     action_list, num_requests, 0,
+                                     shared_config_client_cert_conn_setup,
+                                     "test/server/serfserverkey.pem",
+                                     all_server_certs,
+                                     "Serf Client",
+                                     NULL, /* No server cert callback */
+                                     test_pool);
+    CuAssertIntEquals(tc, APR_SUCCESS, status);
+
+    config = create_trusting_ssl_config(tc, test_pool);
+    CuAssertIntEquals(tc, SERF_ERROR_SSL_CERT_FAILED,
+                      serf_ssl_config_set_client_cert(
+                          config, "test/server/serfclientcert.p12",
+                          "wrong password", test_pool));
+    CuAssertIntEquals(tc, APR_SUCCESS,
+                      serf_ssl_config_set_client_cert(
+                          config, "test/server/serfclientcert.p12",
+                          "serftest", test_pool));
+    tb->user_baton = config;
+
+    create_new_request(tb, &handler_ctx[0], "GET", "/", 1);
+
+    test_helper_run_requests_expect_ok(tc, tb, num_requests,
+                                       handler_ctx, test_pool);
+
+    CuAssertTrue(tc, !(tb->result_flags & TEST_RESULT_CLIENT_CERTCB_CALLED));
+}
+
+static apr_status_t
+session_cache_conn_setup(apr_socket_t *skt,
+                         serf_bucket_t **input_bkt,
+                         serf_bucket_t **output_bkt,
+                         void *setup_baton,
+                         apr_pool_t *pool)
+{
+    test_baton_t *tb = setup_baton;
+    apr_status_t status;
+
+    status = https_shared_config_conn_setup(skt, input_bkt, output_bkt,
+                                            setup_baton, pool);
+    if (status)
+        return status;
+
+    return serf_ssl_use_session_cache(tb->ssl_context, "localhost",
+                                      SERV_PORT);
+}
+
+/* Run two connections, one after the other, with a shared configuration
+   that caches sessions for MAX_AGE. Returns whether the second one resumed
+   the session of the first. */
+static int run_session_cache_connections(CuTest *tc,
+                                         apr_interval_time_t max_age)
+{
+    test_baton_t *tb;
+    handler_baton_t handler_ctx[2];
+    const int num_requests = sizeof(handler_ctx)/sizeof(handler_ctx[0]);
+    serf_ssl_config_t *config;
+    apr_status_t status;
+    test_server_message_t message_list[] = {
+        {CHUNKED_REQUEST(1, "1")},
+        {CHUNKED_REQUEST(1, "2")},
+    };
+
+    test_server_action_t action_list[] = {
+        {SERVER_RESPOND, CHUNKED_EMPTY_RESPONSE},
+        {SERVER_RESPOND, CHUNKED_EMPTY_RESPONSE},
+    };
+
+    /* Set up a test context with a server */
+    apr_pool_t *test_pool = tc->testBaton;
+    status = test_https_server_setup(&tb,
+                                     message_list, num_requests,
+                                     action_list, num_requests, 0,
+                                     session_cache_conn_setup,
+                                     "test/server/serfserverkey.pem",
+                                     server_certs,
+                                     NULL, /* no client cert */
+                                     ssl_server_cert_cb_expect_allok,
+                                     test_pool);
+    CuAssertIntEquals(tc, APR_SUCCESS, status);
+
+    config = create_trusting_ssl_config(tc, test_pool);
+    CuAssertIntEquals(tc, APR_SUCCESS,
+                      serf_ssl_config_cache_sessions(config, 10, max_age));
+    tb->user_baton = config;
+
+    create_new_request(tb, &handler_ctx[0], "GET", "/", 1);
+    status = test_helper_run_requests_no_check(tc, tb, 1, &handler_ctx[0],
+                                               test_pool);
+    CuAssertIntEquals(tc, APR_SUCCESS, status);
+    CuAssertIntEquals(tc, 0, serf_ssl_session_reused(tb->ssl_context));
+
+    /* Make sure even a short MAX_AGE has passed. */
+    apr_sleep(apr_time_from_msec(10));
+
+    use_new_connection(tb, test_pool);
+
+    create_new_request(tb, &handler_ctx[1], "GET", "/", 2);
+    status = test_helper_run_requests_no_check(tc, tb, 1, &handler_ctx[1],
+                                               test_pool);
+    CuAssertIntEquals(tc, APR_SUCCESS, status);
+    CuAssertIntEquals(tc, num_requests, tb->handled_requests->nelts);
+
+    return serf_ssl_session_reused(tb->ssl_context);
+}
+
+/* Validate that a second connection with a shared configuration resumes
+   the session of the first one from the session cache. */
+static void test_ssl_session_cache(CuTest *tc)
+{
+    CuAssertTrue(tc, run_session_cache_connections(tc, 0));
+}
+
+/* Validate that a session older than the max_age of the session cache is
+   not offered to the server. */
+static void test_ssl_session_cache_expired(CuTest *tc)
+{
+    CuAssertIntEquals(tc, 0, run_session_cache_connections(tc, 1));
+}
+
 /* Validate that the expired certificate is reported as failure in the
    callback. */
 static void test_ssl_expired_server_cert(CuTest *tc)
@@ -2278,6 +3098,13 @@ CuSuite *test_context(void)
     SUITE_ADD_TEST(suite, test_connection_large_response);
     SUITE_ADD_TEST(suite, test_connection_large_request);
     SUITE_ADD_TEST(suite, test_connection_userinfo_in_url);
+    SUITE_ADD_TEST(suite, test_connection_reuses_respools);
+    SUITE_ADD_TEST(suite, test_connection_respool_allocator_pool);
+    SUITE_ADD_TEST(suite, test_connection_file_request_body);
+    SUITE_ADD_TEST(suite, test_connection_response_body_to_file);
+    SUITE_ADD_TEST(suite, test_connection_expect_continue);
+    SUITE_ADD_TEST(suite, test_connection_expect_continue_rejected);
+    SUITE_ADD_TEST(suite, test_connection_expect_continue_timeout);
     SUITE_ADD_TEST(suite, test_ssl_handshake);
     SUITE_ADD_TEST(suite, test_ssl_trust_rootca);
     SUITE_ADD_TEST(suite, test_ssl_application_rejects_cert);
@@ -2288,6 +3115,11 @@ CuSuite *test_context(void)
     SUITE_ADD_TEST(suite, test_ssl_large_response);
     SUITE_ADD_TEST(suite, test_ssl_large_request);
     SUITE_ADD_TEST(suite, test_ssl_client_certificate);
+    SUITE_ADD_TEST(suite, test_ssl_shared_config);
+    SUITE_ADD_TEST(suite, test_ssl_shared_config_client_cert_provider);
+    SUITE_ADD_TEST(suite, test_ssl_shared_config_client_cert);
+    SUITE_ADD_TEST(suite, test_ssl_session_cache);
+    SUITE_ADD_TEST(suite, test_ssl_session_cache_expired);
     SUITE_ADD_TEST(suite, test_ssl_expired_server_cert);
     SUITE_ADD_TEST(suite, test_ssl_future_server_cert);
     SUITE_ADD_TEST(suite, test_setup_ssltunnel);
@@ -81,6 +81,96 @@ static void test_ssl_load_cert_file(CuTest *tc)
     CuAssertPtrNotNull(tc, cert);
 }
 
+/* Test that ssl contexts can share a configuration, and that it stays
+   valid for them after its pool is gone. */
+static void test_ssl_config_shared(CuTest *tc)
+{
+    serf_bucket_t *bkt1, *bkt2, *stream;
+    serf_ssl_context_t *ssl_context1, *ssl_context2;
+    serf_ssl_certificate_t *cert = NULL;
+    serf_ssl_config_t *config;
+    apr_pool_t *config_pool;
+    apr_status_t status;
+
+    apr_pool_t *test_pool = tc->testBaton;
+    serf_bucket_alloc_t *alloc = serf_bucket_allocator_create(test_pool, NULL,
+                                                              NULL);
+
+    apr_pool_create(&config_pool, test_pool);
+    config = serf_ssl_config_create(config_pool);
+    CuAssertPtrNotNull(tc, config);
+
+    status = serf_ssl_load_cert_file(&cert,
+                                     get_ca_file(test_pool,
+                                                 "test/serftestca.pem"),
+                                     test_pool);
+    CuAssertIntEquals(tc, APR_SUCCESS, status);
+    CuAssertIntEquals(tc, APR_SUCCESS,
+                      serf_ssl_config_trust_cert(config, cert));
+    CuAssertIntEquals(tc, APR_SUCCESS,
+                      serf_ssl_config_use_default_certificates(config));
+
+    ssl_context1 = serf_ssl_context_create(config, alloc);
+    ssl_context2 = serf_ssl_context_create(config, alloc);
+    CuAssertPtrNotNull(tc, ssl_context1);
+    CuAssertTrue(tc, ssl_context1 != ssl_context2);
+
+    stream = SERF_BUCKET_SIMPLE_STRING("", alloc);
+    bkt1 = serf_bucket_ssl_decrypt_create(stream, ssl_context1, alloc);
+    CuAssertPtrEquals(tc, ssl_context1,
+                      serf_bucket_ssl_decrypt_context_get(bkt1));
+
+    stream = SERF_BUCKET_SIMPLE_STRING("", alloc);
+    bkt2 = serf_bucket_ssl_decrypt_create(stream, ssl_context2, alloc);
+    CuAssertPtrEquals(tc, ssl_context2,
+                      serf_bucket_ssl_decrypt_context_get(bkt2));
+
+    /* The ssl contexts hold on to the shared SSL_CTX. */
+    apr_pool_destroy(config_pool);
+
+    CuAssertIntEquals(tc, APR_SUCCESS,
+                      serf_ssl_set_hostname(ssl_context1, "localhost"));
+    serf_bucket_destroy(bkt1);
+    serf_bucket_destroy(bkt2);
+}
+
+/* Test setting up the session cache of a shared configuration. */
+static void test_ssl_session_cache(CuTest *tc)
+{
+    serf_bucket_t *bkt, *stream;
+    serf_ssl_context_t *ssl_context;
+    serf_ssl_config_t *config;
+
+    apr_pool_t *test_pool = tc->testBaton;
+    serf_bucket_alloc_t *alloc = serf_bucket_allocator_create(test_pool, NULL,
+                                                              NULL);
+
+    config = serf_ssl_config_create(test_pool);
+    CuAssertIntEquals(tc, APR_SUCCESS,
+                      serf_ssl_config_cache_sessions(config, 16,
+                                                     apr_time_from_sec(600)));
+    /* Changing the size replaces the cache. */
+    CuAssertIntEquals(tc, APR_SUCCESS,
+                      serf_ssl_config_cache_sessions(config, 4, 0));
+
+    ssl_context = serf_ssl_context_create(config, alloc);
+    stream = SERF_BUCKET_SIMPLE_STRING("", alloc);
+    bkt = serf_bucket_ssl_decrypt_create(stream, ssl_context, alloc);
+
+    CuAssertIntEquals(tc, APR_SUCCESS,
+                      serf_ssl_set_hostname(ssl_context, "localhost"));
+    CuAssertIntEquals(tc, APR_SUCCESS,
+                      serf_ssl_use_session_cache(ssl_context, "localhost",
+                                                 12345));
+    /* Nothing to resume yet. */
+    CuAssertIntEquals(tc, 0, serf_ssl_session_reused(ssl_context));
+
+    serf_bucket_destroy(bkt);
+
+    CuAssertIntEquals(tc, APR_SUCCESS,
+                      serf_ssl_config_cache_sessions(config, 0, 0));
+}
+
 /* Test that reading the subject from a custom CA certificate file works. */
 static void test_ssl_cert_subject(CuTest *tc)
 {
@@ -287,6 +377,8 @@ CuSuite *test_ssl(void)
 
     SUITE_ADD_TEST(suite, test_ssl_init);
     SUITE_ADD_TEST(suite, test_ssl_load_cert_file);
+    SUITE_ADD_TEST(suite, test_ssl_config_shared);
+    SUITE_ADD_TEST(suite, test_ssl_session_cache);
     SUITE_ADD_TEST(suite, test_ssl_cert_subject);
     SUITE_ADD_TEST(suite, test_ssl_cert_issuer);
     SUITE_ADD_TEST(suite, test_ssl_cert_certificate);